@@ -0,0 +1,31 @@
+#!/bin/sh
+# History search benchmark: writes N synthetic commands to a fresh history
+# and reports wall time and the shell's peak RSS for each query, one fresh
+# shell per run. The first trigram search builds and saves the index; the
+# ones after it load the saved index.
+#
+#   make && sh bench/history_bench.sh [commands]
+
+SHELL_BIN=$(cd "$(dirname "${SHELL_BIN:-./shell.out}")" && pwd)/$(basename "${SHELL_BIN:-./shell.out}")
+COUNT=${1:-2000000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+awk -v n="$COUNT" 'BEGIN {
+    split("git make ls cd grep vim cat echo ssh docker reveal hop find python3", cmd, " ")
+    split("src include build -la main.c shell.c --all origin master README test foo bar /tmp x", arg, " ")
+    srand(1)
+    for (i = 0; i < n; i++) {
+        line = cmd[int(rand() * 14) + 1]
+        for (j = int(rand() * 4); j >= 0; j--) line = line " " arg[int(rand() * 15) + 1]
+        printf "%s %x\n", line, int(rand() * 1048576)
+    }
+}' > "$DIR/.shell_history"
+
+cd "$DIR" || exit 1
+printf '%-28s %10s %10s\n' "query" "seconds" "peak RSS"
+for query in "search git master 8" "search git master 8" "prefix docker src" "search cat src" "prefix g" "search 7d"; do
+    # 'time' reports the shell's own usage for a builtin
+    "$SHELL_BIN" -c "time log $query > /dev/null" 2>&1 |
+        awk -v q="log $query" '$1 == "1" { printf "%-28s %10s %10s\n", q, $2, $5 }'
+done
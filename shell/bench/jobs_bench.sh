@@ -0,0 +1,40 @@
+#!/bin/sh
+# Job table stress test: starts N background jobs from one batch script,
+# kills them all at once and times how long the shell takes to reap and
+# report every one of them.
+#
+#   make && sh bench/jobs_bench.sh [jobs]
+
+SHELL_BIN=${SHELL_BIN:-./shell.out}
+JOBS=${1:-10000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# The shell has no quoting, so the killer is a script; its parent is the
+# shell. The kill is timed from inside it, so starting it is not counted,
+# and reaping from when every signal has been sent.
+echo "date +%s%N > $DIR/tk; pkill -KILL -P \$PPID -x sleep; date +%s%N > $DIR/t1" > "$DIR/kill.sh"
+
+{
+    echo "date +%s%N > $DIR/t0"
+    i=0
+    while [ "$i" -lt "$JOBS" ]; do
+        echo "sleep 1000 &"
+        i=$((i + 1))
+    done
+    echo "date +%s%N > $DIR/tl"
+    echo "sh $DIR/kill.sh"
+    echo "wait"
+    echo "date +%s%N > $DIR/t2"
+} > "$DIR/script"
+
+"$SHELL_BIN" < "$DIR/script" > "$DIR/out"
+
+reaped=$(grep -c 'exited abnormally' "$DIR/out")
+awk -v jobs="$JOBS" -v reaped="$reaped" \
+    -v t0="$(cat "$DIR/t0")" -v tl="$(cat "$DIR/tl")" -v tk="$(cat "$DIR/tk")" -v t1="$(cat "$DIR/t1")" -v t2="$(cat "$DIR/t2")" 'BEGIN {
+    printf "%d jobs, %d reaped\n", jobs, reaped
+    printf "launch %8.3f s %10.1f us/job\n", (tl - t0) / 1e9, (tl - t0) / 1e3 / jobs
+    printf "kill   %8.3f s %10.1f us/job\n", (t1 - tk) / 1e9, (t1 - tk) / 1e3 / jobs
+    printf "reap   %8.3f s %10.1f us/job\n", (t2 - t1) / 1e9, (t2 - t1) / 1e3 / jobs
+}'
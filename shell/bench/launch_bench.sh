@@ -0,0 +1,34 @@
+#!/bin/sh
+# Launch latency benchmark: runs N short external commands from one batch
+# script under each 'set launch' mode and reports the best of three runs.
+#
+#   make && sh bench/launch_bench.sh [commands]
+
+SHELL_BIN=${SHELL_BIN:-./shell.out}
+COUNT=${1:-5000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+# A path with a '/' skips both the builtin 'true' and the PATH lookup
+i=0
+while [ "$i" -lt "$COUNT" ]; do
+    echo "/bin/true"
+    i=$((i + 1))
+done > "$DIR/body"
+
+printf '%-8s %10s %12s\n' "launch" "seconds" "us/command"
+for mode in fork spawn zygote; do
+    { echo "set launch $mode"; cat "$DIR/body"; } > "$DIR/script"
+    best=
+    for run in 1 2 3; do
+        start=$(date +%s%N)
+        "$SHELL_BIN" "$DIR/script" > /dev/null
+        end=$(date +%s%N)
+        ns=$((end - start))
+        if [ -z "$best" ] || [ "$ns" -lt "$best" ]; then
+            best=$ns
+        fi
+    done
+    awk -v mode="$mode" -v ns="$best" -v n="$COUNT" \
+        'BEGIN { printf "%-8s %10.3f %12.1f\n", mode, ns / 1e9, ns / 1e3 / n }'
+done
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Pipe capacity benchmark: streams N GB through a two-stage pipeline in the
+# shell under each pipesize setting and reports the best of three runs.
+#
+#   make && sh bench/pipe_bench.sh [gigabytes]
+
+SHELL_BIN=${SHELL_BIN:-./shell.out}
+GB=${1:-4}
+
+printf '%-10s %10s %10s\n' "pipesize" "seconds" "MB/s"
+for mode in default 256K 1M auto; do
+    best=
+    for run in 1 2 3; do
+        start=$(date +%s%N)
+        "$SHELL_BIN" -c "set pipesize $mode; dd if=/dev/zero bs=1M count=$((GB * 1024)) status=none | wc -c" > /dev/null
+        end=$(date +%s%N)
+        ns=$((end - start))
+        if [ -z "$best" ] || [ "$ns" -lt "$best" ]; then
+            best=$ns
+        fi
+    done
+    awk -v mode="$mode" -v ns="$best" -v gb="$GB" \
+        'BEGIN { s = ns / 1e9; printf "%-10s %10.3f %10.1f\n", mode, s, gb * 1024 / s }'
+done
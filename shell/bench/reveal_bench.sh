@@ -0,0 +1,27 @@
+#!/bin/sh
+# Large-directory listing benchmark: fills a directory with N empty files
+# and reports wall time and the shell's peak RSS for each reveal mode, one
+# fresh shell per run.
+#
+#   make && sh bench/reveal_bench.sh [entries] [dir]
+
+SHELL_BIN=${SHELL_BIN:-./shell.out}
+COUNT=${1:-1000000}
+if [ -n "$2" ]; then
+    DIR=$2 # kept, so later runs can reuse it
+    mkdir -p "$DIR"
+else
+    DIR=$(mktemp -d)
+    trap 'rm -rf "$DIR"' EXIT
+fi
+
+if [ "$(ls -f "$DIR" | wc -l)" -lt "$COUNT" ]; then
+    seq -f "$DIR/file-%.0f" 1 "$COUNT" | xargs touch
+fi
+
+printf '%-14s %10s %10s\n' "mode" "seconds" "peak RSS"
+for flags in "" "-U" "-l" "-lU"; do
+    # 'time' reports the shell's own usage for a builtin
+    "$SHELL_BIN" -c "time reveal $flags $DIR > /dev/null" 2>&1 |
+        awk -v mode="reveal $flags" '$1 == "1" { printf "%-14s %10s %10s\n", mode, $2, $5 }'
+done
@@ -0,0 +1,89 @@
+// Tokenizer classifier microbenchmark: runs every scan_impl the CPU supports
+// over the same generated multi-megabyte script and reports throughput.
+//
+//   make bench && ./bench/scan_bench.out [megabytes]
+
+#include "scan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Generated command lines: mostly words and long paths, some operators.
+static char *make_input(size_t size) {
+    static const char *words[] = {
+        "ls", "-la", "grep", "pattern", "|", "sort", "-u", ">", "out.txt", "&", ";",
+        "/var/log/application/service-name/archive/2024/01/15/events.log",
+        "cat", "<", "input.dat", "wc", "-l", ">>", "summary.txt",
+        "/usr/local/share/generated/batch/job-000123/artifacts/result.json",
+    };
+    size_t nwords = sizeof(words) / sizeof(words[0]);
+    char *buf = malloc(size + 1);
+    if (buf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    size_t used = 0;
+    unsigned seed = 12345;
+    while (used < size) {
+        seed = seed * 1103515245u + 12345u;
+        const char *w = words[(seed >> 16) % nwords];
+        size_t n = strlen(w);
+        if (used + n + 1 > size) break;
+        memcpy(buf + used, w, n);
+        used += n;
+        buf[used++] = ((seed >> 8) % 16 == 0) ? '\n' : ' ';
+    }
+    memset(buf + used, ' ', size - used);
+    buf[size] = '\0';
+    return buf;
+}
+
+// The tokenizer's access pattern: skip blanks, then consume a name or one
+// operator byte.
+static size_t count_tokens(const scan_impl *impl, const char *s, size_t len) {
+    scan_cursor c;
+    scan_start(&c, impl, s, len);
+    size_t i = 0, tokens = 0;
+    while (i < len) {
+        i = scan_skip_space(&c, i);
+        if (i == len) break;
+        size_t end = scan_name_end(&c, i);
+        i = (end == i) ? i + 1 : end;
+        tokens++;
+    }
+    return tokens;
+}
+
+int main(int argc, char *argv[]) {
+    size_t mb = (argc > 1) ? (size_t)atoi(argv[1]) : 64;
+    size_t size = mb * 1024 * 1024;
+    char *input = make_input(size);
+
+    const scan_impl *const *impls = scan_all();
+    size_t expected = 0;
+    printf("%-8s %12s %10s %10s\n", "impl", "tokens", "seconds", "MB/s");
+    for (int i = 0; impls[i] != NULL; i++) {
+        double best = 1e9;
+        size_t tokens = 0;
+        for (int rep = 0; rep < 5; rep++) {
+            double start = now_sec();
+            tokens = count_tokens(impls[i], input, size);
+            double elapsed = now_sec() - start;
+            if (elapsed < best) best = elapsed;
+        }
+        if (i == 0) expected = tokens;
+        printf("%-8s %12zu %10.4f %10.1f%s\n", impls[i]->name, tokens, best, mb / best,
+               tokens == expected ? "" : "  MISMATCH");
+    }
+    printf("selected: %s\n", scan_best()->name);
+    free(input);
+    return 0;
+}
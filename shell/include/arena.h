@@ -0,0 +1,34 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// A chunked bump allocator. Everything allocated from an arena is released
+// together by arena_reset() or arena_free(); individual frees do not exist.
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+} arena_chunk;
+
+typedef struct {
+    arena_chunk *head;
+    size_t chunk_size;    // minimum chunk size, 0 for the default
+    size_t allocations;   // arena_alloc() calls served
+    size_t chunk_mallocs; // malloc() calls made to back them
+    size_t resets;
+} arena;
+
+// Backs everything parsed from one command line; main() resets it once per
+// loop iteration.
+extern arena line_arena;
+
+void *arena_alloc(arena *a, size_t size);
+// Unaligned, for byte strings packed back to back.
+void *arena_alloc_packed(arena *a, size_t size);
+char *arena_strndup(arena *a, const char *s, size_t len);
+void arena_reset(arena *a);
+void arena_free(arena *a);
+
+#endif
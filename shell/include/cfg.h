@@ -3,6 +3,25 @@
 
 #include <stdbool.h>
 
-char** parse_command(char *input); 
+// atomic: one pipeline stage with its own redirections (the last '<' and the
+// last '>'/'>>' win, matching the old flat-argv behaviour)
+typedef struct atomic_cmd {
+    char **argv;
+    int argc;
+    char *input_file;
+    char *output_file;
+    bool append;
+    struct atomic_cmd *next;
+} atomic_cmd;
+
+// cmd_group: atomic ('|' atomic)*
+typedef struct cmd_group {
+    atomic_cmd *stages;
+    int stage_count;
+    bool is_background;
+    struct cmd_group *next;
+} cmd_group;
+
+cmd_group *parse_command(char *input); 
 
 #endif
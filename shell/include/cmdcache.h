@@ -0,0 +1,21 @@
+#ifndef CMDCACHE_H
+#define CMDCACHE_H
+
+#include <stddef.h>
+#include "cfg.h"
+
+typedef struct {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+} cmdcache_stats;
+
+extern cmdcache_stats command_cache_stats;
+
+// Like parse_command(), but serves repeated lines from a bounded cache keyed
+// by the whitespace-normalized line. The result is owned by the cache and
+// must not be modified; it stays valid until CMDCACHE_ENTRIES other lines
+// have been cached after it.
+cmd_group *parse_command_cached(char *input);
+
+#endif
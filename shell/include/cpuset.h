@@ -0,0 +1,28 @@
+#ifndef CPUSET_H
+#define CPUSET_H
+
+// A set of CPU numbers. It does not use <sched.h>'s cpu_set_t, so files
+// built without _GNU_SOURCE can carry one around.
+#define CPU_LIST_MAX 1024
+
+typedef struct {
+    unsigned long bits[CPU_LIST_MAX / (8 * sizeof(unsigned long))];
+} cpu_list;
+
+void cpu_list_clear(cpu_list *set);
+void cpu_list_add(cpu_list *set, int cpu);
+int cpu_list_has(const cpu_list *set, int cpu);
+int cpu_list_count(const cpu_list *set);
+
+// Parses a list such as "0-3,6". Returns -1 if it is malformed or empty.
+int cpu_list_parse(const char *s, cpu_list *set);
+
+// The CPUs the shell is allowed to run on.
+int cpu_list_current(cpu_list *set);
+
+// Writes the CPUs of set ordered so that neighbours share the closest
+// cache: SMT siblings and L2 first, then L3, from sysfs. Returns how many
+// were written, at most max.
+int cpu_cache_order(const cpu_list *set, int *order, int max);
+
+#endif
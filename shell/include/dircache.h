@@ -0,0 +1,37 @@
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef struct {
+    size_t hits;          // served from memory
+    size_t misses;        // had to read the directory
+    size_t evictions;     // dropped to stay within the entry or byte bound
+    size_t invalidations; // dropped because the directory changed
+} dircache_stats;
+
+extern dircache_stats dir_cache_stats;
+
+// Identifies a directory read on a miss, so its listing can be stored.
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    struct timespec mtime; // as it was before the directory was read
+    int wd;                // inotify watch, -1 if none could be added
+    int racy;              // mtime too recent to prove a later change
+} dir_key;
+
+// Returns the sorted names (with hidden ones) of the directory open as
+// dir_fd if an unchanged listing is cached; each name is preceded by its
+// DT_* type byte. The array stays valid until the next dir_cache call. On a
+// miss returns NULL and fills key; the directory must be read after this
+// call, so that a change made while it is read is not missed.
+const char **dir_cache_lookup(int dir_fd, dir_key *key, size_t *count);
+
+// Copies a listing read after a miss into the cache, unless it is larger
+// than the cache could hold.
+void dir_cache_store(const dir_key *key, const char **names, size_t count);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <sys/types.h>
+
+// What an events_wait call saw; several bits can be set at once.
+#define EVENT_CHILD     0x01 // SIGCHLD: a foreground waiter should reap
+#define EVENT_INTERRUPT 0x02 // Ctrl+C
+#define EVENT_INPUT     0x04 // the watched descriptor is readable
+#define EVENT_REPORTED  0x08 // a job status line was printed
+#define EVENT_STOP      0x10 // Ctrl+Z
+
+// Blocks SIGCHLD, SIGINT and SIGTSTP and routes them, together with one
+// pidfd per background job, through a single epoll instance.
+int events_init(void);
+
+// Waits up to timeout_ms (-1: forever) and handles what arrived: finished
+// jobs are reaped and reported, Ctrl+C and Ctrl+Z reach the foreground job.
+// watch_fd, if not -1, is also waited on for readability.
+int events_wait(int watch_fd, int timeout_ms);
+
+// The epoll descriptor, for callers that poll their own descriptors too;
+// when it is readable, events_wait(-1, 0) handles what is pending.
+int events_fd(void);
+
+// Handles a pending Ctrl+C or Ctrl+Z without blocking, leaving finished
+// jobs and feeds to the next events_wait. Returns nonzero once Ctrl+C has
+// been pressed since shell_interrupted was last cleared, or if Ctrl+Z
+// arrived just now; work the shell does itself for a job ends on either.
+int events_interrupted(void);
+
+// Starts or stops watching a background job's process for exit; returns
+// the pidfd to keep with its stage, or -1 if it is watched by scanning.
+int events_watch(pid_t pid);
+void events_unwatch(int pidfd, int background);
+
+// Moves everything in data_fd (a builtin's output, from offset 0) into the
+// write end of a pipe as its reader drains it, from events_wait, so the
+// shell never blocks on the pipe. Both descriptors are taken over and
+// closed once the data is written or the reader is gone.
+void events_feed(int data_fd, int pipe_fd);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef FASTCOPY_H
+#define FASTCOPY_H
+
+#include <stddef.h>
+
+// How a copy moved its bytes, fastest first.
+typedef enum {
+    COPY_FILE_RANGE, // copy_file_range(): file to file, may reflink
+    COPY_SENDFILE,   // sendfile(): file to anything
+    COPY_SPLICE,     // splice(): either side a pipe
+    COPY_READ_WRITE  // plain read()/write() through a buffer
+} copy_method;
+
+typedef struct {
+    size_t copies;
+    size_t bytes;
+    size_t by_method[COPY_READ_WRITE + 1]; // copies finished by each method
+} fastcopy_stats;
+
+extern fastcopy_stats fast_copy_stats;
+
+// Copies in_fd to out_fd until EOF, keeping the data in the kernel when the
+// descriptor types allow it. stop is asked between chunks and ends the
+// copy early when it returns nonzero. Returns 0, or -1 with errno set.
+int fast_copy(int in_fd, int out_fd, int (*stop)(void));
+
+#endif
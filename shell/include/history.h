@@ -0,0 +1,39 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    size_t searches;
+    size_t indexed;  // answered from the trigram index
+    size_t scanned;  // patterns too short for it, answered by a scan
+    size_t loaded;   // commands whose trigrams came from the saved index
+    size_t built;    // commands whose trigrams were computed this session
+} history_stats;
+
+extern history_stats history_search_stats;
+
+// Opens dir/.shell_history, the append-only log with one command per line,
+// and dir/.shell_history.idx, the offset of each command in it. Commands
+// the index does not cover yet (written by a session that ended early or
+// ran alongside) are indexed here. The trigram index for searches is kept
+// in dir/.shell_history.grams.
+void history_open(const char *dir);
+
+// Appends one command with a single write().
+void history_add(const char *cmd);
+
+size_t history_count(void);
+
+// Command id (0 is the oldest), not NUL-terminated. The pointer stays
+// valid until the next history call.
+const char *history_get(size_t id, size_t *len);
+
+// Ids of the commands containing text, or starting with it if prefix is
+// set, oldest first, in a malloc'd array; returns how many.
+size_t history_search(const char *text, int prefix, uint32_t **ids);
+
+void history_purge(void);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef LAUNCH_H
+#define LAUNCH_H
+
+#include "cpuset.h"
+
+#include <sys/types.h>
+
+// How external commands are started; switched at runtime with 'set launch'.
+typedef enum {
+    LAUNCH_FORK,  // fork() + execv()/execvp()
+    LAUNCH_SPAWN, // posix_spawn(), which glibc runs on clone(CLONE_VM|CLONE_VFORK)
+    LAUNCH_ZYGOTE // a helper process forks on the shell's behalf (zygote.h)
+} launch_mode;
+
+extern launch_mode launch_backend;
+
+// Scheduling and resource limits from a 'with' prefix, applied to the
+// child before it runs the command.
+typedef struct {
+    cpu_list cpus;        // CPUs it may run on; empty to inherit the shell's
+    int nice;             // added to the shell's niceness
+    long long mem_limit;  // RLIMIT_DATA in bytes, 0 for no limit
+} launch_limits;
+
+// One external command to start. Descriptors other than the two below are
+// expected to be close-on-exec.
+typedef struct {
+    char **argv;
+    const char *path; // resolved executable, or NULL to search PATH
+    int stdin_fd;     // becomes stdin, or -1 to inherit the shell's
+    int stdout_fd;    // becomes stdout, or -1 to inherit the shell's
+    pid_t pgid;       // process group to join, 0 to lead a new one
+    const launch_limits *limits; // or NULL
+} launch_request;
+
+// Starts the command with SIGINT/SIGTSTP at their defaults. Returns the pid,
+// or -1 after reporting the error.
+pid_t launch_external(const launch_request *req);
+
+// Applies limits to the calling process: for a new child before exec.
+void launch_apply_limits(const launch_limits *limits);
+
+const char *launch_mode_name(launch_mode mode);
+int launch_mode_parse(const char *name, launch_mode *mode);
+
+#endif
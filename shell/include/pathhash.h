@@ -0,0 +1,29 @@
+#ifndef PATHHASH_H
+#define PATHHASH_H
+
+#include <stddef.h>
+
+typedef struct {
+    size_t hits;          // answered from the table
+    size_t misses;        // had to walk PATH
+    size_t negative_hits; // answered "not found" from the table
+    size_t invalidations; // table dropped because PATH or a directory changed
+} pathhash_stats;
+
+extern pathhash_stats path_hash_stats;
+
+// Resolves a command name (no '/') to the path of an executable in a PATH
+// directory, caching both hits and misses. A relative PATH entry ('.',
+// an empty one, 'bin') gives a path relative to the current directory.
+// Returns NULL if the command is not on PATH. The string stays valid until
+// the table is next invalidated or cleared.
+const char *path_lookup(const char *name);
+
+void path_hash_clear(void);
+
+// Called after the shell changes directory: relative PATH entries now
+// name other directories, so a table that used them is dropped.
+void path_hash_chdir(void);
+void path_hash_print(void);
+
+#endif
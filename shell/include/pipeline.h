@@ -1,6 +1,95 @@
 #ifndef PIPELINE_H
 #define PIPELINE_H
 
-void execute_command_group(char **args);
+#include "cfg.h"
+#include "usage.h"
+#include "launch.h"
+
+#include <sys/types.h>
+
+// Pipe capacity: a byte count, or one of these.
+#define PIPE_SIZE_DEFAULT 0  // whatever the kernel gives (64 KB on Linux)
+#define PIPE_SIZE_AUTO   -1  // start at the default, grow pipes seen full
+
+extern long pipe_size_setting; // 'set pipesize'
+
+typedef struct {
+    size_t sized;  // pipes given an explicit capacity
+    size_t grown;  // auto-mode resizes of a full pipe
+} pipesize_stats;
+
+extern pipesize_stats pipe_size_stats;
+
+extern int pipefail_setting; // 'set pipefail'
+
+// Where the stages of a pipeline run.
+typedef enum {
+    PLACE_NONE,  // wherever the scheduler likes
+    PLACE_CACHE  // one CPU each, neighbours sharing a cache
+} placement_mode;
+
+extern placement_mode placement_setting; // 'set placement'
+
+// Settings for one pipeline, from 'set' and leading 'time'/'with' prefixes.
+typedef struct {
+    long pipe_size;
+    int timed; // 'time': report stage usage when it finishes
+    launch_limits limits;
+    placement_mode placement;
+} pipeline_options;
+
+typedef enum {
+    STAGE_RUNNING,
+    STAGE_STOPPED,
+    STAGE_DONE
+} stage_state;
+
+// Wait statuses for stages that never ran as a process
+#define STATUS_FAILED    (1 << 8)   // exit code 1
+#define STATUS_NOT_FOUND (127 << 8) // exit code 127, as other shells use
+
+// One stage of a job. Stages the shell ran itself, or that could not be
+// started, have no pid and are DONE from the outset.
+typedef struct {
+    pid_t pid;
+    int pidfd;         // exit notification while in the background, or -1
+    stage_state state;
+    int status;        // wait status once DONE
+    char *name;        // argv[0]; a copy owned by the job table once in it
+    run_usage usage;
+} job_stage;
+
+// A stage's exit code: its exit status, or 128 plus the killing signal.
+int stage_exit_code(const job_stage *stage);
+
+// The stage whose code is the job's: the last one, or with pipefail the
+// last one that failed.
+const job_stage *deciding_stage(const job_stage *stages, int count);
+
+// Strips leading 'time' and 'with' prefixes (-pipe SIZE, -cpu LIST,
+// -nice N, -rss SIZE, -place MODE) into opts. Returns
+// the group to run (a shallow copy if anything was stripped), or NULL after
+// reporting a syntax error. stage_usage is left to the caller.
+cmd_group *apply_with_prefix(cmd_group *group, pipeline_options *opts);
+
+// Parses "default", "auto" or a byte count with an optional K/M suffix.
+int parse_pipe_size(const char *s, long *size);
+const char *pipe_size_name(long size);
+
+// Parses a positive byte count with an optional K/M/G suffix.
+int parse_byte_size(const char *s, long long *bytes);
+
+int placement_parse(const char *name, placement_mode *mode);
+const char *placement_name(placement_mode mode);
+
+// stages receives one entry per stage; those run in the shell are complete
+// on return, the others are left RUNNING for the caller to reap.
+int execute_command_group(cmd_group *group, const pipeline_options *opts, pid_t *pgid,
+                          job_stage *stages);
+
+// Auto mode: grows the pipes feeding still-running stages that are full.
+// Returns 1 if some pipe could still grow, 0 once watching is pointless.
+int pipe_autosize_sample(cmd_group *group, const job_stage *stages);
+int is_builtin(const char *name);
 
 #endif
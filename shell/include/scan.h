@@ -0,0 +1,39 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Byte classifier used by the tokenizer. classify() looks at up to 64 bytes
+// and returns two bitmasks, bit i describing s[i]:
+//   space - C locale isspace()
+//   delim - whitespace or one of | & < > ;
+// Bits at and beyond len are set in both masks, so scans stop there.
+typedef struct {
+    const char *name;
+    void (*classify)(const char *s, size_t len, uint64_t *space, uint64_t *delim);
+} scan_impl;
+
+// The fastest implementation this CPU supports, picked on first use.
+const scan_impl *scan_best(void);
+
+// Every implementation this CPU can run, scalar first, NULL-terminated; for
+// the benchmark in bench/.
+const scan_impl *const *scan_all(void);
+
+// Walks a string one 64-byte block at a time, classifying each block once
+// no matter how many tokens start inside it.
+typedef struct {
+    const scan_impl *impl;
+    const char *s;
+    size_t len;
+    size_t block; // offset of the classified block, or SIZE_MAX
+    uint64_t space;
+    uint64_t delim;
+} scan_cursor;
+
+void scan_start(scan_cursor *c, const scan_impl *impl, const char *s, size_t len);
+size_t scan_skip_space(scan_cursor *c, size_t pos); // first non-space at or after pos
+size_t scan_name_end(scan_cursor *c, size_t pos);   // first delimiter at or after pos
+
+#endif
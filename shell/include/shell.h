@@ -9,6 +9,7 @@
 
 #include "cfg.h"
 #include "pipeline.h"
+#include "usage.h"
 
 extern pid_t current_foreground_pid;
 extern char current_foreground_command[256];
@@ -18,42 +19,73 @@ typedef enum {
     STOPPED
 } job_status;
 
+// A job: one command or a whole pipeline, with every stage it started.
 typedef struct {
-    pid_t pid;
+    pid_t pid;         // first stage that is a process, shown by activities
     pid_t pgid;
-    char *command;
+    char *command;     // stage names joined with " | "
     int job_number;
     int is_background; // 1 for background, 0 for sequential
     job_status status;
+    job_stage *stages; // owned by the table
+    int stage_count;
+    int stages_left;   // processes not yet reaped
+    int timed;         // started with 'time'
 } process;
 
-extern process processes[100];
+extern process *processes; // see activities.c
 extern int process_count;
 extern int next_job_number;
 extern pid_t foreground_pgid;
+extern volatile sig_atomic_t shell_interrupted; // set by every Ctrl+C
+extern int last_status; // exit code of the last foreground command
 
-#define MAX_INPUT_SIZE 1024
 #define MAX_NAME_SIZE 256
-#define MAX_ARGS 10
 
-extern char *history[15];
-extern int his_cnt;
+extern char *shell_home_dir;
+extern char *prev_dir; // for 'hop -', NULL until the first hop
 
-void load_history();
-void save_history();
 void init_builtin_state(char *home_path);
 void show_prompt();
 void handle_hop(char **args);
 void handle_reveal(char **args);
 void update_history(char *cmd);
 void handle_log(char **args);
-void run_builtin_or_external(char **args, int is_background);
+int run_builtin(char **args);
+void run_builtin_or_external(cmd_group *group, int is_background);
+void run_shell_cmd(cmd_group *groups);
 void handle_ping(char **args);
 void run_activities_builtin(process *processes, int count);
+void handle_activities(char **args);
 
-void add_child_process(pid_t pid, const char *command, int bg);
+// Returned pointers stay valid until the next add or remove.
+// add_job takes over a malloc'd stage array, see copy_stages; job_number 0
+// (or one in use) picks the next free number.
+process *add_job(job_stage *stages, int stage_count, int bg, int job_number);
+process *add_child_process(pid_t pid, const char *command, int bg);
+// Drops the job holding pid, or takes a job out and hands back its stages
 void remove_process_by_pid(pid_t pid);
-void completed_processes(void);
+job_stage *release_job(process *job);
+job_stage *copy_stages(const job_stage *stages, int count);
+void free_stages(job_stage *stages, int count);
+process *find_job_by_pid(pid_t pid);
+process *find_job_by_number(int job_number);
+process *find_most_recent_job(void);
+// Applies a wait status to the stage with that pid; returns 1 once no
+// stage is left running
+int update_job_stage(process *job, pid_t pid, int status, const run_usage *reaped);
+run_usage job_usage(const process *job);
+// Reports a background job whose last stage was reaped and drops it
+void finish_background_job(process *job);
+// Remembers a finished job for 'activities -r'
+void record_finished_job(const job_stage *stages, int count);
+// "exit N", plus each stage's code for a pipeline
+void format_job_status(char *buf, size_t len, const job_stage *stages, int count);
+// 'time' table: a row per stage with its exit code, and a total
+void print_stage_report(FILE *out, const job_stage *stages, int count);
+int completed_processes(void);
+void handle_wait(char **args);
+void handle_status(char **args);
 
 void setup_signal_handlers();
 void handle_sigint(int signo);
@@ -62,7 +94,9 @@ void handle_sigtstp(int signo);
 void handle_fg(char **args);
 void handle_bg(char **args);
 
-
-void free_args(char **args);
+void handle_stats(char **args);
+void handle_set(char **args);
+void handle_hash(char **args);
+void handle_forall(char **args);
 
 #endif
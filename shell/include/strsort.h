@@ -0,0 +1,9 @@
+#ifndef STRSORT_H
+#define STRSORT_H
+
+#include <stddef.h>
+
+// Sorts an array of strings into strcmp order, moving only the pointers.
+void sort_strings(const char **v, size_t count);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef USAGE_H
+#define USAGE_H
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+// Wall-clock times and resource usage of one process, or of a whole job
+// once its stages are added up.
+typedef struct {
+    struct timespec started; // CLOCK_REALTIME
+    struct timespec ended;   // zero while still running
+    struct rusage usage;     // from wait4 at reap, or sampled from /proc
+} run_usage;
+
+// Clears u and stamps the start time.
+void usage_begin(run_usage *u);
+
+// wait4 that, when the process has exited, stamps u's end time and stores
+// its rusage. u may be NULL.
+pid_t usage_wait(pid_t pid, int *status, int options, run_usage *u);
+
+// Snapshot of RUSAGE_SELF, and the part of it spent since before; for work
+// the shell does itself. Max RSS is the shell's own.
+void usage_self(struct rusage *ru);
+void usage_end_self(run_usage *u, const struct rusage *before);
+
+// Fills u->usage for a live process from /proc. Returns -1 if it is gone.
+int usage_sample(pid_t pid, run_usage *u);
+
+// Folds a stage into a job total: earliest start, latest end, summed
+// counters and the largest RSS.
+void usage_add(run_usage *total, const run_usage *stage);
+
+// Column titles and the matching row for
+// "real user sys maxrss vcsw ivcsw minflt majflt".
+const char *usage_columns(void);
+void usage_format(char *buf, size_t len, const run_usage *u);
+
+// "HH:MM:SS" local start time.
+void usage_start_time(char *buf, size_t len, const run_usage *u);
+
+#endif
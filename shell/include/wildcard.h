@@ -0,0 +1,24 @@
+#ifndef WILDCARD_H
+#define WILDCARD_H
+
+#include <stddef.h>
+#include "cfg.h"
+
+typedef struct {
+    size_t patterns;  // arguments that contained a wildcard
+    size_t matches;   // paths they expanded to
+    size_t dirs_read; // directories listed to find them
+} wildcard_stats;
+
+extern wildcard_stats wildcard_stats_total;
+
+// Replaces every argument holding '*', '?', '[...]' or a '**' component
+// with the paths it matches, sorted; an argument that matches nothing is
+// kept as typed. Names starting with '.' are matched only by a pattern
+// component that starts with '.', and '**' does not follow symbolic
+// links. Returns the group itself if nothing was expanded, otherwise a
+// copy in line_arena (the group may belong to the command cache), or NULL
+// if Ctrl+C stopped the expansion.
+cmd_group *expand_wildcards(cmd_group *group);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include "launch.h"
+
+// The zygote is a helper process, started by re-executing the shell binary,
+// that forks commands on the shell's behalf so the fork copies its small
+// address space instead of the shell's. It clones with CLONE_PARENT, which
+// makes every command a child of the shell itself: waits, setpgid and
+// pidfds work exactly as for the other launch modes.
+
+// Set by 'shell.out --zygote': serves requests on sock until it closes.
+int zygote_main(int sock);
+
+// Starts the helper if it is not running. Returns -1 if it cannot be.
+int zygote_start(void);
+void zygote_stop(void);
+
+// Returned by zygote_launch when the helper could not take the request;
+// the caller starts the command some other way.
+#define ZYGOTE_UNAVAILABLE (-2)
+
+// Starts the command through the helper. Returns the pid, -1 after
+// reporting that the command could not be started, or ZYGOTE_UNAVAILABLE.
+pid_t zygote_launch(const launch_request *req);
+
+#endif
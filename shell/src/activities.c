@@ -1,54 +1,489 @@
 #include "shell.h"
+#include "events.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
-//process processes[100];
 extern int process_count;
 extern int next_job_number;
 extern pid_t foreground_pgid ;
 
-void add_child_process(pid_t pid, const char *command, int bg) {
-    if (process_count < 100) {
-        processes[process_count].pid = pid;
-        processes[process_count].pgid = getpgid(pid);
-        processes[process_count].command = strdup(command);
-        processes[process_count].job_number = next_job_number++;
-        processes[process_count].is_background = bg;
-        processes[process_count].status = RUNNING;
+// The job table is a dense array kept packed by moving the last job into a
+// freed slot, plus two open-addressing indexes to the slot: one from the
+// pid of every live stage and one from the job number. Insert, lookup and
+// removal are O(1) per stage; a job keeps its number for as long as it
+// lives, and numbering restarts once the table is empty.
+typedef struct {
+    int *keys;  // 0 marks an empty bucket
+    int *slots;
+    int size;   // power of two, kept at least twice count
+    int count;
+} job_index;
 
-        process_count++;
-    } 
+static int process_capacity = 0;
+static job_index by_pid, by_number;
+
+static unsigned int bucket_of(const job_index *index, int key) {
+    return ((unsigned int)key * 2654435761u) & (unsigned int)(index->size - 1);
+}
+
+static int index_get(const job_index *index, int key) {
+    if (index->size == 0 || key <= 0) {
+        return -1;
+    }
+    for (unsigned int b = bucket_of(index, key); index->keys[b] != 0; b = (b + 1) & (index->size - 1)) {
+        if (index->keys[b] == key) {
+            return index->slots[b];
+        }
+    }
+    return -1;
+}
+
+static void index_insert(job_index *index, int key, int slot) {
+    unsigned int b = bucket_of(index, key);
+    while (index->keys[b] != 0 && index->keys[b] != key) {
+        b = (b + 1) & (index->size - 1);
+    }
+    if (index->keys[b] == 0) {
+        index->count++;
+    }
+    index->keys[b] = key;
+    index->slots[b] = slot;
+}
+
+static int index_grow(job_index *index) {
+    int size = (index->size == 0) ? 32 : index->size * 2;
+    int *keys = calloc(size, sizeof(int));
+    int *slots = malloc(size * sizeof(int));
+    if (keys == NULL || slots == NULL) {
+        free(keys);
+        free(slots);
+        return -1;
+    }
+    job_index old = *index;
+    index->keys = keys;
+    index->slots = slots;
+    index->size = size;
+    index->count = 0;
+    for (int b = 0; b < old.size; b++) {
+        if (old.keys[b] != 0) {
+            index_insert(index, old.keys[b], old.slots[b]);
+        }
+    }
+    free(old.keys);
+    free(old.slots);
+    return 0;
+}
+
+static int index_put(job_index *index, int key, int slot) {
+    if ((index->count + 1) * 2 > index->size && index_grow(index) < 0) {
+        return -1;
+    }
+    index_insert(index, key, slot);
+    return 0;
+}
+
+// Removes key and shifts the rest of its probe run back, so lookups never
+// need tombstones.
+static void index_remove(job_index *index, int key) {
+    if (index->size == 0) {
+        return;
+    }
+    unsigned int mask = (unsigned int)(index->size - 1);
+    unsigned int hole = bucket_of(index, key);
+    while (index->keys[hole] != key) {
+        if (index->keys[hole] == 0) {
+            return;
+        }
+        hole = (hole + 1) & mask;
+    }
+    for (unsigned int b = (hole + 1) & mask; index->keys[b] != 0; b = (b + 1) & mask) {
+        unsigned int home = bucket_of(index, index->keys[b]);
+        // Move the entry back unless its home lies cyclically in (hole, b]
+        if (((b - home) & mask) >= ((b - hole) & mask)) {
+            index->keys[hole] = index->keys[b];
+            index->slots[hole] = index->slots[b];
+            hole = b;
+        }
+    }
+    index->keys[hole] = 0;
+    index->count--;
+}
+
+// Points the indexes at a job's slot; done stages are no longer indexed, as
+// their pids may already belong to someone else.
+static void index_job(int slot) {
+    process *job = &processes[slot];
+    index_put(&by_number, job->job_number, slot);
+    for (int i = 0; i < job->stage_count; i++) {
+        if (job->stages[i].state != STAGE_DONE) {
+            index_put(&by_pid, job->stages[i].pid, slot);
+        }
+    }
+}
+
+static void unindex_job(int slot) {
+    process *job = &processes[slot];
+    index_remove(&by_number, job->job_number);
+    for (int i = 0; i < job->stage_count; i++) {
+        if (job->stages[i].state != STAGE_DONE && index_get(&by_pid, job->stages[i].pid) == slot) {
+            index_remove(&by_pid, job->stages[i].pid);
+        }
+    }
+}
+
+job_stage *copy_stages(const job_stage *stages, int count) {
+    job_stage *copy = malloc(count * sizeof(job_stage));
+    if (copy == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        copy[i] = stages[i];
+        copy[i].name = strdup(stages[i].name);
+    }
+    return copy;
+}
+
+void free_stages(job_stage *stages, int count) {
+    for (int i = 0; stages != NULL && i < count; i++) {
+        free(stages[i].name);
+    }
+    free(stages);
+}
+
+// "a | b | c" from the stage names.
+static char *join_stage_names(const job_stage *stages, int count) {
+    size_t len = 1;
+    for (int i = 0; i < count; i++) {
+        len += strlen(stages[i].name) + 3;
+    }
+    char *command = malloc(len);
+    if (command == NULL) {
+        return NULL;
+    }
+    command[0] = '\0';
+    for (int i = 0; i < count; i++) {
+        if (i > 0) {
+            strcat(command, " | ");
+        }
+        strcat(command, stages[i].name);
+    }
+    return command;
+}
+
+process *add_job(job_stage *stages, int stage_count, int bg, int job_number) {
+    if (job_number == 0 || find_job_by_number(job_number) != NULL) {
+        job_number = next_job_number++;
+    } else if (next_job_number <= job_number) {
+        next_job_number = job_number + 1;
+    }
+    if (process_count == process_capacity) {
+        int capacity = (process_capacity == 0) ? 16 : process_capacity * 2;
+        process *grown = realloc(processes, capacity * sizeof(process));
+        if (grown == NULL) {
+            perror("malloc");
+            free_stages(stages, stage_count);
+            return NULL;
+        }
+        processes = grown;
+        process_capacity = capacity;
+    }
+
+    process *job = &processes[process_count];
+    job->pid = 0;
+    job->pgid = 0;
+    for (int i = 0; i < stage_count; i++) {
+        if (job->pid == 0) {
+            job->pid = stages[i].pid;
+        }
+        // Earlier stages may be reaped already; any live one names the group
+        if (job->pgid <= 0 && stages[i].state != STAGE_DONE) {
+            job->pgid = getpgid(stages[i].pid);
+        }
+    }
+    job->command = join_stage_names(stages, stage_count);
+    job->job_number = job_number;
+    job->is_background = bg;
+    job->status = RUNNING;
+    job->stages = stages;
+    job->stage_count = stage_count;
+    job->stages_left = 0;
+    job->timed = 0;
+    for (int i = 0; i < stage_count; i++) {
+        if (stages[i].state == STAGE_DONE) {
+            continue;
+        }
+        job->stages_left++;
+        if (stages[i].state == STAGE_STOPPED) {
+            job->status = STOPPED;
+        }
+        stages[i].pidfd = bg ? events_watch(stages[i].pid) : -1;
+    }
+    index_job(process_count);
+    process_count++;
+    return job;
+}
+
+process *add_child_process(pid_t pid, const char *command, int bg) {
+    job_stage *stage = calloc(1, sizeof(job_stage));
+    if (stage == NULL || (stage->name = strdup(command)) == NULL) {
+        perror("malloc");
+        free(stage);
+        return NULL;
+    }
+    stage->pid = pid;
+    stage->state = STAGE_RUNNING;
+    usage_begin(&stage->usage);
+    return add_job(stage, 1, bg, 0);
+}
+
+job_stage *release_job(process *job) {
+    int slot = (int)(job - processes);
+    unindex_job(slot);
+    job_stage *stages = job->stages;
+    for (int i = 0; i < job->stage_count; i++) {
+        events_unwatch(stages[i].pidfd, job->is_background && stages[i].state != STAGE_DONE);
+        stages[i].pidfd = -1;
+    }
+    free(job->command);
+
+    process_count--;
+    if (slot != process_count) {
+        processes[slot] = processes[process_count];
+        index_job(slot);
+    }
+    if (process_count == 0) {
+        next_job_number = 1;
+    }
+    return stages;
 }
 
 void remove_process_by_pid(pid_t pid) {
+    process *job = find_job_by_pid(pid);
+    if (job != NULL) {
+        int count = job->stage_count;
+        free_stages(release_job(job), count);
+    }
+}
+
+int update_job_stage(process *job, pid_t pid, int status, const run_usage *reaped) {
+    for (int i = 0; i < job->stage_count; i++) {
+        job_stage *stage = &job->stages[i];
+        if (stage->pid != pid || stage->state == STAGE_DONE) {
+            continue;
+        }
+        if (WIFSTOPPED(status)) {
+            stage->state = STAGE_STOPPED;
+        } else if (WIFCONTINUED(status)) {
+            stage->state = STAGE_RUNNING;
+        } else {
+            stage->state = STAGE_DONE;
+            stage->status = status;
+            stage->usage.ended = reaped->ended;
+            stage->usage.usage = reaped->usage;
+            events_unwatch(stage->pidfd, job->is_background);
+            stage->pidfd = -1;
+            index_remove(&by_pid, pid);
+            job->stages_left--;
+        }
+        break;
+    }
+    return job->stages_left == 0;
+}
+
+run_usage job_usage(const process *job) {
+    run_usage total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < job->stage_count; i++) {
+        usage_add(&total, &job->stages[i].usage);
+    }
+    if (job->stages_left > 0) {
+        total.ended.tv_sec = total.ended.tv_nsec = 0; // still running
+    }
+    return total;
+}
+
+process *find_job_by_pid(pid_t pid) {
+    int slot = index_get(&by_pid, pid);
+    return (slot >= 0) ? &processes[slot] : NULL;
+}
+
+process *find_job_by_number(int job_number) {
+    int slot = index_get(&by_number, job_number);
+    return (slot >= 0) ? &processes[slot] : NULL;
+}
+
+// The table is not kept in launch order, so the newest background job is
+// the one with the highest number.
+process *find_most_recent_job(void) {
+    process *recent = NULL;
     for (int i = 0; i < process_count; i++) {
-        if (processes[i].pid == pid) {
-            free(processes[i].command);
-            for (int j = i; j < process_count - 1; j++) {
-                processes[j] = processes[j + 1];
-            }
-            process_count--;
-            return;
+        if (processes[i].is_background && (recent == NULL || processes[i].job_number > recent->job_number)) {
+            recent = &processes[i];
         }
     }
+    return recent;
 }
 
 // completed_processes is implemented in shell.c
 
+// The last few finished jobs, foreground and background, for 'activities -r'
+#define RECENT_JOBS 16
+
+typedef struct {
+    char command[64];
+    int status;
+    run_usage usage;
+} finished_job;
+
+static finished_job recent_jobs[RECENT_JOBS];
+static int recent_count = 0; // total recorded; the ring holds the last RECENT_JOBS
+
+void record_finished_job(const job_stage *stages, int count) {
+    finished_job *entry = &recent_jobs[recent_count++ % RECENT_JOBS];
+    char *command = join_stage_names(stages, count);
+    snprintf(entry->command, sizeof(entry->command), "%s", (command != NULL) ? command : stages[0].name);
+    free(command);
+    entry->status = deciding_stage(stages, count)->status;
+    memset(&entry->usage, 0, sizeof(entry->usage));
+    for (int i = 0; i < count; i++) {
+        usage_add(&entry->usage, &stages[i].usage);
+    }
+}
+
+void format_job_status(char *buf, size_t len, const job_stage *stages, int count) {
+    int n = snprintf(buf, len, "exit %d", stage_exit_code(deciding_stage(stages, count)));
+    for (int i = 0; count > 1 && i < count && n > 0 && (size_t)n < len; i++) {
+        n += snprintf(buf + n, len - n, "%s%s %d%s", (i == 0) ? " (" : ", ", stages[i].name,
+                      stage_exit_code(&stages[i]), (i == count - 1) ? ")" : "");
+    }
+}
+
+void print_stage_report(FILE *out, const job_stage *stages, int count) {
+    char row[128];
+    fprintf(out, "stage %s status  command\n", usage_columns());
+    run_usage total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < count; i++) {
+        usage_format(row, sizeof(row), &stages[i].usage);
+        fprintf(out, "%-5d %s %6d  %s\n", i + 1, row, stage_exit_code(&stages[i]), stages[i].name);
+        usage_add(&total, &stages[i].usage);
+    }
+    if (count > 1) {
+        usage_format(row, sizeof(row), &total);
+        fprintf(out, "total %s %6d\n", row, stage_exit_code(deciding_stage(stages, count)));
+    }
+}
+
+void finish_background_job(process *job) {
+    const job_stage *decider = deciding_stage(job->stages, job->stage_count);
+    printf("%s with pid %d exited %s\n", job->command, job->pid,
+           WIFSIGNALED(decider->status) ? "abnormally" : "normally");
+    if (job->stage_count > 1) {
+        char codes[256];
+        format_job_status(codes, sizeof(codes), job->stages, job->stage_count);
+        printf("  %s\n", codes);
+    }
+    if (job->timed) {
+        print_stage_report(stdout, job->stages, job->stage_count);
+    }
+    record_finished_job(job->stages, job->stage_count);
+    int count = job->stage_count;
+    free_stages(release_job(job), count);
+}
+
 int compare_commands(const void *a, const void *b) {
-    process *proc_a = (process *)a;
-    process *proc_b = (process *)b;
+    const process *proc_a = *(process * const *)a;
+    const process *proc_b = *(process * const *)b;
     return strcmp(proc_a->command, proc_b->command);
 }
 
+// Sorts a list of pointers, as the table order is what the indexes point at
 void run_activities_builtin(process *processes, int count) {
-    qsort(processes, count, sizeof(process), compare_commands);
+    process **sorted = malloc(count * sizeof(process *));
+    if (sorted == NULL && count > 0) {
+        perror("malloc");
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        sorted[i] = &processes[i];
+    }
+    qsort(sorted, count, sizeof(process *), compare_commands);
 
     for (int i = 0; i < count; i++) {
-        char *state = (processes[i].status == STOPPED) ? "Stopped" : "Running";
-        printf("[%d] : %s - %s\n", processes[i].pid, processes[i].command, state);
+        char *state = (sorted[i]->status == STOPPED) ? "Stopped" : "Running";
+        printf("[%d] : %s - %s\n", sorted[i]->pid, sorted[i]->command, state);
+    }
+    free(sorted);
+}
+
+static void describe_status(char *buf, size_t len, int status) {
+    if (WIFSIGNALED(status)) {
+        snprintf(buf, len, "Killed %d", WTERMSIG(status));
+    } else {
+        snprintf(buf, len, "Exited %d", WEXITSTATUS(status));
+    }
+}
+
+static const char *stage_state_name(const job_stage *stage, char *buf, size_t len) {
+    if (stage->state == STAGE_DONE) {
+        describe_status(buf, len, stage->status);
+        return buf;
+    }
+    return (stage->state == STAGE_STOPPED) ? "Stopped" : "Running";
+}
+
+// 'activities -r': live jobs with their usage so far, read from /proc, and
+// each stage of a pipeline under its job; then the most recently finished
+// jobs with what wait4 reported.
+static void print_job_resources(void) {
+    char row[128], start[16], state[16];
+    printf("%-8s %-9s %-8s %s  command\n", "pid", "state", "start", usage_columns());
+    for (int i = 0; i < process_count; i++) {
+        process *job = &processes[i];
+        if (!job->is_background) {
+            continue;
+        }
+        for (int j = 0; j < job->stage_count; j++) {
+            if (job->stages[j].state != STAGE_DONE) {
+                usage_sample(job->stages[j].pid, &job->stages[j].usage);
+            }
+        }
+        run_usage total = job_usage(job);
+        usage_format(row, sizeof(row), &total);
+        usage_start_time(start, sizeof(start), &total);
+        printf("%-8d %-9s %-8s %s  %s\n", (int)job->pid,
+               (job->status == STOPPED) ? "Stopped" : "Running", start, row, job->command);
+        for (int j = 0; job->stage_count > 1 && j < job->stage_count; j++) {
+            job_stage *stage = &job->stages[j];
+            usage_format(row, sizeof(row), &stage->usage);
+            usage_start_time(start, sizeof(start), &stage->usage);
+            char pid[16] = "-"; // run by the shell
+            if (stage->pid > 0) {
+                snprintf(pid, sizeof(pid), "%d", (int)stage->pid);
+            }
+            printf("%-8s %-9s %-8s %s    %s\n", pid,
+                   stage_state_name(stage, state, sizeof(state)), start, row, stage->name);
+        }
+    }
+    int first = (recent_count > RECENT_JOBS) ? recent_count - RECENT_JOBS : 0;
+    for (int i = first; i < recent_count; i++) {
+        finished_job *entry = &recent_jobs[i % RECENT_JOBS];
+        usage_format(row, sizeof(row), &entry->usage);
+        usage_start_time(start, sizeof(start), &entry->usage);
+        describe_status(state, sizeof(state), entry->status);
+        printf("%-8s %-9s %-8s %s  %s\n", "-", state, start, row, entry->command);
+    }
+}
+
+void handle_activities(char **args) {
+    if (args[0] == NULL) {
+        run_activities_builtin(processes, process_count);
+    } else if (strcmp(args[0], "-r") == 0 && args[1] == NULL) {
+        print_job_resources();
+    } else {
+        printf("activities: Invalid Syntax!\n");
     }
 }
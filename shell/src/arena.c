@@ -0,0 +1,106 @@
+#include "arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define ARENA_CHUNK_SIZE 8192
+#define ARENA_ALIGN 16
+
+// Offset of the next align-aligned address at or after chunk->used.
+static size_t aligned_offset(arena_chunk *chunk, size_t align) {
+    uintptr_t addr = (uintptr_t)(chunk->data + chunk->used);
+    uintptr_t aligned = (addr + align - 1) & ~(uintptr_t)(align - 1);
+    return chunk->used + (size_t)(aligned - addr);
+}
+
+static void *alloc_aligned(arena *a, size_t size, size_t align) {
+    if (size == 0) {
+        size = 1;
+    }
+
+    arena_chunk *chunk = a->head;
+    size_t offset = (chunk != NULL) ? aligned_offset(chunk, align) : 0;
+    if (chunk == NULL || offset > chunk->size || chunk->size - offset < size) {
+        size_t chunk_size = (a->chunk_size != 0) ? a->chunk_size : ARENA_CHUNK_SIZE;
+        while (chunk_size < size + ARENA_ALIGN) {
+            chunk_size *= 2;
+        }
+        chunk = malloc(sizeof(arena_chunk) + chunk_size);
+        if (chunk == NULL) {
+            perror("malloc");
+            return NULL;
+        }
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = a->head;
+        a->head = chunk;
+        a->chunk_mallocs++;
+        offset = aligned_offset(chunk, align);
+    }
+
+    void *ptr = chunk->data + offset;
+    chunk->used = offset + size;
+    a->allocations++;
+    return ptr;
+}
+
+void *arena_alloc(arena *a, size_t size) {
+    return alloc_aligned(a, size, ARENA_ALIGN);
+}
+
+void *arena_alloc_packed(arena *a, size_t size) {
+    return alloc_aligned(a, size, 1);
+}
+
+char *arena_strndup(arena *a, const char *s, size_t len) {
+    char *copy = arena_alloc(a, len + 1);
+    if (copy == NULL) {
+        return NULL;
+    }
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// Leaves a single chunk big enough for everything the last cycle needed, so
+// a steady stream of similar-sized command lines stops touching malloc.
+void arena_reset(arena *a) {
+    a->resets++;
+    if (a->head == NULL) {
+        return;
+    }
+    if (a->head->next == NULL) {
+        a->head->used = 0;
+        return;
+    }
+
+    size_t total = 0;
+    arena_chunk *chunk = a->head;
+    while (chunk != NULL) {
+        arena_chunk *next = chunk->next;
+        total += chunk->size;
+        free(chunk);
+        chunk = next;
+    }
+
+    a->head = malloc(sizeof(arena_chunk) + total);
+    if (a->head == NULL) {
+        return; // the next arena_alloc() starts from scratch
+    }
+    a->head->size = total;
+    a->head->used = 0;
+    a->head->next = NULL;
+    a->chunk_mallocs++;
+}
+
+void arena_free(arena *a) {
+    arena_chunk *chunk = a->head;
+    while (chunk != NULL) {
+        arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    a->head = NULL;
+}
@@ -1,4 +1,6 @@
 #include "cfg.h" 
+#include "arena.h"
+#include "scan.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,83 +19,99 @@ typedef enum {
 } TokenType;
 
 
+// A token is a span of the input line; nothing is copied until argv is built.
 typedef struct {
     TokenType type;
-    char text[256]; 
+    size_t start;
+    size_t len;
 } Token;
 
-static bool parse_name();
-static bool parse_input();
-static bool parse_output();
-static bool parse_atomic();
-static bool parse_cmd_group();
-static bool parse_shell_cmd_segment();
-static bool parse_shell_cmd();
+static bool parse_name(char **text);
+static bool parse_input(atomic_cmd *cmd);
+static bool parse_output(atomic_cmd *cmd);
+static bool parse_atomic(atomic_cmd **out);
+static bool parse_cmd_group(cmd_group **out);
+static bool parse_shell_cmd_segment(cmd_group *group);
+static bool parse_shell_cmd(cmd_group **out);
 
-#define MAX_TOKENS 1024
-static Token tokens[MAX_TOKENS];
+static const char *tok_input = NULL;
+static Token *tokens = NULL;
 static int tok_pos = 0;         
 static int tok_len = 0;        
+static int tok_cap = 0;
+
+// Doubles the token array inside line_arena when it fills up; the abandoned
+// copies are bounded by the final size, so tokenizing stays linear.
+static bool push_token(TokenType type, size_t start, size_t len) {
+    if (tok_len == tok_cap) {
+        int new_cap = tok_cap * 2;
+        Token *grown = arena_alloc(&line_arena, new_cap * sizeof(Token));
+        if (grown == NULL) {
+            return false;
+        }
+        memcpy(grown, tokens, tok_len * sizeof(Token));
+        tokens = grown;
+        tok_cap = new_cap;
+    }
+    tokens[tok_len++] = (Token){type, start, len};
+    return true;
+}
 
-
-static void tokenize(char *input) {
+static bool tokenize(char *input) {
+    tok_input = input;
     tok_pos = 0; 
     tok_len = 0; 
+    tok_cap = 64;
+    tokens = arena_alloc(&line_arena, tok_cap * sizeof(Token));
+    if (tokens == NULL) {
+        return false;
+    }
 
-    while (*input) {
-        while (isspace((unsigned char)*input)) input++; 
-        if (!*input) break; 
-
-        if (*input == '|') {
-            tokens[tok_len++] = (Token){TOK_PIPE, "|"};
-            input++;
+    scan_cursor scan;
+    size_t n = strlen(input);
+    scan_start(&scan, scan_best(), input, n);
+    size_t i = 0;
+    while (i < n) {
+        i = scan_skip_space(&scan, i);
+        if (i == n) break; 
+
+        bool ok;
+        if (input[i] == '|') {
+            ok = push_token(TOK_PIPE, i, 1);
+            i++;
         } 
-        else if (*input == '&') {
-                tokens[tok_len++] = (Token){TOK_AMP, "&"};
-                input++;
+        else if (input[i] == '&') {
+            ok = push_token(TOK_AMP, i, 1);
+            i++;
         } 
-        else if (*input == '<') {
-            tokens[tok_len++] = (Token){TOK_INPUT, "<"};
-            input++;
+        else if (input[i] == '<') {
+            ok = push_token(TOK_INPUT, i, 1);
+            i++;
         } 
-        else if (*input == '>') {
-            if (*(input + 1) == '>') {
-                tokens[tok_len++] = (Token){TOK_OUTPUT, ">>"};
-                input += 2;
+        else if (input[i] == '>') {
+            if (input[i + 1] == '>') {
+                ok = push_token(TOK_OUTPUT, i, 2);
+                i += 2;
             } else {
-                tokens[tok_len++] = (Token){TOK_OUTPUT, ">"};
-                input++;
+                ok = push_token(TOK_OUTPUT, i, 1);
+                i++;
             }
         } 
-        else if (*input == ';') {
-            tokens[tok_len++] = (Token){TOK_SEMI, ";"};
-            input++;
+        else if (input[i] == ';') {
+            ok = push_token(TOK_SEMI, i, 1);
+            i++;
         } 
         else {
-            char buf[256]; // Temporary buffer for collecting name characters
-            size_t len = 0;
-
-            while (*input && !isspace((unsigned char)*input) && *input != '|' && *input != '&' && *input != '<' && *input != '>' && *input != ';') {
-                if (len < sizeof(buf) - 1) { 
-                    buf[len++] = *input;
-                } else {
-                    fprintf(stderr, "Warning: Name token exceeds buffer size, truncating.\n");
-                    break;
-                }
-                input++;
-            }
-            buf[len] = '\0'; 
+            size_t start = i;
+            i = scan_name_end(&scan, i);
+            ok = push_token(TOK_NAME, start, i - start);
+        }
 
-            if (len > 0) { 
-                tokens[tok_len++] = (Token){TOK_NAME, ""};
-                strncpy(tokens[tok_len - 1].text, buf, sizeof(tokens[tok_len - 1].text) - 1);
-                tokens[tok_len - 1].text[sizeof(tokens[tok_len - 1].text) - 1] = '\0'; 
-            } else {
-                input++;
-            }
+        if (!ok) {
+            return false;
         }
     }
-    tokens[tok_len++] = (Token){TOK_END, ""}; 
+    return push_token(TOK_END, i, 0);
 }
 
 
@@ -110,106 +128,120 @@ static void consume_token() {
     }
 }
 
-static char **collect_atomic_args() {
-    char **args = (char **)malloc((MAX_TOKENS + 1) * sizeof(char *));
-    if (args == NULL) {
-        perror("malloc");
-        return NULL;
-    }
-    int arg_count = 0;
-
-    int temp_pos = tok_pos;
-
-    while(temp_pos < tok_len && tokens[temp_pos].type != TOK_END && 
-        tokens[temp_pos].type != TOK_SEMI && tokens[temp_pos].type != TOK_AMP) {
-        
-        // Collect ALL token types (names, operators, filenames)
-        args[arg_count] = strdup(tokens[temp_pos].text);
-        if (args[arg_count] == NULL) {
-            perror("strdup");
-            for (int i = 0; i < arg_count; i++) {
-                free(args[i]);
-            }
-            free(args);
-            return NULL;
-        }
-        arg_count++;
-        temp_pos++;
-    }
-    args[arg_count] = NULL; 
-    return args;
+static char *token_text(Token *tok) {
+    return arena_strndup(&line_arena, tok_input + tok->start, tok->len);
 }
 
-static bool parse_name() {
+static bool parse_name(char **text) {
     if (current_token_type() == TOK_NAME) {
+        *text = token_text(&tokens[tok_pos]);
         consume_token(); 
-        return true;
+        return *text != NULL;
     }
     return false; 
 }
 
-static bool parse_input() {
+static bool parse_input(atomic_cmd *cmd) {
     if (current_token_type() == TOK_INPUT) {
         consume_token(); 
-        if (parse_name()) { 
+        if (parse_name(&cmd->input_file)) { 
             return true;
         }
     }
     return false; // Expected '< name'
 }
 
-static bool parse_output() {
+static bool parse_output(atomic_cmd *cmd) {
     if (current_token_type() == TOK_OUTPUT) {
+        cmd->append = (tokens[tok_pos].len == 2);
         consume_token(); 
-        if (parse_name()) { 
+        if (parse_name(&cmd->output_file)) { 
             return true;
         }
     }
     return false; 
 }
 
-static bool parse_atomic() {
-    if (!parse_name()) { 
+static bool parse_atomic(atomic_cmd **out) {
+    // Every token up to the next operator is at most one argv slot
+    int max_args = 0;
+    while (tok_pos + max_args < tok_len) {
+        TokenType t = tokens[tok_pos + max_args].type;
+        if (t != TOK_NAME && t != TOK_INPUT && t != TOK_OUTPUT) break;
+        max_args++;
+    }
+
+    atomic_cmd *cmd = arena_alloc(&line_arena, sizeof(atomic_cmd));
+    if (cmd == NULL) {
+        return false;
+    }
+    *cmd = (atomic_cmd){0};
+    cmd->argv = arena_alloc(&line_arena, (max_args + 1) * sizeof(char *));
+    if (cmd->argv == NULL) {
+        return false;
+    }
+
+    if (!parse_name(&cmd->argv[cmd->argc++])) { 
         return false;
     }
 
     while (true) {
         TokenType next_type = current_token_type();
         if (next_type == TOK_NAME) { 
-            if (!parse_name()) return false; 
+            if (!parse_name(&cmd->argv[cmd->argc++])) return false; 
         } else if (next_type == TOK_INPUT) { 
-            if (!parse_input()) return false;
+            if (!parse_input(cmd)) return false;
         } else if (next_type == TOK_OUTPUT) { 
-            if (!parse_output()) return false;
+            if (!parse_output(cmd)) return false;
         } else {
             break; 
         }
     }
+    cmd->argv[cmd->argc] = NULL;
+    *out = cmd;
     return true; // Successfully parsed an atomic command
 }
 
-static bool parse_cmd_group() {
-    if (!parse_atomic()) { 
+static bool parse_cmd_group(cmd_group **out) {
+    cmd_group *group = arena_alloc(&line_arena, sizeof(cmd_group));
+    if (group == NULL) {
+        return false;
+    }
+    *group = (cmd_group){0};
+
+    atomic_cmd **tail = &group->stages;
+    if (!parse_atomic(tail)) { 
         return false;
     }
+    group->stage_count = 1;
 
     while (current_token_type() == TOK_PIPE) {
         consume_token(); 
-        if (!parse_atomic()) { 
+        tail = &(*tail)->next;
+        if (!parse_atomic(tail)) { 
             return false;
         }
+        group->stage_count++;
     }
+    *out = group;
     return true; 
 }
 
-static bool parse_shell_cmd_segment() {
+// Parses the '& cmd_group' continuations. A group followed by '&' runs in
+// the background; a trailing '&' just marks the last group.
+static bool parse_shell_cmd_segment(cmd_group *group) {
     while (true) {
         TokenType current_t = current_token_type();
         if (current_t == TOK_AMP || current_t == TOK_AND) {
+            group->is_background = (current_t == TOK_AMP);
             consume_token(); 
-            if (!parse_cmd_group()) { 
+            if (current_t == TOK_AMP && current_token_type() == TOK_END) {
+                break;
+            }
+            if (!parse_cmd_group(&group->next)) { 
                 return false;
             }
+            group = group->next;
         } else {
             break;
         }
@@ -217,19 +249,15 @@ static bool parse_shell_cmd_segment() {
     return true;
 }
 
-static bool parse_shell_cmd() {
-    if (!parse_cmd_group()) {
+static bool parse_shell_cmd(cmd_group **out) {
+    if (!parse_cmd_group(out)) {
         return false;
     }
 
-    if (!parse_shell_cmd_segment()) {
+    if (!parse_shell_cmd_segment(*out)) {
         return false;
     }
 
-    if (current_token_type() == TOK_AMP) {
-        consume_token(); 
-    }
-
     if (current_token_type() == TOK_SEMI) {
         return false; 
     }
@@ -237,21 +265,17 @@ static bool parse_shell_cmd() {
     return current_token_type() == TOK_END; 
 }
 
-char** parse_command(char *input) {
-    tokenize(input);      
+// The returned groups live in line_arena and are released by the next reset.
+cmd_group *parse_command(char *input) {
+    if (!tokenize(input)) {
+        return NULL;
+    }
     tok_pos = 0;         
-    
-    char** args = collect_atomic_args();
 
-    if (!parse_shell_cmd()) {
-        if (args != NULL) {
-            for (int i = 0; args[i] != NULL; i++) {
-                free(args[i]);
-            }
-            free(args);
-        }
+    cmd_group *groups = NULL;
+    if (!parse_shell_cmd(&groups)) {
         return NULL;
     }
     
-    return args;
-}
\ No newline at end of file
+    return groups;
+}
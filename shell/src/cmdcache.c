@@ -0,0 +1,181 @@
+#include "cmdcache.h"
+#include "arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#define CMDCACHE_ENTRIES 64
+#define CMDCACHE_BUCKETS 128 // power of two, twice the entry count
+
+typedef struct cache_entry {
+    uint64_t hash;
+    char *key;
+    cmd_group *groups;
+    arena storage;
+    struct cache_entry *bucket_next;
+    struct cache_entry *lru_prev;
+    struct cache_entry *lru_next;
+} cache_entry;
+
+cmdcache_stats command_cache_stats;
+
+static cache_entry *buckets[CMDCACHE_BUCKETS];
+static cache_entry *lru_head = NULL; // most recently used
+static cache_entry *lru_tail = NULL;
+static int entry_count = 0;
+
+static uint64_t hash_key(const char *key, size_t len) {
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Trims the line and collapses whitespace runs to one space, so that
+// "ls  -a" and " ls -a" share an entry. Tokens cannot contain whitespace,
+// so this never changes what the line parses to.
+static char *normalize(const char *input, size_t *len) {
+    char *key = arena_alloc(&line_arena, strlen(input) + 1);
+    if (key == NULL) {
+        return NULL;
+    }
+    size_t n = 0;
+    for (const char *p = input; *p != '\0'; p++) {
+        if (isspace((unsigned char)*p)) {
+            if (n > 0 && key[n - 1] != ' ') {
+                key[n++] = ' ';
+            }
+        } else {
+            key[n++] = *p;
+        }
+    }
+    if (n > 0 && key[n - 1] == ' ') {
+        n--;
+    }
+    key[n] = '\0';
+    *len = n;
+    return key;
+}
+
+static void lru_unlink(cache_entry *entry) {
+    if (entry->lru_prev != NULL) entry->lru_prev->lru_next = entry->lru_next;
+    else lru_head = entry->lru_next;
+    if (entry->lru_next != NULL) entry->lru_next->lru_prev = entry->lru_prev;
+    else lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(cache_entry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = lru_head;
+    if (lru_head != NULL) lru_head->lru_prev = entry;
+    lru_head = entry;
+    if (lru_tail == NULL) lru_tail = entry;
+}
+
+static void remove_entry(cache_entry *entry) {
+    cache_entry **slot = &buckets[entry->hash & (CMDCACHE_BUCKETS - 1)];
+    while (*slot != entry) {
+        slot = &(*slot)->bucket_next;
+    }
+    *slot = entry->bucket_next;
+    lru_unlink(entry);
+    arena_free(&entry->storage);
+    free(entry);
+    entry_count--;
+}
+
+static char *copy_string(arena *a, const char *s) {
+    return (s != NULL) ? arena_strndup(a, s, strlen(s)) : NULL;
+}
+
+// Deep-copies a parsed line out of line_arena into the entry's own arena.
+static cmd_group *copy_groups(arena *a, cmd_group *src) {
+    cmd_group *head = NULL;
+    cmd_group **group_tail = &head;
+    for (; src != NULL; src = src->next) {
+        cmd_group *group = arena_alloc(a, sizeof(cmd_group));
+        if (group == NULL) return NULL;
+        *group = *src;
+        group->stages = NULL;
+        group->next = NULL;
+
+        atomic_cmd **stage_tail = &group->stages;
+        for (atomic_cmd *stage = src->stages; stage != NULL; stage = stage->next) {
+            atomic_cmd *copy = arena_alloc(a, sizeof(atomic_cmd));
+            if (copy == NULL) return NULL;
+            *copy = *stage;
+            copy->next = NULL;
+            copy->argv = arena_alloc(a, (stage->argc + 1) * sizeof(char *));
+            if (copy->argv == NULL) return NULL;
+            for (int i = 0; i < stage->argc; i++) {
+                copy->argv[i] = copy_string(a, stage->argv[i]);
+            }
+            copy->argv[stage->argc] = NULL;
+            copy->input_file = copy_string(a, stage->input_file);
+            copy->output_file = copy_string(a, stage->output_file);
+
+            *stage_tail = copy;
+            stage_tail = &copy->next;
+        }
+
+        *group_tail = group;
+        group_tail = &group->next;
+    }
+    return head;
+}
+
+cmd_group *parse_command_cached(char *input) {
+    size_t key_len;
+    char *key = normalize(input, &key_len);
+    if (key == NULL) {
+        return parse_command(input);
+    }
+    uint64_t hash = hash_key(key, key_len);
+
+    cache_entry *entry = buckets[hash & (CMDCACHE_BUCKETS - 1)];
+    for (; entry != NULL; entry = entry->bucket_next) {
+        if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+            command_cache_stats.hits++;
+            lru_unlink(entry);
+            lru_push_front(entry);
+            return entry->groups;
+        }
+    }
+
+    command_cache_stats.misses++;
+    cmd_group *groups = parse_command(input);
+    if (groups == NULL) {
+        return NULL; // syntax errors are not cached
+    }
+
+    entry = calloc(1, sizeof(cache_entry));
+    if (entry == NULL) {
+        return groups;
+    }
+    entry->hash = hash;
+    entry->storage.chunk_size = 256; // parsed lines are small
+    entry->key = arena_strndup(&entry->storage, key, key_len);
+    entry->groups = copy_groups(&entry->storage, groups);
+    if (entry->key == NULL || entry->groups == NULL) {
+        arena_free(&entry->storage);
+        free(entry);
+        return groups;
+    }
+
+    if (entry_count == CMDCACHE_ENTRIES) {
+        command_cache_stats.evictions++;
+        remove_entry(lru_tail);
+    }
+    cache_entry **bucket = &buckets[hash & (CMDCACHE_BUCKETS - 1)];
+    entry->bucket_next = *bucket;
+    *bucket = entry;
+    lru_push_front(entry);
+    entry_count++;
+    return entry->groups;
+}
@@ -0,0 +1,161 @@
+#define _GNU_SOURCE // sched_getaffinity
+#include "cpuset.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+
+void cpu_list_clear(cpu_list *set) {
+    memset(set, 0, sizeof(*set));
+}
+
+void cpu_list_add(cpu_list *set, int cpu) {
+    if (cpu >= 0 && cpu < CPU_LIST_MAX) {
+        set->bits[cpu / BITS_PER_WORD] |= 1UL << (cpu % BITS_PER_WORD);
+    }
+}
+
+int cpu_list_has(const cpu_list *set, int cpu) {
+    return cpu >= 0 && cpu < CPU_LIST_MAX && (set->bits[cpu / BITS_PER_WORD] >> (cpu % BITS_PER_WORD)) & 1;
+}
+
+int cpu_list_count(const cpu_list *set) {
+    int count = 0;
+    for (int cpu = 0; cpu < CPU_LIST_MAX; cpu++) {
+        count += cpu_list_has(set, cpu);
+    }
+    return count;
+}
+
+int cpu_list_parse(const char *s, cpu_list *set) {
+    cpu_list_clear(set);
+    while (*s != '\0') {
+        char *end;
+        long first = strtol(s, &end, 10);
+        long last = first;
+        if (end == s) {
+            return -1;
+        }
+        if (*end == '-') {
+            s = end + 1;
+            last = strtol(s, &end, 10);
+            if (end == s) {
+                return -1;
+            }
+        }
+        if (first < 0 || last < first || last >= CPU_LIST_MAX) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            cpu_list_add(set, (int)cpu);
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return -1;
+        }
+        s = end;
+    }
+    return cpu_list_count(set) > 0 ? 0 : -1;
+}
+
+int cpu_list_current(cpu_list *set) {
+    cpu_set_t mask;
+    cpu_list_clear(set);
+    if (sched_getaffinity(0, sizeof(mask), &mask) < 0) {
+        return -1;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE && cpu < CPU_LIST_MAX; cpu++) {
+        if (CPU_ISSET(cpu, &mask)) {
+            cpu_list_add(set, cpu);
+        }
+    }
+    return 0;
+}
+
+// Lowest CPU sharing cpu's cache of the given level, which names the cache;
+// cpu itself if sysfs does not say.
+static int cache_id(int cpu, int level) {
+    for (int index = 0; index < 8; index++) {
+        char path[96], buf[256];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+        FILE *f = fopen(path, "r");
+        if (f == NULL) {
+            break;
+        }
+        int found = 0;
+        if (fscanf(f, "%d", &found) != 1) {
+            found = 0;
+        }
+        fclose(f);
+        if (found != level) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+        f = fopen(path, "r");
+        if (f == NULL) {
+            break;
+        }
+        int first = cpu;
+        if (fgets(buf, sizeof(buf), f) != NULL) {
+            first = atoi(buf); // lists are ascending
+        }
+        fclose(f);
+        return first;
+    }
+    return cpu;
+}
+
+typedef struct {
+    int cpu, l3, l2;
+} cpu_place;
+
+static int compare_places(const void *a, const void *b) {
+    const cpu_place *x = a, *y = b;
+    if (x->l3 != y->l3) return x->l3 - y->l3;
+    if (x->l2 != y->l2) return x->l2 - y->l2;
+    return x->cpu - y->cpu;
+}
+
+// The cache topology does not change while the shell runs, so the order
+// is worked out once per allowed set, and sysfs read once per CPU.
+static cpu_place known_places[CPU_LIST_MAX];
+static cpu_list known_cpus;
+static cpu_list last_set;
+static int last_order[CPU_LIST_MAX];
+static int last_count = -1;
+
+int cpu_cache_order(const cpu_list *set, int *order, int max) {
+    if (last_count < 0 || memcmp(set, &last_set, sizeof(cpu_list)) != 0) {
+        cpu_place *places = malloc(CPU_LIST_MAX * sizeof(cpu_place));
+        if (places == NULL) {
+            return 0;
+        }
+        int count = 0;
+        for (int cpu = 0; cpu < CPU_LIST_MAX; cpu++) {
+            if (!cpu_list_has(set, cpu)) {
+                continue;
+            }
+            if (!cpu_list_has(&known_cpus, cpu)) {
+                known_places[cpu].cpu = cpu;
+                known_places[cpu].l3 = cache_id(cpu, 3);
+                known_places[cpu].l2 = cache_id(cpu, 2);
+                cpu_list_add(&known_cpus, cpu);
+            }
+            places[count++] = known_places[cpu];
+        }
+        qsort(places, count, sizeof(cpu_place), compare_places);
+        for (int i = 0; i < count; i++) {
+            last_order[i] = places[i].cpu;
+        }
+        free(places);
+        last_set = *set;
+        last_count = count;
+    }
+    int count = (last_count > max) ? max : last_count;
+    memcpy(order, last_order, count * sizeof(int));
+    return count;
+}
@@ -0,0 +1,226 @@
+#include "dircache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#define DIRCACHE_ENTRIES 64
+#define DIRCACHE_BUCKETS 128            // power of two, twice the entry count
+#define DIRCACHE_BYTES (64 << 20)       // names and pointer arrays together
+
+// Without a watch, a listing is trusted on its mtime alone, which cannot
+// show a change made within the same timestamp tick; a directory changed
+// this recently when it was read is not cached.
+#define RACY_NS 2000000000LL
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+// One allocation per listing: the pointer array, then the names packed
+// back to back in sorted order, each after its type byte.
+typedef struct dir_entry {
+    uint64_t dev;
+    uint64_t ino;
+    struct timespec mtime;
+    int wd;
+    size_t count;
+    size_t bytes;
+    const char **names;
+    struct dir_entry *bucket_next;
+    struct dir_entry *lru_prev;
+    struct dir_entry *lru_next;
+} dir_entry;
+
+dircache_stats dir_cache_stats;
+
+static dir_entry *buckets[DIRCACHE_BUCKETS];
+static dir_entry *lru_head = NULL; // most recently used
+static dir_entry *lru_tail = NULL;
+static int entry_count = 0;
+static size_t cached_bytes = 0;
+static int inotify_fd = -1;
+static int inotify_failed = 0;
+
+static size_t bucket_of(uint64_t dev, uint64_t ino) {
+    uint64_t hash = (ino ^ (dev << 32) ^ (dev >> 32)) * 0x9E3779B97F4A7C15ULL;
+    return (size_t)(hash >> 32) & (DIRCACHE_BUCKETS - 1);
+}
+
+static void lru_unlink(dir_entry *entry) {
+    if (entry->lru_prev != NULL) entry->lru_prev->lru_next = entry->lru_next;
+    else lru_head = entry->lru_next;
+    if (entry->lru_next != NULL) entry->lru_next->lru_prev = entry->lru_prev;
+    else lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(dir_entry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = lru_head;
+    if (lru_head != NULL) lru_head->lru_prev = entry;
+    lru_head = entry;
+    if (lru_tail == NULL) lru_tail = entry;
+}
+
+static void remove_entry(dir_entry *entry) {
+    dir_entry **slot = &buckets[bucket_of(entry->dev, entry->ino)];
+    while (*slot != entry) {
+        slot = &(*slot)->bucket_next;
+    }
+    *slot = entry->bucket_next;
+    lru_unlink(entry);
+    if (entry->wd >= 0) {
+        inotify_rm_watch(inotify_fd, entry->wd);
+    }
+    cached_bytes -= entry->bytes;
+    free(entry->names);
+    free(entry);
+    entry_count--;
+}
+
+static dir_entry *find_by_watch(int wd) {
+    for (dir_entry *entry = lru_head; entry != NULL; entry = entry->lru_next) {
+        if (entry->wd == wd) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Drops every listing whose directory has changed since it was watched.
+// Events are read only here, so a change costs nothing until the next
+// lookup; if the queue overflowed, nothing cached can be trusted.
+static void drain_events(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t n = read(inotify_fd, buf, sizeof(buf));
+        if (n <= 0) {
+            return;
+        }
+        for (ssize_t off = 0; off < n;) {
+            struct inotify_event *ev = (struct inotify_event *)(buf + off);
+            off += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                while (lru_tail != NULL) {
+                    dir_cache_stats.invalidations++;
+                    remove_entry(lru_tail);
+                }
+                continue;
+            }
+            dir_entry *entry = find_by_watch(ev->wd);
+            if (entry != NULL) {
+                if (ev->mask & IN_IGNORED) {
+                    entry->wd = -1; // the directory is gone or unmounted
+                }
+                dir_cache_stats.invalidations++;
+                remove_entry(entry);
+            } else if (!(ev->mask & IN_IGNORED)) {
+                // Left by a miss whose listing was never stored
+                inotify_rm_watch(inotify_fd, ev->wd);
+            }
+        }
+    }
+}
+
+// Watches the open directory itself, through its /proc/self/fd link, so a
+// rename of its path cannot attach the watch to another directory.
+static int add_watch(int dir_fd) {
+    if (inotify_fd < 0 && !inotify_failed) {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        inotify_failed = (inotify_fd < 0);
+    }
+    if (inotify_fd < 0) {
+        return -1;
+    }
+    char link[64];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", dir_fd);
+    return inotify_add_watch(inotify_fd, link, WATCH_MASK); // -1 past the watch limit
+}
+
+const char **dir_cache_lookup(int dir_fd, dir_key *key, size_t *count) {
+    struct stat st;
+    if (fstat(dir_fd, &st) != 0) {
+        return NULL;
+    }
+    if (inotify_fd >= 0) {
+        drain_events();
+    }
+
+    dir_entry *entry = buckets[bucket_of(st.st_dev, st.st_ino)];
+    for (; entry != NULL; entry = entry->bucket_next) {
+        if (entry->dev == st.st_dev && entry->ino == st.st_ino) {
+            break;
+        }
+    }
+    if (entry != NULL) {
+        if (entry->mtime.tv_sec == st.st_mtim.tv_sec && entry->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            dir_cache_stats.hits++;
+            lru_unlink(entry);
+            lru_push_front(entry);
+            *count = entry->count;
+            return entry->names;
+        }
+        dir_cache_stats.invalidations++;
+        remove_entry(entry);
+    }
+
+    dir_cache_stats.misses++;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long long age = (now.tv_sec - st.st_mtim.tv_sec) * 1000000000LL + (now.tv_nsec - st.st_mtim.tv_nsec);
+    key->dev = st.st_dev;
+    key->ino = st.st_ino;
+    key->mtime = st.st_mtim;
+    key->racy = (age < RACY_NS);
+    key->wd = add_watch(dir_fd);
+    return NULL;
+}
+
+void dir_cache_store(const dir_key *key, const char **names, size_t count) {
+    size_t bytes = count * sizeof(char *);
+    for (size_t i = 0; i < count; i++) {
+        bytes += strlen(names[i]) + 2;
+    }
+    if ((key->wd < 0 && key->racy) || bytes > DIRCACHE_BYTES) {
+        if (key->wd >= 0 && find_by_watch(key->wd) == NULL) {
+            inotify_rm_watch(inotify_fd, key->wd);
+        }
+        return;
+    }
+
+    dir_entry *entry = malloc(sizeof(dir_entry));
+    char *block = malloc(bytes > 0 ? bytes : 1);
+    if (entry == NULL || block == NULL) {
+        free(entry);
+        free(block);
+        return;
+    }
+    entry->dev = key->dev;
+    entry->ino = key->ino;
+    entry->mtime = key->mtime;
+    entry->wd = key->wd;
+    entry->count = count;
+    entry->bytes = bytes;
+    entry->names = (const char **)block;
+    char *p = block + count * sizeof(char *);
+    for (size_t i = 0; i < count; i++) {
+        size_t len = strlen(names[i]);
+        memcpy(p, names[i] - 1, len + 2);
+        entry->names[i] = p + 1;
+        p += len + 2;
+    }
+
+    while (lru_tail != NULL && (entry_count == DIRCACHE_ENTRIES || cached_bytes + bytes > DIRCACHE_BYTES)) {
+        dir_cache_stats.evictions++;
+        remove_entry(lru_tail);
+    }
+    dir_entry **bucket = &buckets[bucket_of(entry->dev, entry->ino)];
+    entry->bucket_next = *bucket;
+    *bucket = entry;
+    lru_push_front(entry);
+    entry_count++;
+    cached_bytes += bytes;
+}
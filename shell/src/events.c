@@ -0,0 +1,286 @@
+#define _GNU_SOURCE // signalfd, epoll
+#include "events.h"
+#include "shell.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define EVENTS_BATCH 64
+
+// epoll tags: the signalfd, the caller's descriptor, a job's pid, or a feed
+#define TAG_SIGNAL 0
+#define TAG_WATCH 1
+#define TAG_PID (1ULL << 32)
+#define TAG_FEED (2ULL << 32)
+
+#define FEED_CHUNK (1 << 20) // bytes moved per call, so one feed cannot hog the loop
+
+// Builtin output still on its way into a pipe
+typedef struct {
+    int data_fd; // -1 for a free slot
+    int pipe_fd;
+    off_t offset;
+    off_t size;
+} feed;
+
+static int signal_fd = -1;
+static int epoll_fd = -1;
+static int pidfd_supported = 1;
+static int unwatched_jobs = 0; // background jobs without a pidfd (EMFILE and the like)
+static feed *feeds = NULL;
+static int feed_cap = 0;
+
+int events_init(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+        perror("sigprocmask");
+        return -1;
+    }
+
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (signal_fd < 0 || epoll_fd < 0) {
+        perror("signalfd");
+        return -1;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = TAG_SIGNAL };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+int events_fd(void) {
+    return epoll_fd;
+}
+
+int events_watch(pid_t pid) {
+    if (!pidfd_supported || epoll_fd < 0) {
+        return -1;
+    }
+    int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd < 0) {
+        if (errno == ENOSYS) {
+            pidfd_supported = 0; // old kernel: SIGCHLD scans the table instead
+        } else {
+            unwatched_jobs++;
+        }
+        return -1;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = TAG_PID | (uint32_t)pid };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pidfd, &ev) < 0) {
+        close(pidfd);
+        unwatched_jobs++;
+        return -1;
+    }
+    return pidfd;
+}
+
+void events_unwatch(int pidfd, int background) {
+    if (pidfd >= 0) {
+        close(pidfd); // closing the last reference also drops it from epoll
+    } else if (background && pidfd_supported && unwatched_jobs > 0) {
+        unwatched_jobs--;
+    }
+}
+
+static void end_feed(feed *f) {
+    close(f->pipe_fd); // also drops it from epoll
+    close(f->data_fd);
+    f->data_fd = -1;
+}
+
+// Writes what the pipe takes without blocking. Returns 1 once the feed is
+// finished: all written, or the reader is gone.
+static int feed_more(feed *f) {
+    // A reader that exited leaves EPIPE, which must not kill the shell
+    struct sigaction ignore, saved_pipe;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigemptyset(&ignore.sa_mask);
+    sigaction(SIGPIPE, &ignore, &saved_pipe);
+
+    int done = 0;
+    while (f->offset < f->size) {
+        size_t chunk = (f->size - f->offset < FEED_CHUNK) ? (size_t)(f->size - f->offset) : FEED_CHUNK;
+        ssize_t n = sendfile(f->pipe_fd, f->data_fd, &f->offset, chunk);
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            // No sendfile between these two: through a buffer
+            char buf[65536];
+            ssize_t got = pread(f->data_fd, buf, (chunk < sizeof(buf)) ? chunk : sizeof(buf), f->offset);
+            n = (got > 0) ? write(f->pipe_fd, buf, (size_t)got) : -1;
+            if (n > 0) {
+                f->offset += n;
+            }
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            break; // full; epoll says when it drains
+        }
+        if (n <= 0) {
+            done = 1;
+            break;
+        }
+    }
+    sigaction(SIGPIPE, &saved_pipe, NULL);
+    return done || f->offset >= f->size;
+}
+
+void events_feed(int data_fd, int pipe_fd) {
+    struct stat st;
+    int slot = 0;
+    while (slot < feed_cap && feeds[slot].data_fd >= 0) {
+        slot++;
+    }
+    if (slot == feed_cap) {
+        int cap = (feed_cap == 0) ? 8 : feed_cap * 2;
+        feed *grown = realloc(feeds, cap * sizeof(feed));
+        if (grown == NULL) {
+            perror("realloc");
+            close(data_fd);
+            close(pipe_fd);
+            return;
+        }
+        for (int i = feed_cap; i < cap; i++) {
+            grown[i].data_fd = -1;
+        }
+        feeds = grown;
+        feed_cap = cap;
+    }
+    feed *f = &feeds[slot];
+    f->data_fd = data_fd;
+    f->pipe_fd = pipe_fd;
+    f->offset = 0;
+    f->size = (fstat(data_fd, &st) == 0) ? st.st_size : 0;
+    fcntl(pipe_fd, F_SETFL, fcntl(pipe_fd, F_GETFL) | O_NONBLOCK);
+    if (feed_more(f)) {
+        end_feed(f);
+        return;
+    }
+    struct epoll_event ev = { .events = EPOLLOUT, .data.u64 = TAG_FEED | (uint32_t)slot };
+    if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pipe_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        end_feed(f);
+    }
+}
+
+// A background job's stage has exited: its pidfd became readable. The job
+// is reported once its last stage is reaped.
+static int reap_stage(pid_t pid) {
+    process *job = find_job_by_pid(pid);
+    int status;
+    run_usage reaped;
+    if (job == NULL || !job->is_background || usage_wait(pid, &status, WNOHANG, &reaped) != pid) {
+        return 0;
+    }
+    if (!update_job_stage(job, pid, status, &reaped)) {
+        return 0;
+    }
+    finish_background_job(job);
+    fflush(stdout);
+    return EVENT_REPORTED;
+}
+
+static int handle_signals(void) {
+    int result = 0;
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == (ssize_t)sizeof(info)) {
+        switch (info.ssi_signo) {
+        case SIGINT:
+            handle_sigint(SIGINT);
+            result |= EVENT_INTERRUPT;
+            break;
+        case SIGTSTP:
+            handle_sigtstp(SIGTSTP);
+            result |= EVENT_STOP;
+            break;
+        case SIGCHLD:
+            result |= EVENT_CHILD;
+            // Exits arrive on pidfds; stops and continues of background
+            // jobs (and everything, without pidfds) need a scan
+            if (!pidfd_supported || unwatched_jobs > 0 || info.ssi_code == CLD_STOPPED || info.ssi_code == CLD_CONTINUED) {
+                if (completed_processes() > 0) {
+                    result |= EVENT_REPORTED;
+                }
+            }
+            break;
+        }
+    }
+    fflush(stdout);
+    return result;
+}
+
+int events_wait(int watch_fd, int timeout_ms) {
+    if (epoll_fd < 0) {
+        return 0;
+    }
+    if (watch_fd >= 0) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = TAG_WATCH };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watch_fd, &ev);
+    }
+
+    struct epoll_event events[EVENTS_BATCH];
+    int n = epoll_wait(epoll_fd, events, EVENTS_BATCH, timeout_ms);
+    int result = 0;
+    for (int i = 0; i < n; i++) {
+        uint64_t tag = events[i].data.u64;
+        if (tag == TAG_SIGNAL) {
+            result |= handle_signals();
+        } else if (tag == TAG_WATCH) {
+            result |= EVENT_INPUT;
+        } else if ((tag & TAG_FEED) != 0) {
+            feed *f = &feeds[tag & 0xFFFFFFFFu];
+            if (f->data_fd >= 0 && feed_more(f)) {
+                end_feed(f);
+            }
+        } else {
+            result |= reap_stage((pid_t)(tag & 0xFFFFFFFFu));
+        }
+    }
+
+    if (watch_fd >= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, watch_fd, NULL);
+    }
+    return result;
+}
+
+int events_interrupted(void) {
+    // Only Ctrl+C and Ctrl+Z are taken: the caller's stdout may still be a
+    // builtin's redirection, so job reports and feeds wait for events_wait
+    sigset_t keys;
+    sigemptyset(&keys);
+    sigaddset(&keys, SIGINT);
+    sigaddset(&keys, SIGTSTP);
+    struct timespec now = { 0, 0 };
+    int stopped = 0;
+    int signo;
+    while ((signo = sigtimedwait(&keys, NULL, &now)) > 0) {
+        if (signo == SIGINT) {
+            handle_sigint(SIGINT);
+        } else {
+            handle_sigtstp(SIGTSTP);
+            stopped = 1;
+        }
+    }
+    return shell_interrupted || stopped;
+}
@@ -0,0 +1,150 @@
+#define _GNU_SOURCE // copy_file_range, splice
+#include "fastcopy.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+// Bytes per syscall; small enough that Ctrl+C is noticed promptly.
+#define COPY_CHUNK (4 << 20)
+#define RW_BUFFER_SIZE (128 * 1024)
+
+fastcopy_stats fast_copy_stats;
+
+// Errors meaning "this method cannot handle these descriptors", as opposed
+// to a real I/O failure.
+static int unsupported(int err) {
+    return err == EINVAL || err == ENOSYS || err == EXDEV || err == EBADF ||
+           err == EOPNOTSUPP || err == ESPIPE;
+}
+
+static ssize_t read_write_chunk(int in_fd, int out_fd) {
+    static char buffer[RW_BUFFER_SIZE];
+    ssize_t n = read(in_fd, buffer, sizeof(buffer));
+    if (n <= 0) {
+        return n;
+    }
+    for (ssize_t done = 0; done < n;) {
+        ssize_t w = write(out_fd, buffer + done, (size_t)(n - done));
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += w;
+    }
+    return n;
+}
+
+// Moves one chunk; returns the byte count, 0 at EOF or -1 on error.
+static ssize_t copy_chunk(copy_method method, int in_fd, int out_fd) {
+    switch (method) {
+    case COPY_FILE_RANGE:
+        return copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK, 0);
+    case COPY_SENDFILE:
+        return sendfile(out_fd, in_fd, NULL, COPY_CHUNK);
+    case COPY_SPLICE:
+        return splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK,
+                      SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+    default:
+        return read_write_chunk(in_fd, out_fd);
+    }
+}
+
+static int is_fifo(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+// Waits in short slices until both ends are ready, asking stop() between
+// slices. Returns 0 when ready, 1 if stopped and -1 on error.
+static int wait_ready(int in_fd, int out_fd, int (*stop)(void)) {
+    struct pollfd fds[2] = { { in_fd, POLLIN, 0 }, { out_fd, POLLOUT, 0 } };
+    int ready[2] = { 0, 0 };
+    while (!stop()) {
+        struct pollfd waiting[2];
+        int map[2], n = 0;
+        for (int i = 0; i < 2; i++) {
+            if (!ready[i]) {
+                waiting[n] = fds[i];
+                map[n++] = i;
+            }
+        }
+        if (n == 0) {
+            return 0;
+        }
+        int r = poll(waiting, n, 100);
+        if (r < 0 && errno != EINTR) {
+            return -1;
+        }
+        // Hangups and errors count as ready; the copy call reports them
+        for (int i = 0; i < n && r > 0; i++) {
+            if (waiting[i].revents != 0) {
+                ready[map[i]] = 1;
+            }
+        }
+    }
+    return 1;
+}
+
+int fast_copy(int in_fd, int out_fd, int (*stop)(void)) {
+    struct stat in_st;
+    int pipe_side = is_fifo(in_fd) || is_fifo(out_fd);
+
+    // copy_file_range and sendfile trust st_size, which is 0 for procfs and
+    // friends even though they have data, so only real files use them
+    int regular_in = fstat(in_fd, &in_st) == 0 && S_ISREG(in_st.st_mode) && in_st.st_size > 0;
+
+    // The process on the other end of a pipe may stall or be stopped for
+    // as long as it likes, so pipe copies splice without blocking and wait
+    // for readiness in slices that keep asking stop()
+    copy_method method = COPY_READ_WRITE;
+    if (pipe_side) {
+        method = COPY_SPLICE;
+    } else if (regular_in) {
+        method = COPY_FILE_RANGE;
+    }
+
+    size_t copied = 0;
+    while (!stop()) {
+        if (pipe_side) {
+            int r = wait_ready(in_fd, out_fd, stop);
+            if (r > 0) {
+                break;
+            }
+            if (r < 0) {
+                fast_copy_stats.bytes += copied;
+                return -1;
+            }
+        }
+        ssize_t n = copy_chunk(method, in_fd, out_fd);
+        if (n > 0) {
+            copied += (size_t)n;
+            continue;
+        }
+        if (n == 0) {
+            break;
+        }
+        if (errno == EINTR || errno == EAGAIN) {
+            continue;
+        }
+        // Fall through to the next method only before any byte has moved
+        if (copied == 0 && method != COPY_READ_WRITE && unsupported(errno)) {
+            if (method == COPY_FILE_RANGE || (method == COPY_SPLICE && regular_in)) {
+                method = COPY_SENDFILE;
+            } else {
+                method = COPY_READ_WRITE;
+            }
+            continue;
+        }
+        fast_copy_stats.bytes += copied;
+        return -1;
+    }
+
+    fast_copy_stats.copies++;
+    fast_copy_stats.bytes += copied;
+    fast_copy_stats.by_method[method]++;
+    return 0;
+}
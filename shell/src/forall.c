@@ -0,0 +1,551 @@
+#define _GNU_SOURCE // pipe2
+#include "shell.h"
+#include "arena.h"
+#include "launch.h"
+#include "pathhash.h"
+#include "events.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define FORALL_READ_SIZE 65536
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} out_buf;
+
+// One job in flight. Its stdout is a pipe the shell drains, so jobs never
+// write over each other.
+typedef struct {
+    pid_t pid;    // 0 when the slot is free
+    int out_fd;   // read end of the job's stdout; -1 once it closed, until the job is reaped
+    size_t seq;   // input line number, which fixes the output order
+    char *item;   // the input line, used as the -t tag
+    out_buf out;  // output not written yet
+    arena args;   // argv and item, reset for each job
+} forall_slot;
+
+// Reads the item list in chunks without blocking the output side.
+typedef struct {
+    int fd;
+    char *buf;
+    size_t start;
+    size_t len;
+    size_t cap;
+    int eof;
+} line_reader;
+
+typedef struct {
+    int tagged;
+    forall_slot *slots;
+    int slot_count;
+    int running;
+    size_t next_emit;  // seq of the next output to write (ordered mode)
+    out_buf *pending;  // finished outputs waiting for earlier jobs,
+    char *ready;       // ring indexed by seq % pending_cap
+    size_t pending_cap;
+    int unordered;     // parking ran out of memory: output goes out as it comes
+} forall_state;
+
+static int buf_append(out_buf *b, const char *data, size_t len) {
+    if (b->len + len > b->cap) {
+        size_t cap = (b->cap == 0) ? 4096 : b->cap;
+        while (cap < b->len + len) {
+            cap *= 2;
+        }
+        char *grown = realloc(b->data, cap);
+        if (grown == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        b->data = grown;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static void write_all(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return; // reader gone; keep draining jobs regardless
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+// Returns the next complete line (or the unterminated tail at EOF), or NULL
+// if more input is needed. The line stays valid until the next fill.
+static char *next_line(line_reader *r) {
+    char *start = r->buf + r->start;
+    char *nl = (r->len > 0) ? memchr(start, '\n', r->len) : NULL;
+    size_t line_len;
+    if (nl != NULL) {
+        line_len = (size_t)(nl - start);
+    } else if (r->eof && r->len > 0) {
+        line_len = r->len;
+        if (r->start + r->len == r->cap) {
+            return NULL; // no room for the terminator; fill() makes some
+        }
+    } else {
+        return NULL;
+    }
+    start[line_len] = '\0';
+    size_t consumed = (nl != NULL) ? line_len + 1 : line_len;
+    r->start += consumed;
+    r->len -= consumed;
+    return start;
+}
+
+static void fill(line_reader *r) {
+    if (r->start > 0) {
+        memmove(r->buf, r->buf + r->start, r->len);
+        r->start = 0;
+    }
+    if (r->len == r->cap) {
+        size_t cap = (r->cap == 0) ? FORALL_READ_SIZE : r->cap * 2;
+        char *grown = realloc(r->buf, cap);
+        if (grown == NULL) {
+            perror("realloc");
+            r->eof = 1;
+            return;
+        }
+        r->buf = grown;
+        r->cap = cap;
+    }
+    if (r->eof) {
+        return;
+    }
+    ssize_t n = read(r->fd, r->buf + r->len, r->cap - r->len);
+    if (n > 0) {
+        r->len += (size_t)n;
+    } else if (n == 0 || errno != EINTR) {
+        r->eof = 1;
+    }
+}
+
+// Builds a job's argv: every "{}" is replaced by the item, and if no
+// argument mentions "{}" the item is appended as the last one.
+static char **job_argv(arena *a, char **cmd, const char *item) {
+    int argc = 0, substituted = 0;
+    while (cmd[argc] != NULL) {
+        argc++;
+    }
+    char **argv = arena_alloc(a, (argc + 2) * sizeof(char *));
+    if (argv == NULL) {
+        return NULL;
+    }
+    size_t item_len = strlen(item);
+    for (int i = 0; i < argc; i++) {
+        const char *p = cmd[i];
+        size_t len = 0;
+        int count = 0;
+        for (const char *q = strstr(p, "{}"); q != NULL; q = strstr(q + 2, "{}")) {
+            count++;
+        }
+        if (count == 0) {
+            argv[i] = cmd[i];
+            continue;
+        }
+        substituted = 1;
+        len = strlen(p) + count * item_len - count * 2;
+        char *arg = arena_alloc(a, len + 1);
+        if (arg == NULL) {
+            return NULL;
+        }
+        char *out = arg;
+        for (const char *q; (q = strstr(p, "{}")) != NULL; p = q + 2) {
+            memcpy(out, p, (size_t)(q - p));
+            out += q - p;
+            memcpy(out, item, item_len);
+            out += item_len;
+        }
+        strcpy(out, p);
+        argv[i] = arg;
+    }
+    if (!substituted) {
+        argv[argc++] = (char *)item;
+    }
+    argv[argc] = NULL;
+    return argv;
+}
+
+static int grow_pending(forall_state *st, size_t needed) {
+    size_t cap = (st->pending_cap == 0) ? 64 : st->pending_cap;
+    while (cap <= needed) {
+        cap *= 2;
+    }
+    out_buf *pending = calloc(cap, sizeof(out_buf));
+    char *ready = calloc(cap, 1);
+    if (pending == NULL || ready == NULL) {
+        perror("calloc");
+        free(pending);
+        free(ready);
+        return -1;
+    }
+    for (size_t seq = st->next_emit; seq < st->next_emit + st->pending_cap; seq++) {
+        size_t from = seq % st->pending_cap;
+        if (st->ready[from]) {
+            pending[seq % cap] = st->pending[from];
+            ready[seq % cap] = 1;
+        }
+    }
+    free(st->pending);
+    free(st->ready);
+    st->pending = pending;
+    st->ready = ready;
+    st->pending_cap = cap;
+    return 0;
+}
+
+// No memory to park more outputs: everything parked or buffered is written
+// now, out of order, and so is all output from here on. The caller starts
+// no more jobs and lets the running ones finish.
+static void go_unordered(forall_state *st) {
+    fprintf(stderr, "forall: out of memory, writing the remaining output unordered\n");
+    st->unordered = 1;
+    for (size_t k = 0; k < st->pending_cap; k++) {
+        if (st->ready[k]) {
+            write_all(st->pending[k].data, st->pending[k].len);
+            free(st->pending[k].data);
+            memset(&st->pending[k], 0, sizeof(out_buf));
+            st->ready[k] = 0;
+        }
+    }
+    for (int i = 0; i < st->slot_count; i++) {
+        forall_slot *s = &st->slots[i];
+        if (s->pid != 0) {
+            write_all(s->out.data, s->out.len);
+            s->out.len = 0;
+        }
+    }
+}
+
+// A job's output is complete: write it now if every earlier job's output
+// has been written, otherwise park it until then.
+static void complete_output(forall_state *st, size_t seq, out_buf *out) {
+    if (!st->unordered && seq != st->next_emit && seq - st->next_emit >= st->pending_cap &&
+        grow_pending(st, seq - st->next_emit) < 0) {
+        go_unordered(st);
+    }
+    if (st->unordered) {
+        write_all(out->data, out->len);
+        out->len = 0;
+        return;
+    }
+    if (seq != st->next_emit) {
+        st->pending[seq % st->pending_cap] = *out;
+        st->ready[seq % st->pending_cap] = 1;
+        memset(out, 0, sizeof(*out));
+        return;
+    }
+
+    write_all(out->data, out->len);
+    out->len = 0;
+    st->next_emit++;
+    while (st->pending_cap > 0 && st->ready[st->next_emit % st->pending_cap]) {
+        size_t slot = st->next_emit % st->pending_cap;
+        write_all(st->pending[slot].data, st->pending[slot].len);
+        free(st->pending[slot].data);
+        memset(&st->pending[slot], 0, sizeof(out_buf));
+        st->ready[slot] = 0;
+        st->next_emit++;
+    }
+    // The running job that is now first streams from here on
+    for (int i = 0; i < st->slot_count; i++) {
+        forall_slot *s = &st->slots[i];
+        if (s->pid != 0 && s->seq == st->next_emit) {
+            write_all(s->out.data, s->out.len);
+            s->out.len = 0;
+        }
+    }
+}
+
+// Writes each complete line of a tagged job's output as "item<TAB>line".
+static void emit_tagged(forall_slot *s, int final) {
+    size_t start = 0;
+    while (start < s->out.len) {
+        char *nl = memchr(s->out.data + start, '\n', s->out.len - start);
+        if (nl == NULL && !final) {
+            break;
+        }
+        size_t end = (nl != NULL) ? (size_t)(nl - s->out.data) : s->out.len;
+        write_all(s->item, strlen(s->item));
+        write_all("\t", 1);
+        write_all(s->out.data + start, end - start);
+        write_all("\n", 1);
+        start = end + 1;
+    }
+    if (start >= s->out.len) {
+        s->out.len = 0;
+    } else {
+        memmove(s->out.data, s->out.data + start, s->out.len - start);
+        s->out.len -= start;
+    }
+}
+
+static void on_output(forall_state *st, forall_slot *s, const char *data, size_t len) {
+    if (!st->tagged && (st->unordered || s->seq == st->next_emit)) {
+        write_all(data, len);
+        return;
+    }
+    buf_append(&s->out, data, len);
+    if (st->tagged) {
+        emit_tagged(s, 0);
+    }
+}
+
+// Frees the slot if its job has exited. A job may close its stdout long
+// before it exits; its slot stays busy until SIGCHLD says so, without
+// blocking the other jobs or Ctrl+C.
+static void reap_job(forall_state *st, forall_slot *s) {
+    int status;
+    pid_t result;
+    while ((result = waitpid(s->pid, &status, WNOHANG)) < 0 && errno == EINTR) {
+    }
+    if (result == 0) {
+        return;
+    }
+    remove_process_by_pid(s->pid);
+    s->pid = 0;
+    st->running--;
+}
+
+// The job's stdout reached EOF: its output is complete.
+static void finish_output(forall_state *st, forall_slot *s) {
+    close(s->out_fd);
+    s->out_fd = -1;
+    if (st->tagged) {
+        emit_tagged(s, 1);
+    } else {
+        complete_output(st, s->seq, &s->out);
+    }
+    reap_job(st, s);
+}
+
+// Returns -1 if the command does not exist, so the remaining items are not
+// tried one by one.
+static int start_job(forall_state *st, forall_slot *s, char **cmd, const char *line,
+                     size_t seq, int devnull) {
+    out_buf empty = {0};
+    arena_reset(&s->args);
+    s->item = arena_strndup(&s->args, line, strlen(line));
+    char **argv = (s->item != NULL) ? job_argv(&s->args, cmd, s->item) : NULL;
+    if (argv == NULL) {
+        complete_output(st, seq, &empty);
+        return 0;
+    }
+
+    const char *path = argv[0];
+    if (strchr(path, '/') == NULL) {
+        path = path_lookup(path);
+    }
+    int fds[2];
+    if (path == NULL) {
+        fprintf(stderr, "Command not found!\n");
+        return -1;
+    } else if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("pipe");
+    } else {
+        launch_request req = {
+            .argv = argv,
+            .path = path,
+            .stdin_fd = devnull,
+            .stdout_fd = fds[1],
+            .pgid = 0,
+        };
+        pid_t pid = launch_external(&req);
+        close(fds[1]);
+        if (pid > 0) {
+            s->pid = pid;
+            s->out_fd = fds[0];
+            s->seq = seq;
+            s->out.len = 0;
+            st->running++;
+            add_child_process(pid, argv[0], 0);
+            return 0;
+        }
+        close(fds[0]);
+    }
+    // Nothing started; the job's (empty) output still takes its turn
+    if (!st->tagged) {
+        complete_output(st, seq, &empty);
+    }
+    return 0;
+}
+
+static int parse_jobs(const char *s) {
+    char *end;
+    long n = strtol(s, &end, 10);
+    return (*end == '\0' && n > 0 && n <= 4096) ? (int)n : -1;
+}
+
+// forall [-j N] [-t] cmd args... : runs cmd once per line of stdin, N at a
+// time (default: one per CPU). "{}" in the arguments is replaced by the
+// line; without it the line is appended. Output comes out in input order,
+// or with -t line by line as produced, each prefixed by its input line.
+void handle_forall(char **args) {
+    int jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int tagged = 0;
+    int i = 0;
+    for (; args[i] != NULL && args[i][0] == '-'; i++) {
+        if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL && parse_jobs(args[i + 1]) > 0) {
+            jobs = parse_jobs(args[++i]);
+        } else if (strncmp(args[i], "-j", 2) == 0 && parse_jobs(args[i] + 2) > 0) {
+            jobs = parse_jobs(args[i] + 2);
+        } else if (strcmp(args[i], "-t") == 0) {
+            tagged = 1;
+        } else {
+            printf("forall: Invalid Syntax!\n");
+            return;
+        }
+    }
+    if (args[i] == NULL) {
+        printf("forall: Invalid Syntax!\n");
+        return;
+    }
+    if (jobs < 1) {
+        jobs = 1;
+    }
+    char **cmd = args + i;
+
+    int devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    forall_state st = { .tagged = tagged, .slot_count = jobs };
+    st.slots = calloc(jobs, sizeof(forall_slot));
+    struct pollfd *fds = calloc(jobs + 2, sizeof(struct pollfd));
+    forall_slot **polled = calloc(jobs, sizeof(forall_slot *));
+    if (devnull < 0 || st.slots == NULL || fds == NULL || polled == NULL) {
+        perror("forall");
+        goto out;
+    }
+    for (int j = 0; j < jobs; j++) {
+        st.slots[j].args.chunk_size = 1024;
+        st.slots[j].out_fd = -1;
+    }
+
+    fflush(stdout);
+    shell_interrupted = 0;
+    line_reader in = { .fd = STDIN_FILENO };
+    size_t seq = 0;
+    int stopping = 0;
+    while (1) {
+        if (shell_interrupted && !stopping) {
+            stopping = 1;
+            for (int j = 0; j < jobs; j++) {
+                if (st.slots[j].pid != 0) {
+                    kill(-st.slots[j].pid, SIGINT); // each job leads its own group
+                }
+            }
+        }
+        // Refill every free slot from lines already read
+        for (int j = 0; j < jobs && !stopping && !st.unordered && st.running < jobs; j++) {
+            if (st.slots[j].pid != 0) {
+                continue;
+            }
+            char *line = next_line(&in);
+            if (line == NULL) {
+                break;
+            }
+            if (start_job(&st, &st.slots[j], cmd, line, seq++, devnull) < 0) {
+                stopping = 1;
+            }
+        }
+
+        int want_input = !stopping && !st.unordered && !in.eof && st.running < jobs;
+        if (st.running == 0 && !want_input) {
+            if (!stopping && !st.unordered && in.len > 0) {
+                fill(&in); // make room for the last, unterminated line
+                continue;
+            }
+            break;
+        }
+
+        int nfds = 0;
+        for (int j = 0; j < jobs; j++) {
+            if (st.slots[j].pid != 0 && st.slots[j].out_fd >= 0) {
+                polled[nfds] = &st.slots[j];
+                fds[nfds].fd = st.slots[j].out_fd;
+                fds[nfds].events = POLLIN;
+                nfds++;
+            }
+        }
+        int input_index = -1;
+        if (want_input) {
+            input_index = nfds;
+            fds[nfds].fd = in.fd;
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+
+        // Ctrl+C arrives through the shell's event loop descriptor
+        int events_index = nfds;
+        fds[nfds].fd = events_fd();
+        fds[nfds].events = POLLIN;
+        nfds++;
+
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno != EINTR) {
+                perror("poll");
+                break;
+            }
+            continue;
+        }
+        if (fds[events_index].revents != 0) {
+            events_wait(-1, 0);
+            for (int j = 0; j < jobs; j++) {
+                if (st.slots[j].pid != 0 && st.slots[j].out_fd < 0) {
+                    reap_job(&st, &st.slots[j]);
+                }
+            }
+        }
+
+        if (input_index >= 0 && fds[input_index].revents != 0) {
+            fill(&in);
+        }
+        for (int j = 0; j < nfds; j++) {
+            if (j == input_index || j == events_index || fds[j].revents == 0) {
+                continue;
+            }
+            char chunk[FORALL_READ_SIZE];
+            ssize_t n = read(fds[j].fd, chunk, sizeof(chunk));
+            if (n > 0) {
+                on_output(&st, polled[j], chunk, (size_t)n);
+            } else if (n == 0 || errno != EINTR) {
+                finish_output(&st, polled[j]);
+            }
+        }
+    }
+    free(in.buf);
+
+out:
+    if (st.slots != NULL) {
+        for (int j = 0; j < jobs; j++) {
+            free(st.slots[j].out.data);
+            arena_free(&st.slots[j].args);
+        }
+    }
+    for (size_t k = 0; k < st.pending_cap; k++) {
+        free(st.pending[k].data);
+    }
+    free(st.pending);
+    free(st.ready);
+    free(st.slots);
+    free(fds);
+    free(polled);
+    if (devnull >= 0) {
+        close(devnull);
+    }
+}
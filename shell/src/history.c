@@ -0,0 +1,832 @@
+#define _GNU_SOURCE // flock, memmem
+#include "history.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define HISTORY_FILE ".shell_history"
+#define INDEX_SUFFIX ".idx"
+#define GRAMS_SUFFIX ".grams"
+#define GRAMS_MAGIC 0x31534d4152474853ULL // "SHGRAMS1"
+#define GRAMS_SAVE_MIN 4096 // unsaved commands worth rewriting the saved index for
+#define LOG_MAP_SLACK (16 << 20) // the log grows into its mapping before it is redone
+#define INDEX_BATCH 8192          // offsets written per write() while catching up
+#define INTERSECT_MAX 3           // posting lists intersected; the rest is checked by memmem
+
+history_stats history_search_stats;
+
+// The log is mapped read-only and only ever appended to. Commands indexed
+// by an earlier session have their offsets in the mapped index file; those
+// added since are kept in memory until the next session indexes them.
+static char log_path[PATH_MAX];
+static char index_path[PATH_MAX];
+static char grams_path[PATH_MAX];
+static int log_fd = -1;
+static int index_fd = -1;
+static const char *log_map = NULL;
+static size_t log_mapped = 0;
+static size_t log_size = 0;
+static const uint64_t *index_map = NULL;
+static size_t index_entries = 0;
+static uint64_t *session = NULL;
+static size_t session_count = 0;
+static size_t session_cap = 0;
+static char *last_command = NULL;
+static char *line_buf = NULL;
+static size_t line_cap = 0;
+
+// Trigram postings: the ids of the commands containing a trigram, stored
+// as varint gaps so that a common trigram costs about a byte per command.
+// Each command is indexed as "\n" followed by its text, which gives prefix
+// searches an anchored first trigram.
+typedef struct {
+    uint32_t key;  // the three bytes plus one; 0 marks an empty slot
+    uint32_t count;
+    uint32_t last; // newest id in the list
+    uint32_t len;
+    uint32_t cap;
+    uint8_t *bytes;
+} posting;
+
+static posting *grams = NULL;
+static size_t gram_cap = 0; // power of two
+static size_t gram_count = 0;
+static int grams_ready = 0; // built on the first search, then kept up to date
+
+// The saved index covers the first commands of the offset index, whose
+// ids never change; commands after them are indexed in memory, in lists
+// that continue the saved ones. Its table is sorted by key.
+typedef struct {
+    uint64_t magic;
+    uint64_t commands;
+    uint64_t last_offset; // of the last command covered, to tell if the log is the same
+    uint64_t gram_count;
+} grams_header;
+
+typedef struct {
+    uint32_t key;
+    uint32_t count;
+    uint32_t last;
+    uint32_t len;
+    uint64_t offset; // into the posting bytes after the table
+} saved_gram;
+
+static const char *saved_map = NULL;
+static size_t saved_size = 0;
+static const saved_gram *saved = NULL;
+static size_t saved_count = 0;
+static const uint8_t *saved_data = NULL;
+static size_t saved_commands = 0;
+
+static int map_log(void) {
+    if (log_size <= log_mapped) {
+        return 0;
+    }
+    if (log_map != NULL) {
+        munmap((void *)log_map, log_mapped);
+    }
+    // Pages past the end of the file become readable as it grows
+    size_t len = log_size + LOG_MAP_SLACK;
+    void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, log_fd, 0);
+    if (map == MAP_FAILED) {
+        log_map = NULL;
+        log_mapped = 0;
+        return -1;
+    }
+    log_map = map;
+    log_mapped = len;
+    return 0;
+}
+
+static void unmap_index(void) {
+    if (index_map != NULL) {
+        munmap((void *)index_map, index_entries * sizeof(uint64_t));
+    }
+    index_map = NULL;
+    index_entries = 0;
+}
+
+static void map_index(void) {
+    struct stat st;
+    unmap_index();
+    if (fstat(index_fd, &st) != 0 || st.st_size < (off_t)sizeof(uint64_t)) {
+        return;
+    }
+    size_t entries = (size_t)st.st_size / sizeof(uint64_t);
+    void *map = mmap(NULL, entries * sizeof(uint64_t), PROT_READ, MAP_SHARED, index_fd, 0);
+    if (map != MAP_FAILED) {
+        index_map = map;
+        index_entries = entries;
+    }
+}
+
+static uint64_t entry_offset(size_t id) {
+    return (id < index_entries) ? index_map[id] : session[id - index_entries];
+}
+
+static const char *entry_text(size_t id, size_t *len) {
+    uint64_t off = entry_offset(id);
+    const char *nl = memchr(log_map + off, '\n', log_size - off);
+    *len = (nl != NULL) ? (size_t)(nl - (log_map + off)) : log_size - off;
+    return log_map + off;
+}
+
+// End of the last indexed command, or 0 if the index does not describe
+// this log (it was truncated, replaced or never indexed).
+static size_t index_coverage(void) {
+    if (index_entries == 0) {
+        return 0;
+    }
+    uint64_t last = index_map[index_entries - 1];
+    if (last >= log_size || (last > 0 && log_map[last - 1] != '\n')) {
+        return 0;
+    }
+    const char *nl = memchr(log_map + last, '\n', log_size - last);
+    return (nl != NULL) ? (size_t)(nl - log_map) + 1 : 0;
+}
+
+// Indexes the commands past what the index covers, under a lock so that
+// shells starting together do not both append them.
+static void catch_up(void) {
+    struct stat st;
+    if (fstat(index_fd, &st) == 0 && st.st_size % sizeof(uint64_t) != 0) {
+        if (ftruncate(index_fd, st.st_size - st.st_size % sizeof(uint64_t)) != 0) {
+            return;
+        }
+    }
+    map_index();
+    size_t covered = index_coverage();
+    if (covered == 0 && index_entries > 0) {
+        unmap_index();
+        if (ftruncate(index_fd, 0) != 0) {
+            return;
+        }
+    }
+
+    uint64_t batch[INDEX_BATCH];
+    size_t n = 0;
+    int appended = 0;
+    lseek(index_fd, 0, SEEK_END);
+    for (size_t off = covered; off < log_size;) {
+        const char *nl = memchr(log_map + off, '\n', log_size - off);
+        size_t end = (nl != NULL) ? (size_t)(nl - log_map) : log_size;
+        if (end > off) {
+            batch[n++] = off; // empty lines are skipped
+        }
+        if (n == INDEX_BATCH || (end + 1 >= log_size && n > 0)) {
+            if (write(index_fd, batch, n * sizeof(uint64_t)) != (ssize_t)(n * sizeof(uint64_t))) {
+                break;
+            }
+            n = 0;
+            appended = 1;
+        }
+        off = end + 1;
+    }
+    if (appended || covered == 0) {
+        map_index();
+    }
+}
+
+void history_open(const char *dir) {
+    snprintf(log_path, sizeof(log_path), "%s/%s", dir, HISTORY_FILE);
+    snprintf(index_path, sizeof(index_path), "%s/%s%s", dir, HISTORY_FILE, INDEX_SUFFIX);
+    snprintf(grams_path, sizeof(grams_path), "%s/%s%s", dir, HISTORY_FILE, GRAMS_SUFFIX);
+    log_fd = open(log_path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    index_fd = open(index_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (log_fd < 0 || index_fd < 0) {
+        if (log_fd >= 0) close(log_fd);
+        if (index_fd >= 0) close(index_fd);
+        log_fd = index_fd = -1;
+        return; // history is not kept
+    }
+
+    flock(index_fd, LOCK_EX);
+    struct stat st;
+    if (fstat(log_fd, &st) == 0) {
+        log_size = (size_t)st.st_size;
+    }
+    if (map_log() == 0) {
+        // A command cut short by a crash still gets its own line
+        if (log_size > 0 && log_map[log_size - 1] != '\n' && write(log_fd, "\n", 1) == 1) {
+            log_size++;
+            map_log();
+        }
+        catch_up();
+    }
+    flock(index_fd, LOCK_UN);
+
+    if (history_count() > 0) {
+        size_t len;
+        const char *text = history_get(history_count() - 1, &len);
+        last_command = strndup(text, len);
+    }
+}
+
+static void free_grams(void) {
+    for (size_t i = 0; i < gram_cap; i++) {
+        free(grams[i].bytes);
+    }
+    free(grams);
+    grams = NULL;
+    gram_cap = 0;
+    gram_count = 0;
+}
+
+static void unmap_saved(void) {
+    if (saved_map != NULL) {
+        munmap((void *)saved_map, saved_size);
+    }
+    saved_map = NULL;
+    saved = NULL;
+    saved_count = 0;
+    saved_commands = 0;
+}
+
+static void reset_state(void) {
+    if (log_map != NULL) {
+        munmap((void *)log_map, log_mapped);
+    }
+    log_map = NULL;
+    log_mapped = 0;
+    log_size = 0;
+    unmap_index();
+    session_count = 0;
+    free(last_command);
+    last_command = NULL;
+    free_grams();
+    unmap_saved();
+    grams_ready = 0;
+}
+
+// Another shell may have purged the log under this one; offsets past its
+// end would fault, so everything is reloaded.
+static void check_log(void) {
+    struct stat st;
+    if (log_fd >= 0 && fstat(log_fd, &st) == 0 && (size_t)st.st_size < log_size) {
+        reset_state();
+        close(log_fd);
+        close(index_fd);
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s", log_path);
+        *strrchr(dir, '/') = '\0';
+        history_open(dir);
+    }
+}
+
+size_t history_count(void) {
+    check_log();
+    return (log_map != NULL) ? index_entries + session_count : 0;
+}
+
+const char *history_get(size_t id, size_t *len) {
+    return entry_text(id, len);
+}
+
+static uint32_t hash_gram(uint32_t key) {
+    return (key * 2654435761u) >> 7;
+}
+
+static void grow_grams(void) {
+    posting *old = grams;
+    size_t old_cap = gram_cap;
+    gram_cap = (gram_cap == 0) ? 4096 : gram_cap * 2;
+    grams = calloc(gram_cap, sizeof(posting));
+    if (grams == NULL) {
+        grams = old;
+        gram_cap = old_cap;
+        return;
+    }
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].key != 0) {
+            size_t slot = hash_gram(old[i].key) & (gram_cap - 1);
+            while (grams[slot].key != 0) slot = (slot + 1) & (gram_cap - 1);
+            grams[slot] = old[i];
+        }
+    }
+    free(old);
+}
+
+static posting *find_gram(uint32_t key, int create) {
+    if (create && (gram_count + 1) * 2 > gram_cap) {
+        grow_grams();
+    }
+    if (gram_cap == 0) {
+        return NULL;
+    }
+    size_t slot = hash_gram(key) & (gram_cap - 1);
+    while (grams[slot].key != 0) {
+        if (grams[slot].key == key) return &grams[slot];
+        slot = (slot + 1) & (gram_cap - 1);
+    }
+    if (!create || (gram_count + 1) * 2 > gram_cap) {
+        return NULL;
+    }
+    grams[slot].key = key;
+    gram_count++;
+    return &grams[slot];
+}
+
+static size_t put_varint(uint8_t *out, uint32_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+static size_t get_varint(const uint8_t *p, uint32_t *v) {
+    size_t n = 0;
+    *v = 0;
+    for (int shift = 0;; shift += 7) {
+        uint8_t b = p[n++];
+        *v |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return n;
+    }
+}
+
+static void add_posting(posting *p, uint32_t id) {
+    if (p->count > 0 && p->last == id) {
+        return; // the trigram occurs twice in this command
+    }
+    if (p->len + 5 > p->cap) {
+        uint32_t cap = (p->cap == 0) ? 8 : p->cap * 2;
+        uint8_t *grown = realloc(p->bytes, cap);
+        if (grown == NULL) return;
+        p->bytes = grown;
+        p->cap = cap;
+    }
+    p->len += put_varint(p->bytes + p->len, (p->count > 0) ? id - p->last : id);
+    p->last = id;
+    p->count++;
+}
+
+static uint32_t gram_key(const unsigned char *s) {
+    return ((uint32_t)s[0] << 16 | (uint32_t)s[1] << 8 | s[2]) + 1;
+}
+
+static void index_command(uint32_t id, const char *text, size_t len) {
+    uint32_t window = '\n'; // the last three bytes seen
+    for (size_t i = 0; i < len; i++) {
+        window = ((window << 8) | (unsigned char)text[i]) & 0xFFFFFF;
+        if (i >= 1) {
+            posting *p = find_gram(window + 1, 1);
+            if (p != NULL) add_posting(p, id);
+        }
+    }
+}
+
+static void build_grams(size_t from, size_t to) {
+    for (size_t id = from; id < to; id++) {
+        size_t len;
+        const char *text = entry_text(id, &len);
+        index_command((uint32_t)id, text, len);
+    }
+    history_search_stats.built += to - from;
+}
+
+// Maps the saved index if it still describes the first commands of the
+// offset index; anything else about it is checked before it is trusted.
+static void load_saved(void) {
+    unmap_saved();
+    int fd = open(grams_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0) {
+        return;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(grams_header)) {
+        close(fd);
+        return;
+    }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    saved_map = map;
+    saved_size = (size_t)st.st_size;
+
+    const grams_header *head = map;
+    int ok = head->magic == GRAMS_MAGIC && head->commands > 0 && head->commands <= index_entries &&
+             index_map[head->commands - 1] == head->last_offset &&
+             head->gram_count <= (saved_size - sizeof(grams_header)) / sizeof(saved_gram);
+    const saved_gram *table = (const saved_gram *)(saved_map + sizeof(grams_header));
+    size_t table_end = sizeof(grams_header) + (ok ? head->gram_count : 0) * sizeof(saved_gram);
+    const uint8_t *data = (const uint8_t *)saved_map + table_end;
+    size_t data_len = saved_size - table_end;
+    for (size_t i = 0; ok && i < head->gram_count; i++) {
+        const saved_gram *g = &table[i];
+        ok = g->offset <= data_len && g->len <= data_len - g->offset && g->last < head->commands &&
+             (g->len == 0 || !(data[g->offset + g->len - 1] & 0x80)) && (i == 0 || table[i - 1].key < g->key);
+    }
+    if (!ok) {
+        unmap_saved();
+        return;
+    }
+    saved = table;
+    saved_count = head->gram_count;
+    saved_data = data;
+    saved_commands = head->commands;
+}
+
+static const saved_gram *find_saved(uint32_t key) {
+    size_t lo = 0, hi = saved_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (saved[mid].key < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return (lo < saved_count && saved[lo].key == key) ? &saved[lo] : NULL;
+}
+
+static int by_key(const void *a, const void *b) {
+    uint32_t x = (*(posting *const *)a)->key, y = (*(posting *const *)b)->key;
+    return (x > y) - (x < y);
+}
+
+// Writes the saved lists followed by the in-memory ones as a new saved
+// index, renamed into place so that a reader never sees half of it. An
+// in-memory list starts with its first id, which becomes a gap from the
+// saved list's last.
+static int save_grams(size_t commands) {
+    posting **mem = malloc((gram_count + 1) * sizeof(posting *));
+    saved_gram *table = malloc((saved_count + gram_count + 1) * sizeof(saved_gram));
+    if (mem == NULL || table == NULL) {
+        free(mem);
+        free(table);
+        return -1;
+    }
+    size_t mem_count = 0;
+    for (size_t i = 0; i < gram_cap; i++) {
+        if (grams[i].key != 0) mem[mem_count++] = &grams[i];
+    }
+    qsort(mem, mem_count, sizeof(posting *), by_key);
+
+    // The merged table, with each list's new length
+    size_t n = 0, i = 0, j = 0;
+    uint64_t data_len = 0;
+    while (i < saved_count || j < mem_count) {
+        saved_gram g = { 0, 0, 0, 0, data_len };
+        const saved_gram *old = NULL;
+        const posting *add = NULL;
+        if (j == mem_count || (i < saved_count && saved[i].key < mem[j]->key)) {
+            old = &saved[i++];
+        } else if (i == saved_count || mem[j]->key < saved[i].key) {
+            add = mem[j++];
+        } else {
+            old = &saved[i++];
+            add = mem[j++];
+        }
+        g.key = (old != NULL) ? old->key : add->key;
+        if (old != NULL) {
+            g.count = old->count;
+            g.last = old->last;
+            g.len = old->len;
+        }
+        if (add != NULL) {
+            uint8_t buf[5];
+            uint32_t first;
+            size_t skip = get_varint(add->bytes, &first);
+            g.len += add->len - skip + put_varint(buf, (old != NULL) ? first - old->last : first);
+            g.count += add->count;
+            g.last = add->last;
+        }
+        data_len += g.len;
+        table[n++] = g;
+    }
+
+    char tmp[PATH_MAX + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%d", grams_path, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    FILE *out = (fd >= 0) ? fdopen(fd, "w") : NULL;
+    if (out == NULL) {
+        if (fd >= 0) close(fd);
+        free(mem);
+        free(table);
+        return -1;
+    }
+    grams_header head = { GRAMS_MAGIC, commands, index_map[commands - 1], n };
+    fwrite(&head, sizeof(head), 1, out);
+    fwrite(table, sizeof(saved_gram), n, out);
+    for (i = 0, j = 0; i < saved_count || j < mem_count;) {
+        const saved_gram *old = NULL;
+        const posting *add = NULL;
+        if (j == mem_count || (i < saved_count && saved[i].key < mem[j]->key)) {
+            old = &saved[i++];
+        } else if (i == saved_count || mem[j]->key < saved[i].key) {
+            add = mem[j++];
+        } else {
+            old = &saved[i++];
+            add = mem[j++];
+        }
+        if (old != NULL) {
+            fwrite(saved_data + old->offset, 1, old->len, out);
+        }
+        if (add != NULL) {
+            uint8_t buf[5];
+            uint32_t first;
+            size_t skip = get_varint(add->bytes, &first);
+            fwrite(buf, 1, put_varint(buf, (old != NULL) ? first - old->last : first), out);
+            fwrite(add->bytes + skip, 1, add->len - skip, out);
+        }
+    }
+    int failed = ferror(out);
+    failed |= (fclose(out) != 0);
+    free(mem);
+    free(table);
+    if (failed || rename(tmp, grams_path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Readies the trigram index: the saved part is mapped, and the commands
+// after it are indexed in memory. Once enough of those are in the offset
+// index, and so have fixed ids, they are merged into the saved index, so
+// the next session starts from it.
+static void ensure_grams(void) {
+    if (grams_ready) {
+        return;
+    }
+    load_saved();
+    size_t from = saved_commands;
+    size_t unsaved = index_entries - saved_commands;
+    if (unsaved >= GRAMS_SAVE_MIN && unsaved >= saved_commands / 16) {
+        build_grams(saved_commands, index_entries);
+        from = index_entries;
+        if (save_grams(index_entries) == 0) {
+            free_grams();
+            load_saved();
+            from = saved_commands;
+        }
+    }
+    history_search_stats.loaded = saved_commands;
+    build_grams(from, index_entries + session_count);
+    grams_ready = 1;
+}
+
+void history_add(const char *cmd) {
+    if (log_fd < 0 || (last_command != NULL && strcmp(last_command, cmd) == 0)) {
+        return;
+    }
+    size_t len = strlen(cmd);
+    if (len + 1 > line_cap) {
+        char *grown = realloc(line_buf, len + 1);
+        if (grown == NULL) return;
+        line_buf = grown;
+        line_cap = len + 1;
+    }
+    memcpy(line_buf, cmd, len);
+    line_buf[len] = '\n';
+    if (write(log_fd, line_buf, len + 1) != (ssize_t)(len + 1)) {
+        return;
+    }
+
+    // O_APPEND leaves the offset just past this command, even if another
+    // shell has appended since
+    off_t end = lseek(log_fd, 0, SEEK_CUR);
+    if (end < (off_t)(len + 1)) {
+        return;
+    }
+    if (session_count == session_cap) {
+        size_t cap = (session_cap == 0) ? 64 : session_cap * 2;
+        uint64_t *grown = realloc(session, cap * sizeof(uint64_t));
+        if (grown == NULL) return;
+        session = grown;
+        session_cap = cap;
+    }
+    session[session_count++] = (uint64_t)end - (len + 1);
+    if ((size_t)end > log_size) {
+        log_size = (size_t)end;
+    }
+    map_log();
+    if (grams_ready) {
+        index_command((uint32_t)(index_entries + session_count - 1), cmd, len);
+    }
+    free(last_command);
+    last_command = strdup(cmd);
+}
+
+// The id of the command holding byte off, if any: a line another shell
+// appended during this session is not in the index.
+static int id_at(size_t off, size_t *id) {
+    size_t lo = 0, hi = index_entries + session_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (entry_offset(mid) <= off) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) {
+        return 0;
+    }
+    size_t len;
+    const char *text = entry_text(lo - 1, &len);
+    if (log_map + off > text + len) {
+        return 0;
+    }
+    *id = lo - 1;
+    return 1;
+}
+
+// Walks a trigram's saved list and then its in-memory one, whose first
+// entry is an id rather than a gap.
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+    const uint8_t *next;
+    const uint8_t *next_end;
+    uint32_t id;
+    int started;
+} cursor;
+
+static int cursor_next(cursor *c) {
+    if (c->p == c->end) {
+        if (c->next == c->next_end) {
+            return 0;
+        }
+        c->p = c->next;
+        c->end = c->next_end;
+        c->next = c->next_end;
+        c->started = 0;
+    }
+    uint32_t gap;
+    c->p += get_varint(c->p, &gap);
+    c->id = c->started ? c->id + gap : gap;
+    c->started = 1;
+    return 1;
+}
+
+static int push_id(uint32_t **ids, size_t *count, size_t *cap, uint32_t id) {
+    if (*count == *cap) {
+        size_t grown_cap = (*cap == 0) ? 64 : *cap * 2;
+        uint32_t *grown = realloc(*ids, grown_cap * sizeof(uint32_t));
+        if (grown == NULL) return -1;
+        *ids = grown;
+        *cap = grown_cap;
+    }
+    (*ids)[(*count)++] = id;
+    return 0;
+}
+
+static int matches(size_t id, const char *text, size_t len, int prefix) {
+    size_t entry_len;
+    const char *entry = entry_text(id, &entry_len);
+    if (prefix) {
+        return entry_len >= len && memcmp(entry, text, len) == 0;
+    }
+    return memmem(entry, entry_len, text, len) != NULL;
+}
+
+// A trigram's saved list and the in-memory list that continues it; either
+// may be missing.
+typedef struct {
+    const saved_gram *disk;
+    const posting *mem;
+    size_t count;
+} gram_lists;
+
+static int by_count(const void *a, const void *b) {
+    const gram_lists *x = a, *y = b;
+    return (x->count > y->count) - (x->count < y->count);
+}
+
+// Intersects the shortest posting lists of the query's trigrams and checks
+// each survivor against the text itself.
+static size_t search_grams(const char *query, size_t query_len, const char *text, size_t len, int prefix,
+                           uint32_t **ids) {
+    size_t count = 0, cap = 0;
+    size_t n = query_len - 2;
+    gram_lists *lists = malloc(n * sizeof(gram_lists));
+    if (lists == NULL) {
+        return 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+        uint32_t key = gram_key((const unsigned char *)query + i);
+        lists[i].disk = find_saved(key);
+        lists[i].mem = find_gram(key, 0);
+        if (lists[i].disk == NULL && lists[i].mem == NULL) {
+            free(lists);
+            return 0; // a trigram no command has
+        }
+        lists[i].count = (lists[i].disk ? lists[i].disk->count : 0) + (lists[i].mem ? lists[i].mem->count : 0);
+    }
+    qsort(lists, n, sizeof(gram_lists), by_count);
+
+    size_t used = (n < INTERSECT_MAX) ? n : INTERSECT_MAX;
+    cursor cursors[INTERSECT_MAX];
+    for (size_t i = 0; i < used; i++) {
+        const uint8_t *disk = (lists[i].disk != NULL) ? saved_data + lists[i].disk->offset : NULL;
+        const uint8_t *mem = (lists[i].mem != NULL) ? lists[i].mem->bytes : NULL;
+        cursors[i] = (cursor){ disk, disk + (disk ? lists[i].disk->len : 0), mem,
+                               mem + (mem ? lists[i].mem->len : 0), 0, 0 };
+    }
+    for (size_t i = 1; i < used; i++) {
+        cursor_next(&cursors[i]);
+    }
+    while (cursor_next(&cursors[0])) {
+        uint32_t id = cursors[0].id;
+        int all = 1;
+        for (size_t i = 1; i < used && all; i++) {
+            while (cursors[i].started && cursors[i].id < id && cursor_next(&cursors[i])) {
+            }
+            all = cursors[i].started && cursors[i].id == id;
+        }
+        if (all && matches(id, text, len, prefix) && push_id(ids, &count, &cap, id) < 0) {
+            break;
+        }
+    }
+    free(lists);
+    return count;
+}
+
+// Too short for a trigram: memmem over the whole log, each hit mapped back
+// to its command by the offsets.
+static size_t search_scan(const char *text, size_t len, int prefix, uint32_t **ids) {
+    size_t count = 0, cap = 0;
+    size_t id;
+    if (prefix && log_size > 0 && index_entries + session_count > 0 && entry_offset(0) == 0 &&
+        matches(0, text, len, 1)) {
+        push_id(ids, &count, &cap, 0);
+    }
+    // A prefix is looked for after a newline
+    char needle[4] = { '\n' };
+    const char *find = text;
+    size_t find_len = len;
+    if (prefix) {
+        memcpy(needle + 1, text, len);
+        find = needle;
+        find_len = len + 1;
+    }
+    size_t off = 0;
+    while (off < log_size) {
+        const char *hit = memmem(log_map + off, log_size - off, find, find_len);
+        if (hit == NULL) {
+            break;
+        }
+        size_t at = (size_t)(hit - log_map) + (prefix ? 1 : 0);
+        off = at + 1;
+        if (!id_at(at, &id) || (prefix && entry_offset(id) != at)) {
+            continue;
+        }
+        if (push_id(ids, &count, &cap, (uint32_t)id) < 0) {
+            break;
+        }
+        // One hit per command; a prefix search needs the newline ending it
+        size_t entry_len;
+        const char *entry = entry_text(id, &entry_len);
+        off = (size_t)(entry - log_map) + entry_len + (prefix ? 0 : 1);
+    }
+    return count;
+}
+
+size_t history_search(const char *text, int prefix, uint32_t **ids) {
+    *ids = NULL;
+    check_log();
+    size_t len = strlen(text);
+    if (log_map == NULL || len == 0) {
+        return 0;
+    }
+    history_search_stats.searches++;
+
+    size_t query_len = len + (prefix ? 1 : 0);
+    if (query_len < 3) {
+        history_search_stats.scanned++;
+        return search_scan(text, len, prefix, ids);
+    }
+    ensure_grams();
+    history_search_stats.indexed++;
+    if (!prefix) {
+        return search_grams(text, len, text, len, prefix, ids);
+    }
+    char *query = malloc(query_len);
+    if (query == NULL) {
+        return 0;
+    }
+    query[0] = '\n';
+    memcpy(query + 1, text, len);
+    size_t count = search_grams(query, query_len, text, len, prefix, ids);
+    free(query);
+    return count;
+}
+
+void history_purge(void) {
+    if (log_fd < 0) {
+        return;
+    }
+    flock(index_fd, LOCK_EX);
+    if (ftruncate(log_fd, 0) != 0 || ftruncate(index_fd, 0) != 0) {
+        perror("log");
+    }
+    unlink(grams_path);
+    flock(index_fd, LOCK_UN);
+    reset_state();
+}
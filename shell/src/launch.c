@@ -0,0 +1,223 @@
+#define _GNU_SOURCE // sched_setaffinity
+#include "launch.h"
+#include "zygote.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/resource.h>
+
+extern char **environ;
+
+launch_mode launch_backend = LAUNCH_SPAWN;
+
+static const char *mode_names[] = { "fork", "spawn", "zygote" };
+
+const char *launch_mode_name(launch_mode mode) {
+    return mode_names[mode];
+}
+
+int launch_mode_parse(const char *name, launch_mode *mode) {
+    for (int i = 0; i < (int)(sizeof(mode_names) / sizeof(mode_names[0])); i++) {
+        if (strcmp(name, mode_names[i]) == 0) {
+            *mode = (launch_mode)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void to_cpu_set(const cpu_list *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    for (int cpu = 0; cpu < CPU_SETSIZE && cpu < CPU_LIST_MAX; cpu++) {
+        if (cpu_list_has(list, cpu)) {
+            CPU_SET(cpu, set);
+        }
+    }
+}
+
+static int has_cpus(const launch_limits *limits) {
+    return limits != NULL && cpu_list_count(&limits->cpus) > 0;
+}
+
+// Only the soft limit is lowered, so the shell can take its own back after
+// a spawn; the command may still raise it up to the hard limit.
+static int set_mem_limit(long long bytes, struct rlimit *saved) {
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_DATA, &lim) < 0) {
+        return -1;
+    }
+    if (saved != NULL) {
+        *saved = lim;
+    }
+    if (lim.rlim_max == RLIM_INFINITY || (rlim_t)bytes < lim.rlim_max) {
+        lim.rlim_cur = (rlim_t)bytes;
+    } else {
+        lim.rlim_cur = lim.rlim_max;
+    }
+    return setrlimit(RLIMIT_DATA, &lim);
+}
+
+static void set_nice(pid_t pid, int nice) {
+    errno = 0;
+    int prio = getpriority(PRIO_PROCESS, pid);
+    if (errno == 0 && setpriority(PRIO_PROCESS, pid, prio + nice) < 0) {
+        perror("with: nice");
+    }
+}
+
+void launch_apply_limits(const launch_limits *limits) {
+    if (limits == NULL) {
+        return;
+    }
+    if (has_cpus(limits)) {
+        cpu_set_t set;
+        to_cpu_set(&limits->cpus, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+            perror("with: cpu");
+        }
+    }
+    if (limits->nice != 0) {
+        set_nice(0, limits->nice);
+    }
+    if (limits->mem_limit > 0 && set_mem_limit(limits->mem_limit, NULL) < 0) {
+        perror("with: rss");
+    }
+}
+
+static pid_t launch_fork(const launch_request *req) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        setpgid(0, req->pgid);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        launch_apply_limits(req->limits);
+        if (req->stdin_fd >= 0 && req->stdin_fd != STDIN_FILENO) {
+            dup2(req->stdin_fd, STDIN_FILENO);
+        }
+        if (req->stdout_fd >= 0 && req->stdout_fd != STDOUT_FILENO) {
+            dup2(req->stdout_fd, STDOUT_FILENO);
+        }
+        if (req->path != NULL) {
+            execv(req->path, req->argv);
+        }
+        execvp(req->argv[0], req->argv);
+        fprintf(stderr, "Command not found!\n");
+        exit(EXIT_FAILURE);
+    }
+    setpgid(pid, (req->pgid != 0) ? req->pgid : pid);
+    return pid;
+}
+
+// Process group, signal dispositions and the stdin/stdout dup2s are all
+// described up front, so the child never runs shell code between clone and
+// exec and the shell's page tables are never copied. posix_spawn has no
+// attributes for affinity or rlimits, so the shell takes them on itself
+// for the duration of the call and the child inherits them; niceness
+// cannot be undone without privilege, so it is applied by pid afterwards.
+static pid_t launch_spawn(const launch_request *req) {
+    const launch_limits *limits = req->limits;
+    cpu_set_t saved_cpus;
+    struct rlimit saved_mem;
+    int restore_cpus = 0, restore_mem = 0;
+    if (has_cpus(limits) && sched_getaffinity(0, sizeof(saved_cpus), &saved_cpus) == 0) {
+        cpu_set_t set;
+        to_cpu_set(&limits->cpus, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) == 0) {
+            restore_cpus = 1;
+        } else {
+            perror("with: cpu");
+        }
+    }
+    if (limits != NULL && limits->mem_limit > 0) {
+        if (set_mem_limit(limits->mem_limit, &saved_mem) == 0) {
+            restore_mem = 1;
+        } else {
+            perror("with: rss");
+        }
+    }
+
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_init(&attr);
+    posix_spawn_file_actions_init(&actions);
+
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGPIPE); // the shell ignores it while builtins write to pipes
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    // Children start with nothing blocked, whatever the shell is holding off
+    sigset_t none;
+    sigemptyset(&none);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setpgroup(&attr, req->pgid);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+    if (req->stdin_fd >= 0 && req->stdin_fd != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, req->stdin_fd, STDIN_FILENO);
+    }
+    if (req->stdout_fd >= 0 && req->stdout_fd != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, req->stdout_fd, STDOUT_FILENO);
+    }
+
+    pid_t pid;
+    int err = ENOENT;
+    if (req->path != NULL) {
+        err = posix_spawn(&pid, req->path, &actions, &attr, req->argv, environ);
+    }
+    if (err != 0) {
+        err = posix_spawnp(&pid, req->argv[0], &actions, &attr, req->argv, environ);
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (restore_cpus) {
+        sched_setaffinity(0, sizeof(saved_cpus), &saved_cpus);
+    }
+    if (restore_mem) {
+        setrlimit(RLIMIT_DATA, &saved_mem);
+    }
+
+    if (err != 0) {
+        if (err == ENOENT || err == EACCES || err == ENOEXEC) {
+            fprintf(stderr, "Command not found!\n");
+        } else {
+            fprintf(stderr, "%s: %s\n", req->argv[0], strerror(err));
+        }
+        return -1;
+    }
+    if (limits != NULL && limits->nice != 0) {
+        set_nice(pid, limits->nice);
+    }
+    return pid;
+}
+
+pid_t launch_external(const launch_request *req) {
+    if (launch_backend == LAUNCH_ZYGOTE) {
+        pid_t pid = zygote_launch(req);
+        if (pid != ZYGOTE_UNAVAILABLE) {
+            return pid;
+        }
+        return launch_spawn(req);
+    }
+    if (launch_backend == LAUNCH_SPAWN) {
+        return launch_spawn(req);
+    }
+    return launch_fork(req);
+}
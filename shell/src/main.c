@@ -1,6 +1,11 @@
 #include "shell.h"
 #include "cfg.h"
 #include "pipeline.h"
+#include "arena.h"
+#include "cmdcache.h"
+#include "events.h"
+#include "zygote.h"
+#include "history.h"
 
 #include <unistd.h>
 #include <stdio.h>
@@ -8,19 +13,220 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <ctype.h>
 #include <signal.h>
+#include <errno.h>
 
 // Globals used to track background processes
-process processes[100];
+process *processes = NULL;
 int process_count = 0;
 int next_job_number = 1;
+int last_status = 0;
 pid_t foreground_pgid = 0;
+volatile sig_atomic_t shell_interrupted = 0;
 
 pid_t current_foreground_pid = 0;
 char current_foreground_command[256] = "";
 
-int main() {
+arena line_arena;
+
+// Runs one input line, splitting it on ';'. The line is modified in place.
+static void execute_line(char *input, int record_history) {
+    char *command_start = input;
+
+    // Loop to handle multiple commands separated by ';'
+    while (command_start != NULL) {
+        char *command_end = strchr(command_start, ';');
+        if (command_end != NULL) {
+            *command_end = '\0';
+        }
+
+        // Trim leading whitespace
+        while (isspace((unsigned char)*command_start)) {
+            command_start++;
+        }
+        // Trim trailing whitespace
+        size_t len = strlen(command_start);
+        while (len > 0 && isspace((unsigned char)command_start[len - 1])) {
+            command_start[--len] = '\0';
+        }
+
+        if (len > 0) {
+            if (record_history) {
+                update_history(command_start);
+            }
+            // Parse the command and arguments
+            cmd_group *groups = parse_command_cached(command_start);
+            if (groups == NULL) {
+                fprintf(stderr, "Invalid Syntax!\n");
+            } else {
+                run_shell_cmd(groups);
+            }
+        }
+        command_start = (command_end != NULL) ? command_end + 1 : NULL;
+    }
+}
+
+// Streams a whole script through the parser: no prompt, no history and no
+// per-line syscalls beyond what the commands themselves need.
+static void run_batch(const char *buf, size_t len) {
+    const char *p = buf;
+    const char *end = buf + len;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        size_t line_len = (nl != NULL) ? (size_t)(nl - p) : (size_t)(end - p);
+
+        arena_reset(&line_arena);
+        if (process_count > 0) {
+            events_wait(-1, 0); // report jobs that finished meanwhile
+        }
+
+        char *line = arena_strndup(&line_arena, p, line_len);
+        if (line != NULL && line_len > 0) {
+            execute_line(line, 0);
+        }
+        p += line_len + 1;
+    }
+    fflush(stdout);
+}
+
+// Reads all of fd into memory: mmap for regular files, growing reads otherwise.
+// Returns NULL on error; *mapped tells the caller how to release the buffer.
+static char *slurp_fd(int fd, size_t *len, int *mapped) {
+    struct stat st;
+    *mapped = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            posix_madvise(map, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+            *mapped = 1;
+            *len = (size_t)st.st_size;
+            return map;
+        }
+    }
+
+    size_t cap = 65536, used = 0;
+    char *buf = malloc(cap);
+    if (buf == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    while (1) {
+        if (used == cap) {
+            char *grown = realloc(buf, cap * 2);
+            if (grown == NULL) {
+                perror("realloc");
+                free(buf);
+                return NULL;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+        ssize_t n = read(fd, buf + used, cap - used);
+        if (n < 0) {
+            perror("read");
+            free(buf);
+            return NULL;
+        }
+        if (n == 0) {
+            break;
+        }
+        used += (size_t)n;
+    }
+    *len = used;
+    return buf;
+}
+
+static int run_batch_fd(int fd) {
+    size_t len;
+    int mapped;
+    char *buf = slurp_fd(fd, &len, &mapped);
+    if (buf == NULL) {
+        return 1;
+    }
+    run_batch(buf, len);
+    if (mapped) {
+        munmap(buf, len);
+    } else {
+        free(buf);
+    }
+    return last_status;
+}
+
+// Interactive input, read with read() so the wait for a line is also a wait
+// for job exits and signals; a finished background job is reported at once.
+typedef struct {
+    char *buf;
+    size_t len;  // bytes buffered
+    size_t cap;
+    size_t next; // start of the data after the line last returned
+} input_reader;
+
+// Returns the next line without its newline, or NULL at end of input.
+static char *read_command_line(input_reader *r) {
+    if (r->next > 0) {
+        memmove(r->buf, r->buf + r->next, r->len - r->next);
+        r->len -= r->next;
+        r->next = 0;
+    }
+    while (1) {
+        char *nl = (r->len > 0) ? memchr(r->buf, '\n', r->len) : NULL;
+        if (nl != NULL) {
+            *nl = '\0';
+            r->next = (size_t)(nl - r->buf) + 1;
+            return r->buf;
+        }
+        if (r->len + 1 >= r->cap) {
+            size_t cap = (r->cap == 0) ? 1024 : r->cap * 2;
+            char *grown = realloc(r->buf, cap);
+            if (grown == NULL) {
+                perror("realloc");
+                return NULL;
+            }
+            r->buf = grown;
+            r->cap = cap;
+        }
+
+        int events = events_wait(STDIN_FILENO, -1);
+        if (events & EVENT_INTERRUPT) {
+            // The terminal already dropped the typed text; start over
+            r->len = 0;
+            printf("\n");
+            show_prompt();
+            continue;
+        }
+        if (events & EVENT_REPORTED) {
+            show_prompt();
+        }
+        if (!(events & EVENT_INPUT)) {
+            continue;
+        }
+
+        ssize_t n = read(STDIN_FILENO, r->buf + r->len, r->cap - r->len - 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (r->len == 0) {
+                return NULL;
+            }
+            r->buf[r->len] = '\0'; // last line without a newline
+            r->next = r->len;
+            return r->buf;
+        }
+        r->len += (size_t)n;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    // The launch helper (zygote.c) never sets up any shell state
+    if (argc == 2 && strcmp(argv[1], "--zygote") == 0) {
+        return zygote_main(STDIN_FILENO);
+    }
+
     char home_dir[PATH_MAX];
     if (getcwd(home_dir, sizeof(home_dir)) == NULL) {
         perror("getcwd");
@@ -30,84 +236,67 @@ int main() {
     setup_signal_handlers();
     init_builtin_state(home_dir);
 
-    load_history();
+    history_open(shell_home_dir);
 
-    char input[1024];
+    // Non-interactive modes: shell.out -c 'cmds', shell.out script, or piped
+    // stdin. They exit with the last foreground command's status.
+    if (argc == 2 && strcmp(argv[1], "-c") == 0) {
+        fprintf(stderr, "usage: %s [-c commands | script]\n", argv[0]);
+        return 2;
+    }
+    if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+        run_batch(argv[2], strlen(argv[2]));
+        return last_status;
+    }
+    if (argc > 1) {
+        int fd = open(argv[1], O_RDONLY);
+        if (fd < 0) {
+            perror(argv[1]);
+            return 1;
+        }
+        int rc = run_batch_fd(fd);
+        close(fd);
+        return rc;
+    }
+    if (!isatty(STDIN_FILENO)) {
+        return run_batch_fd(STDIN_FILENO);
+    }
+
+    // The reader grows its buffer as needed, so lines of any length stay whole
+    input_reader reader = {0};
     while (1) {
-        // Check for completed background processes and update their status
-        completed_processes();
+        // Everything parsed from the previous line is released in one go
+        arena_reset(&line_arena);
 
         // Display the shell prompt
         show_prompt();
 
-        // Read user input
-        if (fgets(input, sizeof(input), stdin) == NULL) {
-            save_history();
-            // End of file (Ctrl-D) handling
+        // Read user input; background jobs are reported while waiting
+        char *input = read_command_line(&reader);
+        if (input == NULL) {
+            // End of file (Ctrl-D) handling: every stage of every job goes
             for (int i = 0; i < process_count; i++) {
-                kill(processes[i].pid, SIGKILL);
+                if (processes[i].pgid > 0) {
+                    kill(-processes[i].pgid, SIGKILL);
+                }
+                for (int j = 0; j < processes[i].stage_count; j++) {
+                    if (processes[i].stages[j].pid > 0 && processes[i].stages[j].state != STAGE_DONE) {
+                        kill(processes[i].stages[j].pid, SIGKILL);
+                    }
+                }
             }
             printf("\nlogout\n");
             break;
         }
 
-        // Remove the newline character from the input
-        input[strcspn(input, "\n")] = '\0';
-
         if (strlen(input) == 0) {
             continue;
         }
 
-        char *command_start = input;
-        char *command_end = input;
-
-        // Loop to handle multiple commands separated by ';'
-        while (*command_end != '\0') {
-            while (*command_end != ';' && *command_end != '\0') {
-                command_end++;
-            }
-
-            int bg = 0;
-            // Check for background command ('&')
-            if (*(command_end - 1) == '&') {
-                bg = 1;
-                *(command_end - 1) = '\0'; // Remove '&'
-            }
-
-            char temp_char = *command_end;
-            *command_end = '\0';
-
-            // Trim leading whitespace
-            while (isspace((unsigned char)*command_start)) {
-                command_start++;
-            }
-            // Trim trailing whitespace
-            char *temp = command_start + strlen(command_start) - 1;
-            while (isspace((unsigned char)*temp) && temp >= command_start) {
-                *temp = '\0';
-                temp--;
-            }
-
-            if (strlen(command_start) > 0) {
-                update_history(command_start);
-                // Parse the command and arguments
-                char **args = parse_command(command_start);
-                if (args == NULL) {
-                    fprintf(stderr, "Invalid Syntax!\n");
-                } else {
-                    if (args[0] != NULL) {
-                        run_builtin_or_external(args, bg);
-                    }
-                    free_args(args);
-                }
-            }
-            *command_end = temp_char;
-            command_start = command_end + 1;
-            command_end = command_start;
-        }
+        execute_line(input, 1);
     }
 
-    save_history();
+    free(reader.buf);
 
     return 0;
 }
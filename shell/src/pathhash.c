@@ -0,0 +1,276 @@
+#include "pathhash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Positive entries are re-checked against directory mtimes at most this
+// often; a negative hit always re-checks, so a freshly installed command is
+// found on the first try.
+#define REVALIDATE_INTERVAL_NS 1000000000LL
+
+typedef struct path_entry {
+    struct path_entry *next;
+    uint64_t hash;
+    char *path;   // NULL for a negative entry
+    size_t hits;
+    char name[];
+} path_entry;
+
+typedef struct {
+    char *dir;
+    struct timespec mtime; // zero if the directory did not exist
+} path_dir;
+
+pathhash_stats path_hash_stats;
+
+static path_entry **table = NULL;
+static size_t table_size = 0; // power of two
+static size_t entry_count = 0;
+
+static char *path_copy = NULL; // PATH the table was built for
+static path_dir *dirs = NULL;
+static int dir_count = 0;
+static long long last_validated = 0;
+static int relative_dirs = 0; // PATH has entries resolved against the cwd
+
+static uint64_t hash_name(const char *name) {
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    for (; *name != '\0'; name++) {
+        hash ^= (unsigned char)*name;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static struct timespec dir_mtime(const char *dir) {
+    struct stat st;
+    struct timespec none = {0, 0};
+    if (stat(dir[0] != '\0' ? dir : ".", &st) != 0) {
+        return none;
+    }
+    return st.st_mtim;
+}
+
+static void drop_entries(void) {
+    for (size_t i = 0; i < table_size; i++) {
+        path_entry *entry = table[i];
+        while (entry != NULL) {
+            path_entry *next = entry->next;
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        table[i] = NULL;
+    }
+    entry_count = 0;
+}
+
+static void free_dirs(void) {
+    for (int i = 0; i < dir_count; i++) {
+        free(dirs[i].dir);
+    }
+    free(dirs);
+    dirs = NULL;
+    dir_count = 0;
+    relative_dirs = 0;
+    free(path_copy);
+    path_copy = NULL;
+}
+
+// Splits PATH into directories and records their current mtimes.
+static void load_dirs(const char *path_env) {
+    path_copy = strdup(path_env);
+    int count = 1;
+    for (const char *p = path_env; *p != '\0'; p++) {
+        if (*p == ':') count++;
+    }
+    dirs = calloc(count, sizeof(path_dir));
+    if (path_copy == NULL || dirs == NULL) {
+        perror("malloc");
+        free_dirs();
+        return;
+    }
+    const char *dir = path_env;
+    while (1) {
+        const char *end = strchr(dir, ':');
+        size_t len = (end != NULL) ? (size_t)(end - dir) : strlen(dir);
+        dirs[dir_count].dir = strndup(dir, len);
+        dirs[dir_count].mtime = dir_mtime(dirs[dir_count].dir);
+        if (dirs[dir_count].dir[0] != '/') {
+            relative_dirs = 1;
+        }
+        dir_count++;
+        if (end == NULL) break;
+        dir = end + 1;
+    }
+}
+
+// Drops the table if PATH changed or, when forced or due, if any PATH
+// directory's mtime moved (a command was added, removed or renamed).
+static void validate(int force) {
+    const char *path_env = getenv("PATH");
+    if (path_env == NULL) {
+        path_env = "";
+    }
+    if (path_copy == NULL || strcmp(path_copy, path_env) != 0) {
+        if (path_copy != NULL) {
+            path_hash_stats.invalidations++;
+        }
+        drop_entries();
+        free_dirs();
+        load_dirs(path_env);
+        last_validated = now_ns();
+        return;
+    }
+
+    long long now = now_ns();
+    if (!force && now - last_validated < REVALIDATE_INTERVAL_NS) {
+        return;
+    }
+    last_validated = now;
+    int changed = 0;
+    for (int i = 0; i < dir_count; i++) {
+        struct timespec mtime = dir_mtime(dirs[i].dir);
+        if (mtime.tv_sec != dirs[i].mtime.tv_sec || mtime.tv_nsec != dirs[i].mtime.tv_nsec) {
+            dirs[i].mtime = mtime;
+            changed = 1;
+        }
+    }
+    if (changed && entry_count > 0) {
+        path_hash_stats.invalidations++;
+        drop_entries();
+    }
+}
+
+static char *search_path(const char *name) {
+    char candidate[PATH_MAX];
+    for (int i = 0; i < dir_count; i++) {
+        int n = (dirs[i].dir[0] == '\0')
+            ? snprintf(candidate, sizeof(candidate), "%s", name)
+            : snprintf(candidate, sizeof(candidate), "%s/%s", dirs[i].dir, name);
+        if (n <= 0 || (size_t)n >= sizeof(candidate)) {
+            continue;
+        }
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            return strdup(candidate);
+        }
+    }
+    return NULL;
+}
+
+static void grow_table(void) {
+    size_t new_size = (table_size == 0) ? 64 : table_size * 2;
+    path_entry **grown = calloc(new_size, sizeof(path_entry *));
+    if (grown == NULL) {
+        return; // keep chaining in the old table
+    }
+    for (size_t i = 0; i < table_size; i++) {
+        path_entry *entry = table[i];
+        while (entry != NULL) {
+            path_entry *next = entry->next;
+            size_t slot = entry->hash & (new_size - 1);
+            entry->next = grown[slot];
+            grown[slot] = entry;
+            entry = next;
+        }
+    }
+    free(table);
+    table = grown;
+    table_size = new_size;
+}
+
+static path_entry *find(const char *name, uint64_t hash) {
+    if (table_size == 0) {
+        return NULL;
+    }
+    for (path_entry *entry = table[hash & (table_size - 1)]; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+const char *path_lookup(const char *name) {
+    validate(0);
+    uint64_t hash = hash_name(name);
+    path_entry *entry = find(name, hash);
+
+    if (entry != NULL && entry->path == NULL) {
+        // Make sure nothing was installed since the miss was recorded
+        validate(1);
+        entry = find(name, hash);
+    }
+    if (entry != NULL) {
+        entry->hits++;
+        if (entry->path != NULL) {
+            path_hash_stats.hits++;
+        } else {
+            path_hash_stats.negative_hits++;
+        }
+        return entry->path;
+    }
+
+    path_hash_stats.misses++;
+    if (entry_count >= table_size * 3 / 4) {
+        grow_table();
+    }
+    size_t name_len = strlen(name);
+    entry = malloc(sizeof(path_entry) + name_len + 1);
+    if (entry == NULL || table_size == 0) {
+        free(entry);
+        return NULL;
+    }
+    memcpy(entry->name, name, name_len + 1);
+    entry->hash = hash;
+    entry->path = search_path(name);
+    entry->hits = 1;
+    size_t slot = hash & (table_size - 1);
+    entry->next = table[slot];
+    table[slot] = entry;
+    entry_count++;
+    return entry->path;
+}
+
+void path_hash_clear(void) {
+    drop_entries();
+}
+
+void path_hash_chdir(void) {
+    if (relative_dirs) {
+        // Reloaded on the next lookup, with the new directories' mtimes
+        path_hash_stats.invalidations++;
+        drop_entries();
+        free_dirs();
+    }
+}
+
+void path_hash_print(void) {
+    if (entry_count == 0) {
+        printf("hash: hash table empty\n");
+        return;
+    }
+    printf("hits\tcommand\n");
+    for (size_t i = 0; i < table_size; i++) {
+        for (path_entry *entry = table[i]; entry != NULL; entry = entry->next) {
+            if (entry->path != NULL) {
+                printf("%4zu\t%s\n", entry->hits, entry->path);
+            } else {
+                printf("%4zu\t%s (not found)\n", entry->hits, entry->name);
+            }
+        }
+    }
+}
@@ -1,244 +1,685 @@
+#define _GNU_SOURCE // F_SETPIPE_SZ, F_GETPIPE_SZ, memfd_create
 #include "pipeline.h"
 #include "shell.h"
 #include "cfg.h"
+#include "launch.h"
+#include "pathhash.h"
+#include "arena.h"
+#include "fastcopy.h"
+#include "events.h"
+#include "cpuset.h"
 
 #include <stdio.h>
+#include <stdio_ext.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <errno.h>
 #include <sys/stat.h> 
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 
-void execute_builtin_in_pipeline(char **args) {
-    if (strcmp(args[0], "reveal") == 0) {
-        handle_reveal(args + 1);
-    } else if (strcmp(args[0], "hop") == 0) {
-        handle_hop(args + 1);
-    } else if (strcmp(args[0], "log") == 0) {
-        handle_log(args + 1);
-    } else if (strcmp(args[0], "activities") == 0) {
-        run_activities_builtin(processes, process_count);
-    } else if (strcmp(args[0], "ping") == 0) {
-        handle_ping(args + 1);
-    } else if (strcmp(args[0], "true") == 0) {
-        exit(0);
-    } else if (strcmp(args[0], "false") == 0) {
-        exit(1);
-    } else {
-        // Not a builtin, try execvp
-        execvp(args[0], args);
-        fprintf(stderr, "Command not found!\n");
-        exit(EXIT_FAILURE);
-    }
-}
-
-// Executes a command group with pipelines and redirection
-void execute_command_group(char **args) {
-    int pipe_fd[2];
-    int input_fd = STDIN_FILENO;
-    int output_fd = STDOUT_FILENO;
-    int i, start_index = 0;
-    pid_t pid;
-    
-    // Create a copy of args to modify for redirection parsing
-    // Count total args first
-    int arg_count = 0;
-    while (args[arg_count] != NULL) arg_count++;
-    
-    // Create new args array
-    char **new_args = malloc((arg_count + 1) * sizeof(char*));
-    if (new_args == NULL) {
-        perror("malloc");
-        return;
-    }
-    
-    // Copy all arguments initially
-    for (i = 0; i <= arg_count; i++) {
-        new_args[i] = args[i];
-    }
-    
-    // Find I/O redirection points - scan from right to left for output redirection
-    // This ensures the last redirection takes effect
-    int last_output_redirect = -1;
-    int last_input_redirect = -1;
-    
-    // First pass: find the last output and input redirections
-    for (i = 0; new_args[i] != NULL; i++) {
-        if (strcmp(new_args[i], ">") == 0 || strcmp(new_args[i], ">>") == 0) {
-            last_output_redirect = i;
-        } else if (strcmp(new_args[i], "<") == 0) {
-            last_input_redirect = i;
-        }
-    }
-    // Handle input redirection
-    if (last_input_redirect != -1) {
-        if (new_args[last_input_redirect + 1] == NULL) {
-            printf("No such file or directory\n");
-            free(new_args);
-            return;
+long pipe_size_setting = PIPE_SIZE_DEFAULT;
+int pipefail_setting = 0;
+placement_mode placement_setting = PLACE_NONE;
+
+// Where the next placed pipeline starts in the cache order. Each one
+// continues after the last, so concurrent pipelines spread over the
+// allowed CPUs instead of all landing on the first few.
+static unsigned place_cursor = 0;
+pipesize_stats pipe_size_stats;
+
+static const char *builtin_names[] = {
+    "hop", "reveal", "log", "activities", "ping", "fg", "bg", "stats", "set", "hash", "forall", "wait", "status", "true", "false", NULL
+};
+
+int is_builtin(const char *name) {
+    for (int i = 0; builtin_names[i] != NULL; i++) {
+        if (strcmp(name, builtin_names[i]) == 0) {
+            return 1;
         }
-        input_fd = open(new_args[last_input_redirect + 1], O_RDONLY);
-        if (input_fd < 0) {
+    }
+    return 0;
+}
+
+// Opens a stage's redirections; on failure prints the same messages the
+// shell always has and leaves nothing open.
+static int open_redirections(atomic_cmd *stage, int *input_fd, int *output_fd) {
+    *input_fd = STDIN_FILENO;
+    *output_fd = STDOUT_FILENO;
+
+    if (stage->input_file != NULL) {
+        *input_fd = open(stage->input_file, O_RDONLY | O_CLOEXEC);
+        if (*input_fd < 0) {
             printf("No such file or directory\n");
-            free(new_args);
-            return;
+            return -1;
         }
-        // Remove input redirection from args
-        new_args[last_input_redirect] = NULL;
-        new_args[last_input_redirect + 1] = NULL;
     }
-    
-    // Handle output redirection (only the last one)
-    if (last_output_redirect != -1) {
-        if (new_args[last_output_redirect + 1] == NULL) {
+
+    if (stage->output_file != NULL) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (stage->append ? O_APPEND : O_TRUNC);
+        *output_fd = open(stage->output_file, flags, 0644);
+        if (*output_fd < 0) {
             printf("Unable to create file for writing\n");
-            if (input_fd != STDIN_FILENO) close(input_fd);
-            free(new_args);
-            return;
+            if (*input_fd != STDIN_FILENO) close(*input_fd);
+            return -1;
         }
-        
-        if (strcmp(new_args[last_output_redirect], ">") == 0) {
-            output_fd = open(new_args[last_output_redirect + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        } else if (strcmp(new_args[last_output_redirect], ">>") == 0) {
-            output_fd = open(new_args[last_output_redirect + 1], O_WRONLY | O_CREAT | O_APPEND, 0644);
-        }
-        
-        if (output_fd < 0) {
-            printf("Unable to create file for writing\n");
-            if (input_fd != STDIN_FILENO) close(input_fd);
-            free(new_args);
-            return;
-        }
-        
-        // Remove output redirection from args
-        new_args[last_output_redirect] = NULL;
-        new_args[last_output_redirect + 1] = NULL;
-    }
-    
-    // Now remove all other redirection operators and their arguments
-    for (i = 0; new_args[i] != NULL; i++) {
-        if (strcmp(new_args[i], ">") == 0 || strcmp(new_args[i], ">>") == 0 || strcmp(new_args[i], "<") == 0) {
-            new_args[i] = NULL;
-            if (new_args[i + 1] != NULL) {
-                new_args[i + 1] = NULL;
-                i++; // Skip the filename too
+    }
+    return 0;
+}
+
+// The most an unprivileged process may ask F_SETPIPE_SZ for.
+static long pipe_max_size(void) {
+    static long max = 0;
+    if (max == 0) {
+        max = 1048576;
+        FILE *f = fopen("/proc/sys/fs/pipe-max-size", "r");
+        if (f != NULL) {
+            if (fscanf(f, "%ld", &max) != 1) {
+                max = 1048576;
             }
+            fclose(f);
         }
     }
-    
-    // Compact the args array by removing NULL entries
-    int write_pos = 0;
-    for (i = 0; i < arg_count; i++) {
-        if (new_args[i] != NULL) {
-            if (write_pos != i) {
-                new_args[write_pos] = new_args[i];
+    return max;
+}
+
+int parse_byte_size(const char *s, long long *bytes) {
+    char *end;
+    long long n = strtoll(s, &end, 10);
+    if (end == s || n <= 0) {
+        return -1;
+    }
+    long long unit = 1;
+    if (*end == 'K' || *end == 'k') {
+        unit = 1024;
+    } else if (*end == 'M' || *end == 'm') {
+        unit = 1024 * 1024;
+    } else if (*end == 'G' || *end == 'g') {
+        unit = 1024 * 1024 * 1024;
+    }
+    if (unit != 1) {
+        end++;
+    }
+    if (*end != '\0' || n > (1LL << 50) / unit) {
+        return -1;
+    }
+    *bytes = n * unit;
+    return 0;
+}
+
+int parse_pipe_size(const char *s, long *size) {
+    if (strcmp(s, "default") == 0) {
+        *size = PIPE_SIZE_DEFAULT;
+        return 0;
+    }
+    if (strcmp(s, "auto") == 0) {
+        *size = PIPE_SIZE_AUTO;
+        return 0;
+    }
+    long long n;
+    if (parse_byte_size(s, &n) < 0 || n < 4096 || n > (1LL << 30)) {
+        return -1;
+    }
+    *size = (long)n;
+    return 0;
+}
+
+const char *pipe_size_name(long size) {
+    static char name[32];
+    if (size == PIPE_SIZE_DEFAULT) return "default";
+    if (size == PIPE_SIZE_AUTO) return "auto";
+    snprintf(name, sizeof(name), "%ld", size);
+    return name;
+}
+
+static const char *placement_names[] = { "none", "cache" };
+
+int placement_parse(const char *name, placement_mode *mode) {
+    for (int i = 0; i < (int)(sizeof(placement_names) / sizeof(placement_names[0])); i++) {
+        if (strcmp(name, placement_names[i]) == 0) {
+            *mode = (placement_mode)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *placement_name(placement_mode mode) {
+    return placement_names[mode];
+}
+
+int stage_exit_code(const job_stage *stage) {
+    if (WIFSIGNALED(stage->status)) {
+        return 128 + WTERMSIG(stage->status);
+    }
+    return WEXITSTATUS(stage->status);
+}
+
+const job_stage *deciding_stage(const job_stage *stages, int count) {
+    if (pipefail_setting) {
+        for (int i = count - 1; i >= 0; i--) {
+            if (stage_exit_code(&stages[i]) != 0) {
+                return &stages[i];
             }
-            write_pos++;
-        }
-    }
-    new_args[write_pos] = NULL;
-    
-    // Handle pipeline execution
-    start_index = 0;
-    int prev_pipe_read = STDIN_FILENO;
-    
-    for (i = 0; new_args[i] != NULL; i++) {
-        if (strcmp(new_args[i], "|") == 0) {
-            new_args[i] = NULL;
-            
-            if (pipe(pipe_fd) < 0) {
-                perror("pipe");
-                if (input_fd != STDIN_FILENO) close(input_fd);
-                if (output_fd != STDOUT_FILENO) close(output_fd);
-                free(new_args);
-                return;
+        }
+    }
+    return &stages[count - 1];
+}
+
+// Reads one 'with' option and its value into opts. Returns the number of
+// words used, or 0 if they are not a valid option.
+static int parse_with_option(char **argv, int argc, pipeline_options *opts) {
+    if (argc < 2) {
+        return 0;
+    }
+    const char *value = argv[1];
+    if (strcmp(argv[0], "-pipe") == 0) {
+        return parse_pipe_size(value, &opts->pipe_size) == 0 ? 2 : 0;
+    }
+    if (strcmp(argv[0], "-cpu") == 0) {
+        cpu_list allowed;
+        if (cpu_list_parse(value, &opts->limits.cpus) < 0) {
+            return 0;
+        }
+        // CPUs outside the shell's own set would make the launch fail
+        if (cpu_list_current(&allowed) == 0) {
+            for (int cpu = 0; cpu < CPU_LIST_MAX; cpu++) {
+                if (cpu_list_has(&opts->limits.cpus, cpu) && cpu_list_has(&allowed, cpu)) {
+                    return 2;
+                }
             }
-            
-            pid = fork();
-            if (pid < 0) {
-                perror("fork");
-                close(pipe_fd[0]);
-                close(pipe_fd[1]);
-                if (input_fd != STDIN_FILENO) close(input_fd);
-                if (output_fd != STDOUT_FILENO) close(output_fd);
-                free(new_args);
-                return;
+            return 0;
+        }
+        return 2;
+    }
+    if (strcmp(argv[0], "-nice") == 0) {
+        char *end;
+        long n = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || n < -20 || n > 19) {
+            return 0;
+        }
+        opts->limits.nice = (int)n;
+        return 2;
+    }
+    if (strcmp(argv[0], "-rss") == 0) {
+        return parse_byte_size(value, &opts->limits.mem_limit) == 0 ? 2 : 0;
+    }
+    if (strcmp(argv[0], "-place") == 0) {
+        return placement_parse(value, &opts->placement) == 0 ? 2 : 0;
+    }
+    return 0;
+}
+
+cmd_group *apply_with_prefix(cmd_group *group, pipeline_options *opts) {
+    opts->pipe_size = pipe_size_setting;
+    opts->timed = 0;
+    memset(&opts->limits, 0, sizeof(opts->limits));
+    opts->placement = placement_setting;
+    atomic_cmd *first = group->stages;
+    if (first == NULL) {
+        return group;
+    }
+
+    // 'time' and 'with' options may come in either order
+    int i = 0;
+    const char *prefix = NULL;
+    while (i < first->argc) {
+        if (strcmp(first->argv[i], "time") == 0) {
+            opts->timed = 1;
+            prefix = first->argv[i++];
+            continue;
+        }
+        if (strcmp(first->argv[i], "with") != 0) {
+            break;
+        }
+        prefix = first->argv[i++];
+        while (i < first->argc && first->argv[i][0] == '-') {
+            int used = parse_with_option(first->argv + i, first->argc - i, opts);
+            if (used == 0) {
+                break;
             }
-            
-            if (pid == 0) {
-                // Child process
-                //printf("..\n");
-                close(pipe_fd[0]);
-                if (prev_pipe_read != STDIN_FILENO) {
-                    dup2(prev_pipe_read, STDIN_FILENO);
-                    close(prev_pipe_read);
-                } else if (input_fd != STDIN_FILENO) {
-                    dup2(input_fd, STDIN_FILENO);
-                    close(input_fd);
+            i += used;
+        }
+        if (i < first->argc && first->argv[i][0] == '-') {
+            break;
+        }
+    }
+    if (prefix == NULL) {
+        return group;
+    }
+    if (i == first->argc || first->argv[i][0] == '-') {
+        printf("%s: Invalid Syntax!\n", prefix);
+        return NULL;
+    }
+
+    // The group may belong to the command cache, so it is not edited in place
+    cmd_group *copy = arena_alloc(&line_arena, sizeof(cmd_group));
+    atomic_cmd *stage = arena_alloc(&line_arena, sizeof(atomic_cmd));
+    if (copy == NULL || stage == NULL) {
+        return NULL;
+    }
+    *copy = *group;
+    *stage = *first;
+    stage->argv += i;
+    stage->argc -= i;
+    copy->stages = stage;
+    return copy;
+}
+
+// Gives a new pipe the requested capacity; above fs.pipe-max-size an
+// unprivileged shell gets the maximum instead.
+static void size_pipe(int fd, long size) {
+    if (fcntl(fd, F_SETPIPE_SZ, (int)size) >= 0 ||
+        (errno == EPERM && fcntl(fd, F_SETPIPE_SZ, (int)pipe_max_size()) >= 0)) {
+        pipe_size_stats.sized++;
+    }
+}
+
+int pipe_autosize_sample(cmd_group *group, const job_stage *stages) {
+    long max = pipe_max_size();
+    int growable = 0;
+    int i = 0;
+    for (atomic_cmd *stage = group->stages; stage != NULL; stage = stage->next, i++) {
+        if (i == 0 || stage->input_file != NULL || stages[i].state == STAGE_DONE) {
+            continue;
+        }
+        // The shell closed its ends long ago; the reader's stdin reopened
+        // through /proc reaches the same pipe for a moment
+        char link[64];
+        snprintf(link, sizeof(link), "/proc/%d/fd/0", (int)stages[i].pid);
+        int fd = open(link, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        int size = fcntl(fd, F_GETPIPE_SZ);
+        int queued;
+        if (size > 0 && size < max) {
+            // Within a page of capacity means the writer is (about to be) blocked
+            if (ioctl(fd, FIONREAD, &queued) == 0 && queued + 4096 >= size) {
+                long grown = ((long)size * 4 < max) ? (long)size * 4 : max;
+                if (fcntl(fd, F_SETPIPE_SZ, (int)grown) >= 0) {
+                    pipe_size_stats.grown++;
+                    size = (int)grown;
                 }
-                dup2(pipe_fd[1], STDOUT_FILENO);
-                close(pipe_fd[1]);
-                
-                // Handle builtin commands
-                execute_builtin_in_pipeline(new_args + start_index);
+            }
+            if (size < max) {
+                growable = 1;
+            }
+        }
+        close(fd);
+    }
+    return growable;
+}
+
+// Pipes are close-on-exec so launched commands only keep the ends that were
+// dup'ed onto their stdin/stdout.
+static int cloexec_pipe(int fds[2]) {
+    if (pipe(fds) < 0) {
+        return -1;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
+// Builtins that change the shell's own state (cwd, job control) mean
+// nothing once their output is piped, so pipelines refuse them.
+static int is_shell_state_builtin(const char *name) {
+    return strcmp(name, "hop") == 0 || strcmp(name, "fg") == 0 || strcmp(name, "bg") == 0;
+}
+
+// forall is the only builtin that reads stdin (its list of items).
+static int builtin_reads_stdin(const char *name) {
+    return strcmp(name, "forall") == 0;
+}
+
+// Points target (stdin or stdout) at fd; returns a saved copy of the
+// original to hand to restore_fd, or -1 if nothing was changed.
+static int redirect_fd(int fd, int target) {
+    if (fd < 0 || fd == target) {
+        return -1;
+    }
+    int saved = fcntl(target, F_DUPFD_CLOEXEC, 3);
+    if (saved < 0) {
+        perror("dup");
+        return -1;
+    }
+    dup2(fd, target);
+    return saved;
+}
+
+static void restore_fd(int saved, int target) {
+    if (saved >= 0) {
+        dup2(saved, target);
+        close(saved);
+    }
+}
+
+// Runs a builtin stage in the shell with stdin/stdout pointed at the
+// stage's descriptors. The stage's reader has already been started, and
+// SIGPIPE is ignored so a reader that exits early only makes the remaining
+// writes fail. Returns the builtin's exit code.
+static int run_builtin_stage(atomic_cmd *stage, int stdin_fd, int stdout_fd) {
+    fflush(stdout);
+    int saved_stdin = redirect_fd(stdin_fd, STDIN_FILENO);
+    int saved_stdout = redirect_fd(stdout_fd, STDOUT_FILENO);
+
+    run_builtin(stage->argv);
+
+    if (fflush(stdout) != 0) {
+        __fpurge(stdout); // the reader is gone; drop what it never read
+    }
+    clearerr(stdout);
+    restore_fd(saved_stdout, STDOUT_FILENO);
+    restore_fd(saved_stdin, STDIN_FILENO);
+    return last_status;
+}
+
+// A 'cat' with only file operands (no options, no '-') just moves bytes,
+// which the shell can do itself without starting a process.
+static int is_copy_stage(atomic_cmd *stage) {
+    if (strcmp(stage->argv[0], "cat") != 0) {
+        return 0;
+    }
+    for (int i = 1; i < stage->argc; i++) {
+        if (stage->argv[i][0] == '-') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int runs_in_shell(atomic_cmd *stage) {
+    return stage != NULL && (is_builtin(stage->argv[0]) || is_copy_stage(stage));
+}
+
+// The shell copies a foreground 'cat' stage itself when it has something
+// other than the terminal to read and both neighbours are real processes;
+// two stages run by the shell could otherwise wait on each other.
+static int use_copy_fast_path(cmd_group *group, atomic_cmd *prev, atomic_cmd *stage) {
+    return !group->is_background && is_copy_stage(stage) &&
+           (stage->argc > 1 || stage->input_file != NULL || prev != NULL) &&
+           !runs_in_shell(prev) && !runs_in_shell(stage->next);
+}
+
+// Returns 0, or 1 after reporting an error.
+static int copy_into(int in_fd, int out_fd, const char *name) {
+    struct stat in_st, out_st;
+    int out_regular = fstat(out_fd, &out_st) == 0 && S_ISREG(out_st.st_mode);
+    if (out_regular && fstat(in_fd, &in_st) == 0 &&
+        in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino && in_st.st_size > 0) {
+        fprintf(stderr, "cat: %s: input file is output file\n", name);
+        return 1;
+    }
+    // copy_file_range and sendfile refuse O_APPEND descriptors. A '>>' file
+    // the shell opened itself is positioned at its end and copied into
+    // directly, then put back in append mode.
+    int append_flags = -1;
+    if (out_fd != STDOUT_FILENO && out_regular) {
+        int flags = fcntl(out_fd, F_GETFL);
+        if (flags >= 0 && (flags & O_APPEND) && fcntl(out_fd, F_SETFL, flags & ~O_APPEND) == 0) {
+            append_flags = flags;
+            lseek(out_fd, 0, SEEK_END);
+        }
+    }
+    // A reader that went away early is not an error, as with a real cat
+    // killed by SIGPIPE
+    int failed = 0;
+    if (fast_copy(in_fd, out_fd, events_interrupted) < 0 && errno != EPIPE) {
+        fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+        failed = 1;
+    }
+    if (append_flags >= 0) {
+        fcntl(out_fd, F_SETFL, append_flags);
+    }
+    return failed;
+}
+
+// Runs a 'cat' stage in the shell: each operand, or stdin_fd when there
+// are none, is copied to stdout_fd. Returns cat's exit code.
+static int run_copy_stage(atomic_cmd *stage, int stdin_fd, int stdout_fd) {
+    shell_interrupted = 0;
+    if (stage->argc == 1) {
+        return copy_into(stdin_fd, stdout_fd, "-");
+    }
+    int failed = 0;
+    for (int i = 1; i < stage->argc && !shell_interrupted; i++) {
+        int fd = open(stage->argv[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "cat: %s: %s\n", stage->argv[i], strerror(errno));
+            failed = 1;
+            continue;
+        }
+        failed |= copy_into(fd, stdout_fd, stage->argv[i]);
+        close(fd);
+    }
+    return failed;
+}
+
+// Executes a command group with pipelines and redirection. External
+// stages are direct children of the shell and join the process group led
+// by the first one started, which is stored in *pgid. Builtin stages run
+// in the shell itself once every external stage is running, and so do
+// plain 'cat' stages, so only real commands cost a process. A builtin
+// writing into a pipe writes into a memfd instead, which events_wait then
+// feeds to the pipe as its reader drains it, so a slow or stopped reader
+// never holds up the shell. Returns the number of processes started; the
+// caller waits for them.
+int execute_command_group(cmd_group *group, const pipeline_options *opts, pid_t *pgid,
+                          job_stage *stages) {
+    int pipe_fd[2];
+    int prev_pipe_read = -1;
+    int launched = 0;
+    *pgid = 0;
+
+    // Stages the shell runs itself wait here, holding their descriptors,
+    // until the external stages around them have been launched
+    atomic_cmd **local_stages = arena_alloc(&line_arena, group->stage_count * sizeof(atomic_cmd *));
+    int *local_in = arena_alloc(&line_arena, group->stage_count * sizeof(int));
+    int *local_out = arena_alloc(&line_arena, group->stage_count * sizeof(int));
+    int *local_index = arena_alloc(&line_arena, group->stage_count * sizeof(int));
+    int *local_piped = arena_alloc(&line_arena, group->stage_count * sizeof(int));
+    int local_count = 0;
+    if (local_stages == NULL || local_in == NULL || local_out == NULL || local_index == NULL ||
+        local_piped == NULL) {
+        return 0;
+    }
+
+    // Cache placement hands each external stage the next CPU in an order
+    // where neighbours share a cache, so what one stage writes into a pipe
+    // is read by a core that likely still holds it
+    int *place_order = NULL;
+    int place_count = 0;
+    unsigned placed = place_cursor;
+    if (opts->placement == PLACE_CACHE && group->stage_count > 1) {
+        cpu_list allowed = opts->limits.cpus;
+        if (cpu_list_count(&allowed) == 0) {
+            cpu_list_current(&allowed);
+        }
+        place_order = arena_alloc(&line_arena, CPU_LIST_MAX * sizeof(int));
+        if (place_order != NULL) {
+            place_count = cpu_cache_order(&allowed, place_order, CPU_LIST_MAX);
+        }
+    }
+
+    // Anything a builtin printed must reach the terminal before the stages do
+    fflush(stdout);
+
+    // Stages never reached (a redirection failed) count as not run
+    int stage_index = 0;
+    for (atomic_cmd *stage = group->stages; stage != NULL; stage = stage->next, stage_index++) {
+        memset(&stages[stage_index], 0, sizeof(job_stage));
+        stages[stage_index].pidfd = -1;
+        stages[stage_index].state = STAGE_DONE;
+        stages[stage_index].status = STATUS_NOT_FOUND;
+        stages[stage_index].name = stage->argv[0];
+    }
+
+    stage_index = 0;
+    atomic_cmd *prev = NULL;
+    for (atomic_cmd *stage = group->stages; stage != NULL; prev = stage, stage = stage->next) {
+        int input_fd, output_fd;
+        if (open_redirections(stage, &input_fd, &output_fd) < 0) {
+            stages[stage_index].status = STATUS_FAILED;
+            break;
+        }
+        stages[stage_index].status = 0;
+
+        pipe_fd[0] = pipe_fd[1] = -1;
+        if (stage->next != NULL && cloexec_pipe(pipe_fd) < 0) {
+            perror("pipe");
+            stages[stage_index].status = STATUS_FAILED;
+            if (input_fd != STDIN_FILENO) close(input_fd);
+            if (output_fd != STDOUT_FILENO) close(output_fd);
+            break;
+        }
+        if (pipe_fd[1] >= 0 && opts->pipe_size > 0) {
+            size_pipe(pipe_fd[1], opts->pipe_size);
+        }
+
+        // An explicit redirection wins over the pipe
+        int stdin_fd = (input_fd != STDIN_FILENO) ? input_fd : prev_pipe_read;
+        int stdout_fd = (output_fd != STDOUT_FILENO) ? output_fd : pipe_fd[1];
+        int keep_in = -1, keep_out = -1;
+
+        pid_t pid = -1;
+        if (is_builtin(stage->argv[0])) {
+            if (group->stage_count > 1 && is_shell_state_builtin(stage->argv[0])) {
+                fprintf(stderr, "%s: cannot be used in a pipeline\n", stage->argv[0]);
+                stages[stage_index].status = STATUS_FAILED;
+            } else if (builtin_reads_stdin(stage->argv[0]) && runs_in_shell(prev)) {
+                // Its writer would only run after it, so nothing would arrive
+                fprintf(stderr, "%s: cannot read from a builtin\n", stage->argv[0]);
+                stages[stage_index].status = STATUS_FAILED;
+            } else {
+                // Other builtins never read stdin, so only stdout is kept
+                keep_in = builtin_reads_stdin(stage->argv[0]) ? stdin_fd : -1;
+                keep_out = (stdout_fd >= 0) ? stdout_fd : STDOUT_FILENO;
+                local_stages[local_count] = stage;
+                local_index[local_count] = stage_index;
+                local_piped[local_count] = (keep_out == pipe_fd[1]);
+                local_in[local_count] = keep_in;
+                local_out[local_count++] = keep_out;
+            }
+        } else if (use_copy_fast_path(group, prev, stage)) {
+            keep_in = stdin_fd;
+            keep_out = (stdout_fd >= 0) ? stdout_fd : STDOUT_FILENO;
+            local_stages[local_count] = stage;
+            local_index[local_count] = stage_index;
+            local_piped[local_count] = 0;
+            local_in[local_count] = keep_in;
+            local_out[local_count++] = keep_out;
+        } else {
+            // Names without a '/' resolve through the PATH hash; a cached
+            // miss is reported without starting a process at all
+            const char *path = stage->argv[0];
+            if (strchr(path, '/') == NULL) {
+                path = path_lookup(path);
+            }
+            if (path == NULL) {
+                fprintf(stderr, "Command not found!\n");
+                stages[stage_index].status = STATUS_NOT_FOUND;
             } else {
-                // Parent process
-                close(pipe_fd[1]);
-                if (prev_pipe_read != STDIN_FILENO) {
-                    close(prev_pipe_read);
+                launch_limits limits = opts->limits;
+                if (place_count > 0) {
+                    cpu_list_clear(&limits.cpus);
+                    cpu_list_add(&limits.cpus, place_order[placed++ % (unsigned)place_count]);
+                }
+                launch_request req = {
+                    .argv = stage->argv,
+                    .path = path,
+                    .stdin_fd = stdin_fd,
+                    .stdout_fd = stdout_fd,
+                    .pgid = *pgid,
+                    .limits = &limits,
+                };
+                usage_begin(&stages[stage_index].usage);
+                pid = launch_external(&req);
+                if (pid < 0) {
+                    stages[stage_index].status = STATUS_NOT_FOUND;
                 }
-                prev_pipe_read = pipe_fd[0];
-                start_index = i + 1;
             }
         }
-    }
-    
-    // Execute the last/only command
-    pid = fork();
-    if (pid < 0) {
-        perror("fork");
-        if (prev_pipe_read != STDIN_FILENO) close(prev_pipe_read);
-        if (input_fd != STDIN_FILENO) close(input_fd);
-        if (output_fd != STDOUT_FILENO) close(output_fd);
-        free(new_args);
-        return;
-    }
-    
-    if (pid == 0) {
-        // Child process - last command in pipeline
-        if (prev_pipe_read != STDIN_FILENO) {
-            dup2(prev_pipe_read, STDIN_FILENO);
+        if (pid > 0) {
+            if (*pgid == 0) {
+                *pgid = pid;
+            }
+            launched++;
+        }
+        stages[stage_index].pid = (pid > 0) ? pid : 0;
+        stages[stage_index].state = (pid > 0) ? STAGE_RUNNING : STAGE_DONE;
+        stage_index++;
+
+        // Parent process
+        if (prev_pipe_read >= 0 && prev_pipe_read != keep_in) {
             close(prev_pipe_read);
-        } else if (input_fd != STDIN_FILENO) {
-            dup2(input_fd, STDIN_FILENO);
+        }
+        if (input_fd != STDIN_FILENO && input_fd != keep_in) {
             close(input_fd);
         }
-        
-        if (output_fd != STDOUT_FILENO) {
-            dup2(output_fd, STDOUT_FILENO);
+        if (output_fd != STDOUT_FILENO && output_fd != keep_out) {
             close(output_fd);
         }
-        
-        execute_builtin_in_pipeline(new_args + start_index);
-    } else {
-        // Parent process - wait for completion
-        if (prev_pipe_read != STDIN_FILENO) {
-            close(prev_pipe_read);
+        if (pipe_fd[1] >= 0 && pipe_fd[1] != keep_out) {
+            close(pipe_fd[1]);
         }
-        if (input_fd != STDIN_FILENO) {
-            close(input_fd);
+        prev_pipe_read = pipe_fd[0];
+    }
+
+    if (prev_pipe_read >= 0) {
+        close(prev_pipe_read);
+    }
+    if (place_count > 0) {
+        place_cursor = placed;
+    }
+
+    if (local_count > 0) {
+        // The shell now holds no read end of any pipe except those of 'cat'
+        // and forall stages fed by real processes, so a builtin whose reader is another
+        // builtin gets EPIPE instead of blocking forever
+        struct sigaction ignore, saved_pipe;
+        memset(&ignore, 0, sizeof(ignore));
+        ignore.sa_handler = SIG_IGN;
+        sigemptyset(&ignore.sa_mask);
+        sigaction(SIGPIPE, &ignore, &saved_pipe);
+
+        // Ctrl+C while a builtin feeds a foreground pipeline reaches its readers
+        pid_t saved_foreground = foreground_pgid;
+        if (!group->is_background && *pgid != 0) {
+            foreground_pgid = *pgid;
         }
-        if (output_fd != STDOUT_FILENO) {
-            close(output_fd);
+        for (int i = 0; i < local_count; i++) {
+            job_stage *result = &stages[local_index[i]];
+            struct rusage before;
+            usage_begin(&result->usage);
+            usage_self(&before);
+            int code;
+            if (is_builtin(local_stages[i]->argv[0])) {
+                int buffer = local_piped[i] ? memfd_create("builtin-output", MFD_CLOEXEC) : -1;
+                code = run_builtin_stage(local_stages[i], local_in[i], (buffer >= 0) ? buffer : local_out[i]);
+                if (buffer >= 0) {
+                    events_feed(buffer, local_out[i]);
+                    local_out[i] = STDOUT_FILENO; // the feed closes it
+                }
+            } else {
+                code = run_copy_stage(local_stages[i], local_in[i], local_out[i]);
+            }
+            result->status = code << 8; // as wait() would report it
+            usage_end_self(&result->usage, &before);
+            if (local_in[i] >= 0) {
+                close(local_in[i]);
+            }
+            if (local_out[i] != STDOUT_FILENO) {
+                close(local_out[i]);
+            }
         }
-        
-        // Wait for all children
-        int status;
-        while (wait(&status) > 0);
+        foreground_pgid = saved_foreground;
+        sigaction(SIGPIPE, &saved_pipe, NULL);
     }
-    
-    free(new_args);
+    return launched;
 }
@@ -0,0 +1,1023 @@
+#define _GNU_SOURCE // getdents64, statx
+#include "shell.h"
+#include "arena.h"
+#include "events.h"
+#include "dircache.h"
+#include "strsort.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <grp.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define DENTS_BUFFER_SIZE (1 << 20)
+#define NAME_CHUNK_SIZE (1 << 20)
+
+// Metadata for -l is fetched by this many threads at most, and only for
+// directories big enough to repay starting them
+#define STAT_THREADS_MAX 16
+#define STAT_THREADS_MIN 4   // statx mostly waits on the filesystem, not the CPU
+#define STAT_PARALLEL_MIN 256
+#define STAT_BATCH 64
+
+// What -l shows of an entry; stat_ok is 0 if it vanished before statx
+typedef struct {
+    int stat_ok;
+    uint16_t mode;
+    uint32_t nlink;
+    uint32_t uid, gid;
+    uint64_t size;
+    int64_t mtime;
+} reveal_meta;
+
+// Names are packed back to back in the arena, each after the DT_* type the
+// directory reported for it, and sorted by moving the pointers alone.
+typedef struct {
+    arena pool;
+    const char **names;
+    size_t count;
+    size_t cap;
+    reveal_meta *meta; // parallel to names once fetched
+    size_t meta_cap;
+} listing;
+
+#define NAME_TYPE(name) ((unsigned char)(name)[-1])
+
+static int is_dot_or_dotdot(const char *name) {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+// Reads the whole directory with getdents64 through buf, which holds
+// DENTS_BUFFER_SIZE bytes, copying names into the listing's arena.
+static int read_listing(int dir_fd, int show_all, listing *out, char *buf) {
+    while (1) {
+        ssize_t n = getdents64(dir_fd, buf, DENTS_BUFFER_SIZE);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        for (ssize_t off = 0; off < n;) {
+            struct dirent64 *d = (struct dirent64 *)(buf + off);
+            off += d->d_reclen;
+            if (!show_all && d->d_name[0] == '.') {
+                continue;
+            }
+            if (out->count == out->cap) {
+                size_t cap = (out->cap == 0) ? 1024 : out->cap * 2;
+                const char **grown = realloc(out->names, cap * sizeof(char *));
+                if (grown == NULL) {
+                    perror("realloc");
+                    return -1;
+                }
+                out->names = grown;
+                out->cap = cap;
+            }
+            size_t len = strlen(d->d_name);
+            char *copy = arena_alloc_packed(&out->pool, len + 2);
+            if (copy == NULL) {
+                return -1;
+            }
+            copy[0] = (char)d->d_type;
+            memcpy(copy + 1, d->d_name, len + 1);
+            out->names[out->count++] = copy + 1;
+        }
+    }
+    return 0;
+}
+
+// Zeroed metadata slots for every name in the listing.
+static int listing_meta(listing *list) {
+    if (list->count > list->meta_cap) {
+        reveal_meta *grown = realloc(list->meta, list->count * sizeof(reveal_meta));
+        if (grown == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        list->meta = grown;
+        list->meta_cap = list->count;
+    }
+    if (list->count > 0) {
+        memset(list->meta, 0, list->count * sizeof(reveal_meta));
+    }
+    return 0;
+}
+
+typedef struct {
+    int dir_fd;
+    const char **names;
+    reveal_meta *meta;
+    size_t count;
+    size_t next; // first entry not yet claimed
+} stat_job;
+
+static void stat_entry(int dir_fd, const char *name, reveal_meta *meta) {
+    struct statx st;
+    unsigned mask = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID | STATX_SIZE | STATX_MTIME;
+    if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW, mask, &st) < 0) {
+        return;
+    }
+    meta->stat_ok = 1;
+    meta->mode = st.stx_mode;
+    meta->nlink = st.stx_nlink;
+    meta->uid = st.stx_uid;
+    meta->gid = st.stx_gid;
+    meta->size = st.stx_size;
+    meta->mtime = st.stx_mtime.tv_sec;
+}
+
+// Claims batches of entries until none are left.
+static void *stat_worker(void *arg) {
+    stat_job *job = arg;
+    while (1) {
+        size_t first = __atomic_fetch_add(&job->next, STAT_BATCH, __ATOMIC_RELAXED);
+        if (first >= job->count) {
+            break;
+        }
+        size_t last = (first + STAT_BATCH < job->count) ? first + STAT_BATCH : job->count;
+        for (size_t i = first; i < last; i++) {
+            stat_entry(job->dir_fd, job->names[i], &job->meta[i]);
+        }
+    }
+    return NULL;
+}
+
+// statx for every entry, relative to the directory so no path is resolved
+// twice. Big directories are spread over a pool so many requests are in
+// flight at once; the calling thread works too.
+static void stat_entries(int dir_fd, const char **names, reveal_meta *meta, size_t count) {
+    stat_job job = { dir_fd, names, meta, count, 0 };
+    pthread_t threads[STAT_THREADS_MAX];
+    int thread_count = 0;
+    if (count >= STAT_PARALLEL_MIN) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int wanted = (cpus < STAT_THREADS_MIN) ? STAT_THREADS_MIN : (cpus > STAT_THREADS_MAX) ? STAT_THREADS_MAX : (int)cpus;
+        if ((size_t)wanted > count / STAT_BATCH) {
+            wanted = (int)(count / STAT_BATCH);
+        }
+        for (int i = 1; i < wanted; i++) {
+            if (pthread_create(&threads[thread_count], NULL, stat_worker, &job) != 0) {
+                break;
+            }
+            thread_count++;
+        }
+    }
+    stat_worker(&job);
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+// Owner and group names, looked up once per id for the life of the shell;
+// a directory rarely has more than a handful. Walker threads share it.
+#define ID_CACHE_SIZE 64
+
+typedef struct {
+    uint32_t id;
+    int used;
+    char name[32];
+} id_name;
+
+static id_name user_names[ID_CACHE_SIZE];
+static id_name group_names[ID_CACHE_SIZE];
+static pthread_mutex_t id_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void id_lookup(id_name *cache, uint32_t id, int group, char out[32]) {
+    pthread_mutex_lock(&id_lock);
+    id_name *slot = &cache[id % ID_CACHE_SIZE];
+    if (!slot->used || slot->id != id) {
+        // getpwuid and getgrgid are only ever called under id_lock
+        const char *name = NULL;
+        if (group) {
+            struct group *gr = getgrgid(id);
+            name = (gr != NULL) ? gr->gr_name : NULL;
+        } else {
+            struct passwd *pw = getpwuid(id);
+            name = (pw != NULL) ? pw->pw_name : NULL;
+        }
+        if (name != NULL) {
+            snprintf(slot->name, sizeof(slot->name), "%s", name);
+        } else {
+            snprintf(slot->name, sizeof(slot->name), "%u", id);
+        }
+        slot->id = id;
+        slot->used = 1;
+    }
+    memcpy(out, slot->name, sizeof(slot->name));
+    pthread_mutex_unlock(&id_lock);
+}
+
+// Output is built up in memory and written with one fwrite per directory,
+// or, when spilling, every TEXT_SPILL bytes so memory stays bounded.
+#define TEXT_SPILL (1 << 20)
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    int spill;
+} text_buf;
+
+static void text_flush(text_buf *out) {
+    if (out->len > 0) {
+        fwrite(out->data, 1, out->len, stdout);
+        out->len = 0;
+    }
+}
+
+static void text_reserve(text_buf *out, size_t more) {
+    if (out->spill && out->len + more > TEXT_SPILL) {
+        text_flush(out);
+    }
+    if (out->len + more <= out->cap) {
+        return;
+    }
+    size_t cap = (out->cap == 0) ? 4096 : out->cap;
+    while (cap < out->len + more) {
+        cap *= 2;
+    }
+    char *grown = realloc(out->data, cap);
+    if (grown == NULL) {
+        perror("realloc");
+        return;
+    }
+    out->data = grown;
+    out->cap = cap;
+}
+
+static void text_printf(text_buf *out, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return;
+    }
+    text_reserve(out, (size_t)n + 1);
+    if (out->len + (size_t)n + 1 > out->cap) {
+        return;
+    }
+    va_start(ap, fmt);
+    vsnprintf(out->data + out->len, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    out->len += (size_t)n;
+}
+
+static void text_append(text_buf *out, const char *s, size_t len) {
+    text_reserve(out, len);
+    if (out->len + len <= out->cap) {
+        memcpy(out->data + out->len, s, len);
+        out->len += len;
+    }
+}
+
+static void format_mode(uint16_t mode, char *out) {
+    char type = '-';
+    switch (mode & S_IFMT) {
+    case S_IFDIR: type = 'd'; break;
+    case S_IFLNK: type = 'l'; break;
+    case S_IFCHR: type = 'c'; break;
+    case S_IFBLK: type = 'b'; break;
+    case S_IFIFO: type = 'p'; break;
+    case S_IFSOCK: type = 's'; break;
+    }
+    out[0] = type;
+    const char *rwx = "rwxrwxrwx";
+    for (int i = 0; i < 9; i++) {
+        out[i + 1] = (mode & (0400 >> i)) ? rwx[i] : '-';
+    }
+    if (mode & S_ISUID) out[3] = (mode & S_IXUSR) ? 's' : 'S';
+    if (mode & S_ISGID) out[6] = (mode & S_IXGRP) ? 's' : 'S';
+    if (mode & S_ISVTX) out[9] = (mode & S_IXOTH) ? 't' : 'T';
+    out[10] = '\0';
+}
+
+// Like ls: month, day and time for the last six months, the year otherwise.
+static void format_mtime(int64_t mtime, time_t now, char *out, size_t len) {
+    time_t t = (time_t)mtime;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    int recent = (t <= now + 3600 && now - t < 182L * 24 * 3600);
+    strftime(out, len, recent ? "%b %e %H:%M" : "%b %e  %Y", &tm);
+}
+
+// Long-format lines for the entries; with a directory, names are shown as
+// paths under it.
+static void format_long(text_buf *out, const char **names, const reveal_meta *meta, size_t count,
+                        const char *dir) {
+    int link_width = 1, user_width = 1, group_width = 1, size_width = 1;
+    char num[32], user[32], group[32];
+    for (size_t i = 0; i < count; i++) {
+        const reveal_meta *m = &meta[i];
+        if (!m->stat_ok) continue;
+        int w = snprintf(num, sizeof(num), "%u", m->nlink);
+        if (w > link_width) link_width = w;
+        w = snprintf(num, sizeof(num), "%llu", (unsigned long long)m->size);
+        if (w > size_width) size_width = w;
+        id_lookup(user_names, m->uid, 0, user);
+        w = (int)strlen(user);
+        if (w > user_width) user_width = w;
+        id_lookup(group_names, m->gid, 1, group);
+        w = (int)strlen(group);
+        if (w > group_width) group_width = w;
+    }
+
+    time_t now = time(NULL);
+    const char *sep = (dir != NULL) ? "/" : "";
+    if (dir == NULL) {
+        dir = "";
+    }
+    for (size_t i = 0; i < count; i++) {
+        const reveal_meta *m = &meta[i];
+        if (!m->stat_ok) {
+            text_printf(out, "?????????? %*s %-*s %-*s %*s %12s %s%s%s\n", link_width, "?", user_width, "?",
+                        group_width, "?", size_width, "?", "?", dir, sep, names[i]);
+            continue;
+        }
+        char mode[11], when[32];
+        format_mode(m->mode, mode);
+        format_mtime(m->mtime, now, when, sizeof(when));
+        id_lookup(user_names, m->uid, 0, user);
+        id_lookup(group_names, m->gid, 1, group);
+        text_printf(out, "%s %*u %-*s %-*s %*llu %s %s%s%s\n", mode, link_width, m->nlink,
+                    user_width, user, group_width, group,
+                    size_width, (unsigned long long)m->size, when, dir, sep, names[i]);
+    }
+}
+
+// The short format: names on one line, each followed by a space.
+static void format_names(text_buf *out, const char **names, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        size_t len = strlen(names[i]);
+        text_reserve(out, len + 1);
+        if (out->len + len + 1 <= out->cap) {
+            memcpy(out->data + out->len, names[i], len);
+            out->data[out->len + len] = ' ';
+            out->len += len + 1;
+        }
+    }
+}
+
+// --- reveal -R: a parallel walk ---
+//
+// Each directory is a node. Worker threads keep their own deque of nodes
+// to read, taking the newest from their own and stealing the oldest from
+// others when it runs dry, so each thread walks a subtree depth first
+// while idle threads split off whole subtrees. A node is opened with
+// openat() relative to its parent's descriptor, which stays open until
+// every subdirectory has been opened from it.
+//
+// Ordered output is a pre-order walk of the finished nodes by the calling
+// thread, each directory sorted and printed as a block once it has been
+// read; unordered output (-U) is written by the workers as they go, one
+// path per line.
+
+#define WALK_THREADS_MAX 16
+#define WALK_THREADS_MIN 4 // the walk mostly waits on the filesystem
+
+typedef struct walk_node {
+    struct walk_node *parent; // opened relative to its descriptor
+    char *path;
+    const char *name;         // last component, inside path
+    int fd;                   // closed once every child has been opened from it
+    int opens;                // children that have not opened themselves yet
+    int refs;                 // self, children not yet opened, the printer
+    int done;                 // read, under walk->lock
+    text_buf text;
+    struct walk_node **children;
+    size_t child_count;
+} walk_node;
+
+typedef struct {
+    pthread_mutex_t lock;
+    walk_node **items; // a ring: head is the oldest node, head + count the newest
+    size_t head, count, cap;
+} walk_deque;
+
+typedef struct {
+    int show_all, long_format, ordered;
+    int thread_count;
+    walk_deque *deques;
+    size_t queued;  // nodes in all deques
+    size_t pending; // nodes queued or being read
+    int stop;
+    pthread_mutex_t lock; // for sleeping, done flags and unordered output
+    pthread_cond_t work;  // something was queued, or the walk ended
+    pthread_cond_t progress; // a node is done, or the walk ended
+} walk_state;
+
+typedef struct {
+    walk_state *walk;
+    int index;
+    char *dents;
+    listing list;
+} walk_worker;
+
+static walk_node *new_node(walk_node *parent, const char *path, size_t path_len, const char *name) {
+    walk_node *node = calloc(1, sizeof(walk_node));
+    size_t name_len = strlen(name);
+    size_t len = path_len + (parent != NULL ? 1 + name_len : 0);
+    char *full = malloc(len + 1);
+    if (node == NULL || full == NULL) {
+        perror("malloc");
+        free(node);
+        free(full);
+        return NULL;
+    }
+    memcpy(full, path, path_len);
+    if (parent != NULL) {
+        full[path_len] = '/';
+        memcpy(full + path_len + 1, name, name_len);
+    }
+    full[len] = '\0';
+    node->parent = parent;
+    node->path = full;
+    node->name = (parent != NULL) ? full + path_len + 1 : full;
+    node->fd = -1;
+    return node;
+}
+
+// Drops one reference; the last one frees the node, and closes its
+// descriptor if a stopped walk left it open.
+static void release_node(walk_node *node) {
+    if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    if (node->fd >= 0) {
+        close(node->fd);
+    }
+    free(node->path);
+    free(node->text.data);
+    free(node->children);
+    free(node);
+}
+
+static void push_node(walk_state *walk, int index, walk_node *node) {
+    walk_deque *dq = &walk->deques[index];
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count == dq->cap) {
+        size_t cap = (dq->cap == 0) ? 256 : dq->cap * 2;
+        walk_node **grown = malloc(cap * sizeof(walk_node *));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&dq->lock);
+            perror("malloc");
+            return;
+        }
+        for (size_t i = 0; i < dq->count; i++) {
+            grown[i] = dq->items[(dq->head + i) % dq->cap];
+        }
+        free(dq->items);
+        dq->items = grown;
+        dq->head = 0;
+        dq->cap = cap;
+    }
+    dq->items[(dq->head + dq->count) % dq->cap] = node;
+    dq->count++;
+    pthread_mutex_unlock(&dq->lock);
+
+    __atomic_add_fetch(&walk->queued, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&walk->lock);
+    pthread_cond_signal(&walk->work);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+// The newest node of the worker's own deque, else the oldest of another's.
+static walk_node *take_node(walk_state *walk, int index) {
+    for (int k = 0; k < walk->thread_count; k++) {
+        walk_deque *dq = &walk->deques[(index + k) % walk->thread_count];
+        walk_node *node = NULL;
+        pthread_mutex_lock(&dq->lock);
+        if (dq->count > 0) {
+            if (k == 0) {
+                node = dq->items[(dq->head + dq->count - 1) % dq->cap];
+            } else {
+                node = dq->items[dq->head];
+                dq->head = (dq->head + 1) % dq->cap;
+            }
+            dq->count--;
+        }
+        pthread_mutex_unlock(&dq->lock);
+        if (node != NULL) {
+            __atomic_sub_fetch(&walk->queued, 1, __ATOMIC_SEQ_CST);
+            return node;
+        }
+    }
+    return NULL;
+}
+
+static int is_subdir(const char *name, const reveal_meta *meta) {
+    if (is_dot_or_dotdot(name)) {
+        return 0;
+    }
+    return NAME_TYPE(name) == DT_DIR ||
+           (NAME_TYPE(name) == DT_UNKNOWN && meta->stat_ok && S_ISDIR(meta->mode));
+}
+
+// Reads one directory, queues its subdirectories and formats its entries.
+static void read_node(walk_worker *worker, walk_node *node) {
+    walk_state *walk = worker->walk;
+    listing *list = &worker->list;
+    list->count = 0;
+    arena_reset(&list->pool);
+
+    int stop = __atomic_load_n(&walk->stop, __ATOMIC_RELAXED);
+    if (!stop) {
+        node->fd = (node->parent != NULL)
+            ? openat(node->parent->fd, node->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+            : open(node->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (node->parent != NULL) {
+        // The printer may hold the parent much longer; its descriptor is
+        // not needed once all its children are open
+        walk_node *parent = node->parent;
+        if (__atomic_sub_fetch(&parent->opens, 1, __ATOMIC_ACQ_REL) == 0) {
+            close(parent->fd);
+            parent->fd = -1;
+        }
+        release_node(parent);
+    }
+    if (node->fd >= 0 && read_listing(node->fd, walk->show_all, list, worker->dents) < 0) {
+        fprintf(stderr, "reveal: %s: %s\n", node->path, strerror(errno));
+    } else if (node->fd < 0 && !stop) {
+        fprintf(stderr, "reveal: %s: %s\n", node->path, strerror(errno));
+    }
+
+    if (walk->ordered) {
+        sort_strings(list->names, list->count);
+    }
+    if (listing_meta(list) < 0) {
+        list->count = 0;
+    }
+
+    // Subdirectories, found from d_type or, where the filesystem does not
+    // fill it in, from the metadata
+    size_t dirs = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        const char *name = list->names[i];
+        if (walk->long_format || (NAME_TYPE(name) == DT_UNKNOWN && !is_dot_or_dotdot(name))) {
+            stat_entry(node->fd, name, &list->meta[i]);
+        }
+        dirs += is_subdir(name, &list->meta[i]);
+    }
+    if (dirs > 0 && walk->ordered) {
+        node->children = malloc(dirs * sizeof(walk_node *));
+        if (node->children == NULL) {
+            perror("malloc");
+            dirs = 0;
+        }
+    }
+    __atomic_add_fetch(&node->refs, (int)dirs, __ATOMIC_RELAXED);
+    size_t path_len = strlen(node->path);
+    walk_node **queued = NULL;
+    size_t queued_count = 0;
+    if (dirs > 0) {
+        queued = malloc(dirs * sizeof(walk_node *));
+    }
+    for (size_t i = 0; i < list->count && queued_count < dirs && queued != NULL; i++) {
+        if (!is_subdir(list->names[i], &list->meta[i])) {
+            continue;
+        }
+        walk_node *child = new_node(node, node->path, path_len, list->names[i]);
+        if (child == NULL) {
+            break;
+        }
+        child->refs = walk->ordered ? 2 : 1; // itself, and the printer
+        queued[queued_count++] = child;
+    }
+    // Children never created give their parent references back
+    for (size_t i = queued_count; i < dirs; i++) {
+        release_node(node);
+    }
+    // From here on the children own the descriptor, and the last of them
+    // to open itself closes it
+    if (queued_count == 0 && node->fd >= 0) {
+        close(node->fd);
+        node->fd = -1;
+    }
+    __atomic_store_n(&node->opens, (int)queued_count, __ATOMIC_RELEASE);
+
+    text_buf *out = &node->text;
+    if (walk->ordered) {
+        text_printf(out, "%s:\n", node->path);
+        if (walk->long_format) {
+            format_long(out, list->names, list->meta, list->count, NULL);
+        } else if (list->count > 0) {
+            format_names(out, list->names, list->count);
+            text_append(out, "\n", 1);
+        }
+    } else {
+        // One path per line, like find, so . and .. add nothing
+        size_t kept = 0;
+        for (size_t i = 0; i < list->count; i++) {
+            if (!is_dot_or_dotdot(list->names[i])) {
+                list->names[kept] = list->names[i];
+                list->meta[kept++] = list->meta[i];
+            }
+        }
+        if (walk->long_format) {
+            format_long(out, list->names, list->meta, kept, node->path);
+        } else {
+            for (size_t i = 0; i < kept; i++) {
+                text_append(out, node->path, path_len);
+                text_append(out, "/", 1);
+                text_append(out, list->names[i], strlen(list->names[i]));
+                text_append(out, "\n", 1);
+            }
+        }
+    }
+
+    __atomic_add_fetch(&walk->pending, queued_count, __ATOMIC_SEQ_CST);
+    // Pushed newest-last in reverse, so this worker continues with the
+    // first subdirectory in name order
+    for (size_t i = queued_count; i > 0; i--) {
+        push_node(walk, worker->index, queued[i - 1]);
+    }
+
+    pthread_mutex_lock(&walk->lock);
+    if (walk->ordered) {
+        if (queued_count > 0) {
+            memcpy(node->children, queued, queued_count * sizeof(walk_node *));
+        }
+        node->child_count = queued_count;
+        node->done = 1;
+    } else if (out->len > 0) {
+        fwrite(out->data, 1, out->len, stdout);
+        out->len = 0;
+    }
+    pthread_mutex_unlock(&walk->lock);
+    free(queued);
+    release_node(node);
+
+    pthread_mutex_lock(&walk->lock);
+    if (__atomic_sub_fetch(&walk->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        pthread_cond_broadcast(&walk->work);
+    }
+    pthread_cond_broadcast(&walk->progress);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+static void *walk_thread(void *arg) {
+    walk_worker *worker = arg;
+    walk_state *walk = worker->walk;
+    while (1) {
+        walk_node *node = take_node(walk, worker->index);
+        if (node != NULL) {
+            read_node(worker, node);
+            continue;
+        }
+        pthread_mutex_lock(&walk->lock);
+        while (__atomic_load_n(&walk->queued, __ATOMIC_SEQ_CST) == 0 &&
+               __atomic_load_n(&walk->pending, __ATOMIC_SEQ_CST) > 0) {
+            pthread_cond_wait(&walk->work, &walk->lock);
+        }
+        int finished = (__atomic_load_n(&walk->pending, __ATOMIC_SEQ_CST) == 0);
+        pthread_mutex_unlock(&walk->lock);
+        if (finished) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Waits up to 100 ms for progress; Ctrl+C stops the walk.
+static void wait_progress(walk_state *walk) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 100 * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&walk->progress, &walk->lock, &deadline);
+    if (!walk->stop) {
+        pthread_mutex_unlock(&walk->lock);
+        int interrupted = events_interrupted();
+        pthread_mutex_lock(&walk->lock);
+        if (interrupted) {
+            __atomic_store_n(&walk->stop, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Prints finished nodes in pre-order, releasing each once its children are
+// known. After a stop it keeps going, printing nothing, to free the rest.
+static void print_ordered(walk_state *walk, walk_node *root) {
+    size_t cap = 256, count = 0;
+    walk_node **stack = malloc(cap * sizeof(walk_node *));
+    if (stack == NULL) {
+        perror("malloc");
+        return;
+    }
+    stack[count++] = root;
+    int first = 1;
+    while (count > 0) {
+        walk_node *node = stack[--count];
+        pthread_mutex_lock(&walk->lock);
+        while (!node->done) {
+            wait_progress(walk);
+        }
+        int stop = walk->stop;
+        pthread_mutex_unlock(&walk->lock);
+        if (!stop) {
+            if (!first) {
+                fputc('\n', stdout);
+            }
+            first = 0;
+            fwrite(node->text.data, 1, node->text.len, stdout);
+        }
+        if (count + node->child_count > cap) {
+            while (count + node->child_count > cap) {
+                cap *= 2;
+            }
+            walk_node **grown = realloc(stack, cap * sizeof(walk_node *));
+            if (grown == NULL) {
+                perror("realloc");
+                break; // the remaining nodes leak rather than crash
+            }
+            stack = grown;
+        }
+        for (size_t i = node->child_count; i > 0; i--) {
+            stack[count++] = node->children[i - 1];
+        }
+        release_node(node);
+    }
+    free(stack);
+}
+
+static void walk_tree(const char *path, int show_all, int long_format, int ordered) {
+    walk_state walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.show_all = show_all;
+    walk.long_format = long_format;
+    walk.ordered = ordered;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    walk.thread_count = (cpus < WALK_THREADS_MIN) ? WALK_THREADS_MIN : (cpus > WALK_THREADS_MAX) ? WALK_THREADS_MAX : (int)cpus;
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.work, NULL);
+    pthread_cond_init(&walk.progress, NULL);
+
+    walk.deques = calloc(walk.thread_count, sizeof(walk_deque));
+    walk_worker *workers = calloc(walk.thread_count, sizeof(walk_worker));
+    pthread_t *threads = calloc(walk.thread_count, sizeof(pthread_t));
+    walk_node *root = new_node(NULL, path, strlen(path), path);
+    if (walk.deques == NULL || workers == NULL || threads == NULL || root == NULL) {
+        perror("reveal");
+        free(walk.deques);
+        free(workers);
+        free(threads);
+        return;
+    }
+    root->refs = ordered ? 2 : 1;
+    for (int i = 0; i < walk.thread_count; i++) {
+        pthread_mutex_init(&walk.deques[i].lock, NULL);
+    }
+
+    fflush(stdout);
+    shell_interrupted = 0;
+    walk.pending = 1;
+    push_node(&walk, 0, root);
+
+    int started = 0;
+    for (int i = 0; i < walk.thread_count; i++) {
+        workers[i].walk = &walk;
+        workers[i].index = i;
+        workers[i].list.pool.chunk_size = NAME_CHUNK_SIZE;
+        workers[i].dents = malloc(DENTS_BUFFER_SIZE);
+        if (workers[i].dents == NULL ||
+            pthread_create(&threads[i], NULL, walk_thread, &workers[i]) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        // Read everything on this thread instead
+        workers[0].dents = (workers[0].dents != NULL) ? workers[0].dents : malloc(DENTS_BUFFER_SIZE);
+        if (workers[0].dents != NULL) {
+            walk_thread(&workers[0]);
+        }
+    }
+
+    if (ordered) {
+        print_ordered(&walk, root);
+    }
+    pthread_mutex_lock(&walk.lock);
+    while (__atomic_load_n(&walk.pending, __ATOMIC_SEQ_CST) > 0) {
+        wait_progress(&walk);
+    }
+    pthread_mutex_unlock(&walk.lock);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < walk.thread_count; i++) {
+        free(workers[i].dents);
+        free(workers[i].list.names);
+        free(workers[i].list.meta);
+        arena_free(&workers[i].list.pool);
+        free(walk.deques[i].items);
+        pthread_mutex_destroy(&walk.deques[i].lock);
+    }
+    free(walk.deques);
+    free(workers);
+    free(threads);
+    pthread_cond_destroy(&walk.work);
+    pthread_cond_destroy(&walk.progress);
+    pthread_mutex_destroy(&walk.lock);
+    fflush(stdout);
+}
+
+// reveal -U on one directory: each getdents64 batch is formatted straight
+// from the buffer the kernel filled and written out, so memory stays
+// constant however large the directory is. Long-format columns are
+// aligned within a batch.
+static int stream_listing(int dir_fd, int show_all, int long_format, char *buf, text_buf *out) {
+    // A dirent64 takes at least 24 bytes
+    size_t batch_max = DENTS_BUFFER_SIZE / 24;
+    const char **names = malloc(batch_max * sizeof(char *));
+    reveal_meta *meta = long_format ? malloc(batch_max * sizeof(reveal_meta)) : NULL;
+    int result = 0, any = 0;
+    if (names == NULL || (long_format && meta == NULL)) {
+        perror("malloc");
+        free(names);
+        return 0;
+    }
+    while (1) {
+        ssize_t n = getdents64(dir_fd, buf, DENTS_BUFFER_SIZE);
+        if (n <= 0) {
+            result = (n < 0) ? -1 : 0;
+            break;
+        }
+        size_t count = 0;
+        for (ssize_t off = 0; off < n;) {
+            struct dirent64 *d = (struct dirent64 *)(buf + off);
+            off += d->d_reclen;
+            if (show_all || d->d_name[0] != '.') {
+                names[count++] = d->d_name;
+            }
+        }
+        if (long_format) {
+            memset(meta, 0, count * sizeof(reveal_meta));
+            stat_entries(dir_fd, names, meta, count);
+            format_long(out, names, meta, count, NULL);
+        } else {
+            format_names(out, names, count);
+            any |= (count > 0);
+        }
+        // Written batch by batch, so output starts at once
+        text_flush(out);
+    }
+    if (any) {
+        text_append(out, "\n", 1);
+    }
+    free(names);
+    free(meta);
+    return result;
+}
+
+// The sorted listing of a directory, hidden names included: from the
+// directory cache if it is unchanged there, otherwise read, sorted and
+// stored. Names may point into the cache, so they must be used before
+// the next lookup.
+static int cached_listing(int dir_fd, listing *list, char *buf) {
+    dir_key key;
+    size_t count;
+    const char **cached = dir_cache_lookup(dir_fd, &key, &count);
+    if (cached != NULL) {
+        list->names = malloc((count > 0 ? count : 1) * sizeof(char *));
+        if (list->names == NULL) {
+            return -1;
+        }
+        memcpy(list->names, cached, count * sizeof(char *));
+        list->count = list->cap = count;
+        return 0;
+    }
+    if (read_listing(dir_fd, 1, list, buf) < 0) {
+        return -1;
+    }
+    sort_strings(list->names, list->count);
+    dir_cache_store(&key, list->names, list->count);
+    return 0;
+}
+
+static size_t drop_hidden(const char **names, size_t count) {
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (names[i][0] != '.') {
+            names[kept++] = names[i];
+        }
+    }
+    return kept;
+}
+
+void handle_reveal(char **args) {
+    int show_all = 0;
+    int long_format = 0;
+    int recursive = 0;
+    int ordered = 1;
+    char *path = ".";
+
+    int i = 0;
+    while (args[i] != NULL && args[i][0] == '-' && args[i][1]!='\0') {
+        for (int j = 1; args[i][j] != '\0'; j++) {
+            if (args[i][j] == 'a') {
+                show_all = 1;
+            } else if (args[i][j] == 'l') {
+                long_format = 1;
+            } else if (args[i][j] == 'R') {
+                recursive = 1;
+            } else if (args[i][j] == 'U') {
+                ordered = 0;
+            } else {
+                fprintf(stderr, "reveal: Invalid Syntax!\n");
+                return;
+            }
+        }
+        i++;
+    }
+
+    if (args[i] != NULL) {
+        path = args[i];
+    }
+
+    if (args[i] != NULL && args[i+1] != NULL) {
+        fprintf(stderr, "reveal: Invalid Syntax!\n");
+        return;
+    }
+
+    char resolved_path[PATH_MAX];
+    char *target_path = path;
+    if (strcmp(path, "~") == 0) {
+        target_path = shell_home_dir;
+    } else if (strcmp(path, "-") == 0) {
+        if (prev_dir == NULL) {
+            fprintf(stderr, "No such directory!\n");
+            return;
+        }
+        target_path = prev_dir;
+    }
+
+    if (realpath(target_path, resolved_path) == NULL) {
+        fprintf(stderr, "No such directory!\n");
+        return;
+    }
+
+    int dir_fd = open(resolved_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        fprintf(stderr, "No such directory!\n");
+        return;
+    }
+    if (recursive) {
+        // Paths are shown as typed, resolved only for ~ and -
+        close(dir_fd);
+        walk_tree(target_path, show_all, long_format, ordered);
+        return;
+    }
+
+    text_buf out = { NULL, 0, 0, 1 };
+    char *dents = malloc(DENTS_BUFFER_SIZE);
+    if (dents == NULL) {
+        perror("malloc");
+    } else if (!ordered) {
+        if (stream_listing(dir_fd, show_all, long_format, dents, &out) < 0) {
+            fprintf(stderr, "reveal: %s\n", strerror(errno));
+        }
+    } else {
+        listing list;
+        memset(&list, 0, sizeof(list));
+        list.pool.chunk_size = NAME_CHUNK_SIZE;
+        if (cached_listing(dir_fd, &list, dents) < 0) {
+            fprintf(stderr, "reveal: %s\n", strerror(errno));
+        } else {
+            if (!show_all) {
+                list.count = drop_hidden(list.names, list.count);
+            }
+            if (!long_format) {
+                format_names(&out, list.names, list.count);
+                if (list.count > 0) {
+                    text_append(&out, "\n", 1);
+                }
+            } else if (listing_meta(&list) == 0) {
+                stat_entries(dir_fd, list.names, list.meta, list.count);
+                format_long(&out, list.names, list.meta, list.count, NULL);
+            }
+        }
+        free(list.names);
+        free(list.meta);
+        arena_free(&list.pool);
+    }
+    text_flush(&out);
+    free(out.data);
+    free(dents);
+    close(dir_fd);
+}
@@ -0,0 +1,176 @@
+#include "scan.h"
+
+#include <stdint.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+static int is_space(unsigned char c) {
+    return c == ' ' || (unsigned char)(c - '\t') <= '\r' - '\t';
+}
+
+static int is_delim(unsigned char c) {
+    return is_space(c) || c == '|' || c == '&' || c == '<' || c == '>' || c == ';';
+}
+
+// Masks with every bit at or beyond len set.
+static uint64_t tail_bits(size_t len) {
+    return (len >= 64) ? 0 : ~0ULL << len;
+}
+
+static void classify_scalar(const char *s, size_t len, uint64_t *space, uint64_t *delim) {
+    uint64_t sp = 0, de = 0;
+    size_t n = (len < 64) ? len : 64;
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = (unsigned char)s[i];
+        sp |= (uint64_t)is_space(c) << i;
+        de |= (uint64_t)is_delim(c) << i;
+    }
+    *space = sp | tail_bits(len);
+    *delim = de | tail_bits(len);
+}
+
+static const scan_impl scalar_impl = { "scalar", classify_scalar };
+
+#ifdef SCAN_X86
+
+// SSE2 has no byte shuffle, so it compares against each class directly;
+// '\t'..'\r' is a single unsigned range check.
+__attribute__((target("sse2")))
+static void classify_sse2(const char *s, size_t len, uint64_t *space, uint64_t *delim) {
+    if (len < 64) {
+        classify_scalar(s, len, space, delim);
+        return;
+    }
+    uint64_t sp = 0, de = 0;
+    for (int i = 0; i < 4; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + 16 * i));
+        __m128i shifted = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+        __m128i ws = _mm_or_si128(
+            _mm_cmpeq_epi8(_mm_min_epu8(shifted, _mm_set1_epi8('\r' - '\t')), shifted),
+            _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+        __m128i ops = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('|')), _mm_cmpeq_epi8(v, _mm_set1_epi8('&'))),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('<')), _mm_cmpeq_epi8(v, _mm_set1_epi8('>'))),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8(';'))));
+        sp |= (uint64_t)(unsigned)_mm_movemask_epi8(ws) << (16 * i);
+        de |= (uint64_t)(unsigned)_mm_movemask_epi8(_mm_or_si128(ws, ops)) << (16 * i);
+    }
+    *space = sp;
+    *delim = de;
+}
+
+static const scan_impl sse2_impl = { "sse2", classify_sse2 };
+
+// AVX2 classifies with two nibble lookups instead of eleven compares. Each
+// class bit is owned by one high nibble; a byte is in the class when both
+// its low and high nibble entries carry the bit:
+//   0x01 '\t'..'\r' (0x09-0x0D)   0x02 ' ' (0x20)   0x04 '&' (0x26)
+//   0x08 ';' '<' '>' (0x3B 0x3C 0x3E)                0x10 '|' (0x7C)
+#define CLASS_SPACE 0x03
+
+__attribute__((target("avx2")))
+static void classify_avx2(const char *s, size_t len, uint64_t *space, uint64_t *delim) {
+    if (len < 64) {
+        classify_scalar(s, len, space, delim);
+        return;
+    }
+    const __m256i lo_table = _mm256_setr_epi8(
+        0x02, 0, 0, 0, 0, 0, 0x04, 0, 0, 0x01, 0x01, 0x09, 0x19, 0x01, 0x08, 0,
+        0x02, 0, 0, 0, 0, 0, 0x04, 0, 0, 0x01, 0x01, 0x09, 0x19, 0x01, 0x08, 0);
+    const __m256i hi_table = _mm256_setr_epi8(
+        0x01, 0, 0x06, 0x08, 0, 0, 0, 0x10, 0, 0, 0, 0, 0, 0, 0, 0,
+        0x01, 0, 0x06, 0x08, 0, 0, 0, 0x10, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i zero = _mm256_setzero_si256();
+
+    uint64_t sp = 0, de = 0;
+    for (int i = 0; i < 2; i++) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + 32 * i));
+        __m256i lo = _mm256_shuffle_epi8(lo_table, _mm256_and_si256(v, nibble));
+        __m256i hi = _mm256_shuffle_epi8(hi_table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        __m256i cls = _mm256_and_si256(lo, hi);
+        __m256i ws = _mm256_and_si256(cls, _mm256_set1_epi8(CLASS_SPACE));
+        sp |= (uint64_t)(uint32_t)~_mm256_movemask_epi8(_mm256_cmpeq_epi8(ws, zero)) << (32 * i);
+        de |= (uint64_t)(uint32_t)~_mm256_movemask_epi8(_mm256_cmpeq_epi8(cls, zero)) << (32 * i);
+    }
+    *space = sp;
+    *delim = de;
+}
+
+static const scan_impl avx2_impl = { "avx2", classify_avx2 };
+
+#endif
+
+const scan_impl *scan_best(void) {
+    static const scan_impl *best = NULL;
+    if (best == NULL) {
+        best = &scalar_impl;
+#ifdef SCAN_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            best = &avx2_impl;
+        } else if (__builtin_cpu_supports("sse2")) {
+            best = &sse2_impl;
+        }
+#endif
+    }
+    return best;
+}
+
+const scan_impl *const *scan_all(void) {
+    static const scan_impl *impls[4] = { &scalar_impl };
+#ifdef SCAN_X86
+    if (impls[1] == NULL) {
+        int n = 1;
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse2")) impls[n++] = &sse2_impl;
+        if (__builtin_cpu_supports("avx2")) impls[n++] = &avx2_impl;
+    }
+#endif
+    return impls;
+}
+
+void scan_start(scan_cursor *c, const scan_impl *impl, const char *s, size_t len) {
+    c->impl = impl;
+    c->s = s;
+    c->len = len;
+    c->block = SIZE_MAX;
+}
+
+static void load_block(scan_cursor *c, size_t block) {
+    c->block = block;
+    c->impl->classify(c->s + block, c->len - block, &c->space, &c->delim);
+}
+
+// Returns the first position at or after pos whose bit is set in the mask
+// selected by want_delim (or, with invert, clear).
+static size_t scan_for(scan_cursor *c, size_t pos, int want_delim, int invert) {
+    while (pos < c->len) {
+        size_t block = pos & ~(size_t)63;
+        if (block != c->block) {
+            load_block(c, block);
+        }
+        uint64_t mask = want_delim ? c->delim : c->space;
+        if (invert) {
+            mask = ~mask;
+        }
+        mask &= ~0ULL << (pos & 63);
+        if (mask != 0) {
+            size_t found = block + (size_t)__builtin_ctzll(mask);
+            return (found < c->len) ? found : c->len;
+        }
+        pos = block + 64;
+    }
+    return c->len;
+}
+
+size_t scan_skip_space(scan_cursor *c, size_t pos) {
+    return scan_for(c, pos, 0, 1);
+}
+
+size_t scan_name_end(scan_cursor *c, size_t pos) {
+    return scan_for(c, pos, 1, 0);
+}
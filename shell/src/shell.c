@@ -1,6 +1,16 @@
 #include "shell.h"
 #include "cfg.h"
 #include "pipeline.h"
+#include "arena.h"
+#include "cmdcache.h"
+#include "launch.h"
+#include "zygote.h"
+#include "pathhash.h"
+#include "dircache.h"
+#include "wildcard.h"
+#include "history.h"
+#include "fastcopy.h"
+#include "events.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -9,59 +19,21 @@
 #include <limits.h>
 #include <errno.h>
 #include <stdlib.h>
-#include <dirent.h>
 #include <sys/wait.h>
 #include <signal.h>
 #include <ctype.h>
 
-char *history[15];
-int his_cnt = 0;
+// Commands a plain 'log' prints
+#define LOG_SHOWN 15
 
 pid_t shell_pgid;
 
 extern pid_t current_foreground_pid;
 extern char current_foreground_command[256];
 
-#define HISTORY_FILE ".shell_history"
-
 char *shell_home_dir = NULL;
 char *prev_dir = NULL;
 
-void load_history() {
-    char history_path[PATH_MAX];
-    snprintf(history_path, sizeof(history_path), "%s/%s", shell_home_dir, HISTORY_FILE);
-    
-    FILE *file = fopen(history_path, "r");
-    if (file == NULL) {
-        return; // No history file exists yet
-    }
-    
-    char line[1024];
-    while (fgets(line, sizeof(line), file) != NULL && his_cnt < 15) {
-        // Remove newline
-        line[strcspn(line, "\n")] = '\0';
-        if (strlen(line) > 0) {
-            history[his_cnt++] = strdup(line);
-        }
-    }
-    fclose(file);
-}
-
-void save_history() {
-    char history_path[PATH_MAX];
-    snprintf(history_path, sizeof(history_path), "%s/%s", shell_home_dir, HISTORY_FILE);
-    
-    FILE *file = fopen(history_path, "w");
-    if (file == NULL) {
-        return; // Can't save history
-    }
-    
-    for (int i = 0; i < his_cnt; i++) {
-        fprintf(file, "%s\n", history[i]);
-    }
-    fclose(file);
-}
-
 void init_builtin_state(char *home_path) {
     if (shell_home_dir == NULL) {
         shell_home_dir = strdup(home_path);
@@ -69,16 +41,6 @@ void init_builtin_state(char *home_path) {
     prev_dir = NULL;
 }
 
-void free_args(char **args) {
-    if (args == NULL) {
-        return;
-    }
-    for (int i = 0; args[i] != NULL; i++) {
-        free(args[i]);
-    }
-    free(args);
-}
-
 void show_prompt() {
     struct passwd *pw = getpwuid(getuid());
     char *username = (pw != NULL) ? pw->pw_name : "unknown";
@@ -136,6 +98,7 @@ void handle_hop(char **args) {
         }
         free(cwd_before_hop);
     } else {
+        path_hash_chdir();
         if (prev_dir != NULL) {
             free(prev_dir);
         }
@@ -143,189 +106,106 @@ void handle_hop(char **args) {
     }
 }
 
-static int string_compare(const void *a, const void *b) {
-    return strcmp(*(const char **)a, *(const char **)b);
-}
-
-void handle_reveal(char **args) {
-    int show_all = 0;
-    int line_by_line = 0;
-    char *path = ".";
-
-    int i = 0;
-    while (args[i] != NULL && args[i][0] == '-' && args[i][1]!='\0') {
-        for (int j = 1; args[i][j] != '\0'; j++) {
-            if (args[i][j] == 'a') {
-                show_all = 1;
-            } else if (args[i][j] == 'l') {
-                line_by_line = 1;
-            } else {
-                fprintf(stderr, "reveal: Invalid Syntax!\n");
-                return;
-            }
-        }
-        i++;
-    }
-
-    if (args[i] != NULL) {
-        path = args[i];
-    }
-
-    if (args[i+1] != NULL) {
-        fprintf(stderr, "reveal: Invalid Syntax!\n");
-        return;
-    }
-
-    // if(strcmp(args[0],"-")==0 && args[1]==NULL){
-    //     path = args[0];
-    // }
-    char resolved_path[PATH_MAX];
-    char *target_path = path;
-    if (strcmp(path, "~") == 0) {
-        target_path = shell_home_dir;
-    } else if (strcmp(path, "-") == 0) {
-        if (prev_dir == NULL) {
-            fprintf(stderr, "No such directory!\n");
-            return;
-        }
-        target_path = prev_dir;
-    }
-
-    if (realpath(target_path, resolved_path) == NULL) {
-        fprintf(stderr, "No such directory!\n");
+void update_history(char *cmd) {
+    // Don't store if command starts with "log"
+    if (strncmp(cmd, "log", 3) == 0 && (cmd[3] == '\0' || cmd[3] == ' ')) {
         return;
     }
+    // Consecutive duplicates are dropped by the store
+    history_add(cmd);
+}
 
-    DIR *dir = opendir(resolved_path);
-    if (dir == NULL) {
-        fprintf(stderr, "No such directory!\n");
-        return;
+// Prints the commands found by 'log search' or 'log prefix', each with the
+// number 'log execute' takes for it.
+static void print_matches(char **words, int prefix) {
+    size_t len = 0;
+    for (int i = 0; words[i] != NULL; i++) {
+        len += strlen(words[i]) + 1;
     }
-
-    struct dirent *entry;
-    char **entries = malloc(100 * sizeof(char *));
-    if (entries == NULL) {
-        perror("malloc");
-        closedir(dir);
+    char *text = arena_alloc(&line_arena, len);
+    if (text == NULL) {
         return;
     }
-    int entry_count = 0;
-    int max_entries = 100;
-
-    while ((entry = readdir(dir)) != NULL) {
-        if (!show_all && entry->d_name[0] == '.') {
-            continue;
-        }
-        if (entry_count >= max_entries) {
-            max_entries *= 2;
-            char **temp = realloc(entries, max_entries * sizeof(char *));
-            if (temp == NULL) {
-                perror("realloc");
-                break;
-            }
-            entries = temp;
-        }
-        entries[entry_count] = strdup(entry->d_name);
-        if (entries[entry_count] == NULL) {
-            perror("strdup");
-            break;
-        }
-        entry_count++;
+    // Words are rejoined with single spaces, as the line was stored
+    text[0] = '\0';
+    for (int i = 0; words[i] != NULL; i++) {
+        if (i > 0) strcat(text, " ");
+        strcat(text, words[i]);
     }
-    closedir(dir);
 
-    qsort(entries, entry_count, sizeof(char *), string_compare);
-
-    for (i = 0; i < entry_count; i++) {
-        printf("%s", entries[i]);
-        if (line_by_line) {
-            printf("\n");
-        } else {
-            printf(" ");
-        }
-        free(entries[i]);
+    uint32_t *ids;
+    size_t count = history_search(text, prefix, &ids);
+    size_t total = history_count();
+    for (size_t i = 0; i < count; i++) {
+        size_t entry_len;
+        const char *entry = history_get(ids[i], &entry_len);
+        printf("%5zu  %.*s\n", total - ids[i], (int)entry_len, entry);
     }
-
-    if (!line_by_line && entry_count > 0) {
-        printf("\n");
-    }
-
-    free(entries);
+    free(ids);
 }
 
-void update_history(char *cmd) {
-    // Don't store if command starts with "log"
-    if (strncmp(cmd, "log", 3) == 0 && (cmd[3] == '\0' || cmd[3] == ' ')) {
-        return;
-    }
-    
-    // Don't store if identical to previous command
-    if (his_cnt > 0 && strcmp(history[his_cnt - 1], cmd) == 0) {
-        return;
-    }
-
-    // If we have 15 commands, remove the oldest
-    if (his_cnt == 15) {
-        free(history[0]);
-        for (int i = 0; i < 14; i++) {
-            history[i] = history[i + 1];
-        }
-        his_cnt--;
+// Prints the newest 'shown' commands, oldest first
+static void print_recent(size_t shown) {
+    size_t count = history_count();
+    for (size_t i = (shown < count) ? count - shown : 0; i < count; i++) {
+        size_t len;
+        const char *entry = history_get(i, &len);
+        fwrite(entry, 1, len, stdout);
+        putchar('\n');
     }
-
-    // Add new command
-    history[his_cnt++] = strdup(cmd);
 }
 
 void handle_log(char **args) {
-    // Check for invalid syntax
-    if (args[0] != NULL && args[1] != NULL && args[2] != NULL) {
-        printf("log: Invalid Syntax!\n");
-        return;
-    }
-    
     if (args[0] == NULL) {
-        // No arguments: Print stored commands (oldest to newest)
-        for (int i = 0; i < his_cnt; i++) {
-            printf("%s\n", history[i]);
+        // No arguments: the commands 'log execute 1' to 15 refer to
+        print_recent(LOG_SHOWN);
+    } else if (strcmp(args[0], "search") == 0 || strcmp(args[0], "prefix") == 0) {
+        if (args[1] == NULL) {
+            printf("log: Invalid Syntax!\n");
+            return;
         }
+        print_matches(args + 1, args[0][0] == 'p');
+    } else if (args[1] != NULL && args[2] != NULL) {
+        printf("log: Invalid Syntax!\n");
     } else if (strcmp(args[0], "purge") == 0) {
         // Check for extra arguments after purge
         if (args[1] != NULL) {
             printf("log: Invalid Syntax!\n");
             return;
         }
-        // Clear history
-        for (int i = 0; i < his_cnt; i++) {
-            free(history[i]);
-        }
-        his_cnt = 0;
+        history_purge();
     } else if (strcmp(args[0], "execute") == 0) {
         if (args[1] == NULL) {
             printf("log: Invalid Syntax!\n");
             return;
         }
-        
-        // Check for extra arguments after execute <index>
-        if (args[2] != NULL) {
-            printf("log: Invalid Syntax!\n");
-            return;
-        }
 
-        int index = atoi(args[1]);
         // Index should be 1-indexed, newest to oldest
-        if (index <= 0 || index > his_cnt) {
+        long index = atol(args[1]);
+        size_t count = history_count();
+        if (index <= 0 || (size_t)index > count) {
             printf("log: Invalid Syntax!\n");
             return;
         }
 
-        // Convert to array index (newest to oldest means reverse order)
-        char *command_to_execute = history[his_cnt - index];
-        char **exec_args = parse_command(command_to_execute);
-        if (exec_args != NULL) {
-            run_builtin_or_external(exec_args, 0);
-            free_args(exec_args);
+        // The log is not NUL-terminated, so the command is copied out
+        size_t len;
+        const char *entry = history_get(count - (size_t)index, &len);
+        char *command_to_execute = arena_strndup(&line_arena, entry, len);
+        cmd_group *groups = (command_to_execute != NULL) ? parse_command_cached(command_to_execute) : NULL;
+        if (groups != NULL) {
+            run_shell_cmd(groups);
+        }
+    } else if (args[1] == NULL && strcmp(args[0], "all") == 0) {
+        print_recent(history_count());
+    } else if (args[1] == NULL && isdigit((unsigned char)args[0][0])) {
+        char *end;
+        long shown = strtol(args[0], &end, 10);
+        if (*end != '\0' || shown <= 0) {
+            printf("log: Invalid Syntax!\n");
+            return;
         }
+        print_recent((size_t)shown);
     } else {
         // Invalid first argument
         printf("log: Invalid Syntax!\n");
@@ -346,6 +226,17 @@ void handle_ping(char **args) {
     }
     int actual_signal = signal_num % 32;
 
+    // A pipeline is signalled as a whole through the pid activities shows
+    process *job = find_job_by_pid(pid);
+    if (job != NULL && job->pid == pid && job->stage_count > 1) {
+        if (kill(-job->pgid, actual_signal) == 0) {
+            printf("Sent signal %d to process group %d\n", signal_num, job->pgid);
+        } else if (errno == ESRCH) {
+            fprintf(stderr, "No such process found\n");
+        }
+        return;
+    }
+
     if (kill(pid, actual_signal) == 0) {
         printf("Sent signal %d to process with pid %d\n", signal_num, pid);
     } else {
@@ -355,71 +246,234 @@ void handle_ping(char **args) {
     }
 }
 
+// Reports internal counters; each line names the subsystem it comes from.
+void handle_stats(char **args) {
+    if (args[0] != NULL) {
+        printf("stats: Invalid Syntax!\n");
+        return;
+    }
+    printf("arena: %zu allocations served by %zu mallocs over %zu command lines\n",
+           line_arena.allocations, line_arena.chunk_mallocs, line_arena.resets);
+    printf("cmdcache: %zu hits, %zu misses, %zu evictions\n",
+           command_cache_stats.hits, command_cache_stats.misses, command_cache_stats.evictions);
+    printf("pathhash: %zu hits, %zu negative hits, %zu misses, %zu invalidations\n",
+           path_hash_stats.hits, path_hash_stats.negative_hits, path_hash_stats.misses,
+           path_hash_stats.invalidations);
+    printf("dircache: %zu hits, %zu misses, %zu evictions, %zu invalidations\n",
+           dir_cache_stats.hits, dir_cache_stats.misses, dir_cache_stats.evictions,
+           dir_cache_stats.invalidations);
+    printf("wildcard: %zu patterns, %zu matches, %zu directories read\n",
+           wildcard_stats_total.patterns, wildcard_stats_total.matches, wildcard_stats_total.dirs_read);
+    printf("history: %zu commands, %zu searches (%zu by trigram, %zu by scan), "
+           "trigrams of %zu commands loaded, %zu built\n",
+           history_count(), history_search_stats.searches, history_search_stats.indexed,
+           history_search_stats.scanned, history_search_stats.loaded, history_search_stats.built);
+    printf("fastcopy: %zu copies, %zu bytes (copy_file_range %zu, sendfile %zu, splice %zu, read/write %zu)\n",
+           fast_copy_stats.copies, fast_copy_stats.bytes,
+           fast_copy_stats.by_method[COPY_FILE_RANGE], fast_copy_stats.by_method[COPY_SENDFILE],
+           fast_copy_stats.by_method[COPY_SPLICE], fast_copy_stats.by_method[COPY_READ_WRITE]);
+    printf("pipesize: %zu pipes sized, %zu grown while full\n",
+           pipe_size_stats.sized, pipe_size_stats.grown);
+}
+
+// 'hash' lists remembered command locations with their hit counts;
+// 'hash -r' forgets them all.
+void handle_hash(char **args) {
+    if (args[0] == NULL) {
+        path_hash_print();
+    } else if (strcmp(args[0], "-r") == 0 && args[1] == NULL) {
+        path_hash_clear();
+    } else {
+        printf("hash: Invalid Syntax!\n");
+    }
+}
+
+// Shows or changes shell options: 'set' lists them, 'set <option> <value>'
+// changes one.
+void handle_set(char **args) {
+    if (args[0] == NULL) {
+        printf("launch %s\n", launch_mode_name(launch_backend));
+        printf("pipesize %s\n", pipe_size_name(pipe_size_setting));
+        printf("pipefail %s\n", pipefail_setting ? "on" : "off");
+        printf("placement %s\n", placement_name(placement_setting));
+        return;
+    }
+    if (args[1] == NULL || args[2] != NULL) {
+        printf("set: Invalid Syntax!\n");
+        return;
+    }
+    if (strcmp(args[0], "launch") == 0) {
+        if (launch_mode_parse(args[1], &launch_backend) < 0) {
+            printf("set: launch must be fork, spawn or zygote\n");
+        } else if (launch_backend == LAUNCH_ZYGOTE) {
+            zygote_start(); // now rather than on the first command
+        } else {
+            zygote_stop();
+        }
+    } else if (strcmp(args[0], "pipesize") == 0) {
+        if (parse_pipe_size(args[1], &pipe_size_setting) < 0) {
+            printf("set: pipesize must be default, auto or a size of at least 4K\n");
+        }
+    } else if (strcmp(args[0], "pipefail") == 0) {
+        if (strcmp(args[1], "on") == 0 || strcmp(args[1], "off") == 0) {
+            pipefail_setting = (strcmp(args[1], "on") == 0);
+        } else {
+            printf("set: pipefail must be on or off\n");
+        }
+    } else if (strcmp(args[0], "placement") == 0) {
+        if (placement_parse(args[1], &placement_setting) < 0) {
+            printf("set: placement must be none or cache\n");
+        }
+    } else {
+        printf("set: Invalid Syntax!\n");
+    }
+}
+
 // Global variable to track the foreground process group
 extern pid_t foreground_pgid ;
 
+// Called by the event loop for each Ctrl+C and Ctrl+Z.
 void handle_sigint(int signo) {
+    shell_interrupted = 1;
     if (foreground_pgid > 0) {
         kill(-foreground_pgid, SIGINT);
     }
 }
 
 void handle_sigtstp(int signo) {
+    // The foreground waiter sees the stop and turns the job into an entry
     if (foreground_pgid > 0) {
         kill(-foreground_pgid, SIGTSTP);
-
-        if (current_foreground_pid > 0) {
-            add_child_process(current_foreground_pid, current_foreground_command, 1);
-            // Find the process we just added and mark it as stopped
-            for (int i = 0; i < process_count; i++) {
-                if (processes[i].pid == current_foreground_pid) {
-                    processes[i].status = STOPPED;
-                    printf("\n[%d] Stopped %s\n", processes[i].job_number, processes[i].command);
-                    break;
-                }
-            }
-        }
-        
-        // Reset foreground tracking
-        foreground_pgid = 0;
-        current_foreground_pid = 0;
-        current_foreground_command[0] = '\0';
     }
 }
 
+// Ctrl+C, Ctrl+Z and SIGCHLD are blocked and read from a signalfd by the
+// event loop, which calls the two handlers above outside signal context.
 void setup_signal_handlers() {
-    struct sigaction sa;
-    sa.sa_flags = SA_RESTART;
-    sigemptyset(&sa.sa_mask);
-
-    // Handle SIGINT (Ctrl+C)
-    sa.sa_handler = handle_sigint;
-    sigaction(SIGINT, &sa, NULL);
+    if (events_init() < 0) {
+        exit(EXIT_FAILURE);
+    }
 
-    // Handle SIGTSTP (Ctrl+Z) 
-    sa.sa_handler = handle_sigtstp;
-    sigaction(SIGTSTP, &sa, NULL);
-    
     // Ignore SIGTTOU to prevent background job control issues
     signal(SIGTTOU, SIG_IGN);
 }
 
-process* find_job_by_number(int job_number) {
-    for (int i = 0; i < process_count; i++) {
-        if (processes[i].job_number == job_number) {
-            return &processes[i];
+// A job the shell is waiting on in the foreground.
+typedef struct {
+    pid_t pgid;
+    int left;           // processes left to reap
+    cmd_group *group;   // for pipe sampling; NULL for a job resumed with fg
+    job_stage *stages;
+    int stage_count;
+    int owned;          // stages are malloc'd, as when fg took them from the table
+    int auto_pipes;
+    int job_number;     // kept by a job resumed with fg, else 0
+} foreground_job;
+
+// The last foreground job's stages, for 'status'
+static job_stage *last_stages = NULL;
+static int last_stage_count = 0;
+
+static void set_foreground(pid_t pgid, pid_t pid, const char *command) {
+    foreground_pgid = pgid;
+    current_foreground_pid = pid;
+    strncpy(current_foreground_command, command, sizeof(current_foreground_command) - 1);
+    current_foreground_command[sizeof(current_foreground_command) - 1] = '\0';
+}
+
+static void clear_foreground(void) {
+    foreground_pgid = 0;
+    current_foreground_pid = 0;
+    current_foreground_command[0] = '\0';
+}
+
+// Waits until every process of the job has finished. Returns 1 if it was
+// stopped instead, after making it a stopped background job.
+static int wait_foreground(foreground_job *fg) {
+    // With auto-sized pipes the pipes are sampled between events, more
+    // often while they keep filling up
+    int watching = (fg->auto_pipes && fg->group != NULL);
+    long interval_ms = 1;
+    while (fg->left > 0) {
+        int status;
+        run_usage reaped;
+        pid_t result = usage_wait(-fg->pgid, &status, WUNTRACED | WNOHANG, &reaped);
+        if (result < 0) {
+            break;
+        }
+        if (result > 0) {
+            job_stage *stage = NULL;
+            for (int i = 0; i < fg->stage_count; i++) {
+                if (fg->stages[i].pid == result && fg->stages[i].state != STAGE_DONE) {
+                    stage = &fg->stages[i];
+                }
+            }
+            if (stage == NULL) {
+                continue;
+            }
+            if (WIFSTOPPED(status)) {
+                // The job goes to the table with every stage; the rest of
+                // the group's stops are picked up from there
+                stage->state = STAGE_STOPPED;
+                job_stage *stages = fg->owned ? fg->stages : copy_stages(fg->stages, fg->stage_count);
+                process *job = (stages != NULL) ? add_job(stages, fg->stage_count, 1, fg->job_number) : NULL;
+                if (job != NULL) {
+                    job->status = STOPPED;
+                    printf("\n[%d] Stopped %s\n", job->job_number, job->command);
+                }
+                clear_foreground();
+                completed_processes(); // stops already reported for the other stages
+                return 1;
+            }
+            stage->state = STAGE_DONE;
+            stage->status = status;
+            stage->usage.ended = reaped.ended;
+            stage->usage.usage = reaped.usage;
+            fg->left--;
+            continue;
+        }
+
+        // Nothing to reap yet: sleep until SIGCHLD or another event
+        events_wait(-1, watching ? (int)interval_ms : -1);
+        if (watching) {
+            size_t grown = pipe_size_stats.grown;
+            watching = pipe_autosize_sample(fg->group, fg->stages);
+            interval_ms = (pipe_size_stats.grown != grown) ? 1 : interval_ms * 2;
+            if (interval_ms > 100) {
+                interval_ms = 100;
+            }
         }
     }
-    return NULL;
+    return 0;
 }
 
-process* find_most_recent_job() {
-    for (int i = process_count - 1; i >= 0; i--) {
-        if (processes[i].is_background) {
-            return &processes[i];
-        }
+// A foreground job has finished: its exit code becomes last_status, and
+// its stages are kept for 'status' and 'activities -r'.
+static void finish_foreground(foreground_job *fg, int timed) {
+    last_status = stage_exit_code(deciding_stage(fg->stages, fg->stage_count));
+    record_finished_job(fg->stages, fg->stage_count);
+    if (timed) {
+        print_stage_report(stderr, fg->stages, fg->stage_count);
+    }
+    free_stages(last_stages, last_stage_count);
+    last_stages = fg->owned ? fg->stages : copy_stages(fg->stages, fg->stage_count);
+    last_stage_count = (last_stages != NULL) ? fg->stage_count : 0;
+}
+
+// 'status' prints the last foreground job's exit code, and for a pipeline
+// each stage's, so a failing stage can be told apart from the last one.
+void handle_status(char **args) {
+    if (args[0] != NULL) {
+        printf("status: Invalid Syntax!\n");
+        return;
     }
-    return NULL;
+    if (last_stages == NULL) {
+        printf("exit %d\n", last_status);
+        return;
+    }
+    char line[512];
+    format_job_status(line, sizeof(line), last_stages, last_stage_count);
+    printf("%s\n", line);
 }
 
 void handle_fg(char **args) {
@@ -445,34 +499,63 @@ void handle_fg(char **args) {
             return;
         }
         job->status = RUNNING;
+        for (int i = 0; i < job->stage_count; i++) {
+            if (job->stages[i].state == STAGE_STOPPED) {
+                job->stages[i].state = STAGE_RUNNING;
+            }
+        }
     }
 
-    // Move job to foreground
-    job->is_background = 0;
-    foreground_pgid = job->pgid;
-    current_foreground_pid = job->pid;
-    strncpy(current_foreground_command, job->command, sizeof(current_foreground_command) - 1);
-    current_foreground_command[sizeof(current_foreground_command) - 1] = '\0';
+    // The job leaves the table while it runs in the foreground; Ctrl+Z
+    // puts it back under the same number
+    foreground_job fg = {
+        .pgid = job->pgid,
+        .left = job->stages_left,
+        .stage_count = job->stage_count,
+        .owned = 1,
+        .job_number = job->job_number,
+    };
+    set_foreground(job->pgid, job->pid, job->command);
+    fg.stages = release_job(job);
 
-    // Wait for the job
-    int status;
-    pid_t result = waitpid(-job->pgid, &status, WUNTRACED);
-    
-    if (result > 0) {
-        if (WIFSTOPPED(status)) {
-            // Process was stopped again (Ctrl+Z while in foreground)
-            // The signal handler will take care of this
-            return;
-        } else if (WIFEXITED(status) || WIFSIGNALED(status)) {
-            // Process completed - remove from job list
-            remove_process_by_pid(job->pid);
-        }
+    if (wait_foreground(&fg)) {
+        return; // stopped again
     }
+    finish_foreground(&fg, 0);
+    clear_foreground();
+}
 
-    // Reset foreground tracking
-    foreground_pgid = 0;
-    current_foreground_pid = 0;
-    current_foreground_command[0] = '\0';
+// 'wait' blocks until every running background job has finished, 'wait -n'
+// until any one has, and 'wait N' until job N has. Ctrl+C stops waiting.
+void handle_wait(char **args) {
+    int any = 0, job_number = 0;
+    if (args[0] != NULL && strcmp(args[0], "-n") == 0 && args[1] == NULL) {
+        any = 1;
+    } else if (args[0] != NULL && (args[1] != NULL || (job_number = atoi(args[0])) <= 0)) {
+        printf("wait: Invalid Syntax!\n");
+        return;
+    }
+
+    fflush(stdout);
+    shell_interrupted = 0;
+    int start_count = process_count;
+    while (!shell_interrupted) {
+        int waiting = 0;
+        if (job_number != 0) {
+            process *job = find_job_by_number(job_number);
+            waiting = (job != NULL && job->is_background && job->status == RUNNING);
+        }
+        for (int i = 0; job_number == 0 && i < process_count; i++) {
+            if (processes[i].is_background && processes[i].status == RUNNING) {
+                waiting = 1;
+                break;
+            }
+        }
+        if (!waiting || (any && process_count < start_count)) {
+            break;
+        }
+        events_wait(-1, -1);
+    }
 }
 
 void handle_bg(char **args) {
@@ -501,77 +584,17 @@ void handle_bg(char **args) {
 
     printf("[%d] %s &\n", job->job_number, job->command);
     job->status = RUNNING;
-}
-
-void run_builtin_or_external(char **args, int is_background) {
-    if (args == NULL || args[0] == NULL) {
-        return;
-    }
-
-    int has_pipe = 0;
-    for (int i = 0; args[i] != NULL; i++) {
-        if (strcmp(args[i], "|") == 0) {
-            has_pipe = 1;
-            break;
+    for (int i = 0; i < job->stage_count; i++) {
+        if (job->stages[i].state == STAGE_STOPPED) {
+            job->stages[i].state = STAGE_RUNNING;
         }
     }
+}
 
-    // If it's a pipeline, handle it in execute_command_group
-    if (has_pipe) {
-        pid_t pid = fork();
-        if (pid < 0) {
-            perror("fork");
-        } else if (pid == 0) {
-            // Child process
-            pid_t pgid = getpid();
-            setpgid(0, pgid);
-            
-            // Restore default signal handlers in child
-            signal(SIGINT, SIG_DFL);
-            signal(SIGTSTP, SIG_DFL);
-
-            execute_command_group(args);
-            exit(EXIT_SUCCESS);
-        } else {
-            // Parent process
-            setpgid(pid, pid); // Set process group ID in parent too
-            
-            if (is_background) {
-                add_child_process(pid, args[0], 1);
-                printf("[%d] %d\n", processes[process_count-1].job_number, pid);
-            } else {
-                // Track foreground process for signal handling
-                foreground_pgid = pid;
-                current_foreground_pid = pid;
-                strncpy(current_foreground_command, args[0], sizeof(current_foreground_command) - 1);
-                current_foreground_command[sizeof(current_foreground_command) - 1] = '\0';
-                
-                int status;
-                pid_t result = waitpid(pid, &status, WUNTRACED);
-                
-                if (result == pid) {
-                    if (WIFSTOPPED(status)) {
-                        // Process was stopped by signal (Ctrl+Z)
-                        // The signal handler already dealt with this
-                        // Don't reset foreground tracking here
-                        return;
-                    } else {
-                        // Process completed normally or was terminated
-                        foreground_pgid = 0;
-                        current_foreground_pid = 0;
-                        current_foreground_command[0] = '\0';
-                    }
-                } else {
-                    // waitpid was interrupted or failed
-                    foreground_pgid = 0;
-                    current_foreground_pid = 0;
-                    current_foreground_command[0] = '\0';
-                }
-            }
-        }
-        return;
-    }
-
+// Runs a builtin in the shell process itself and sets last_status; returns
+// 0 if args[0] is not one.
+int run_builtin(char **args) {
+    int status = 0;
     if (strcmp(args[0], "hop") == 0) {
         handle_hop(args + 1);
     } else if (strcmp(args[0], "reveal") == 0) {
@@ -579,108 +602,148 @@ void run_builtin_or_external(char **args, int is_background) {
     } else if (strcmp(args[0], "log") == 0) {
         handle_log(args + 1);
     } else if (strcmp(args[0], "activities") == 0) {
-        run_activities_builtin(processes, process_count);
+        handle_activities(args + 1);
     } else if (strcmp(args[0], "ping") == 0) {
         handle_ping(args + 1);
     } else if (strcmp(args[0], "fg") == 0) {
         handle_fg(args + 1);
+        return 1; // the resumed job's status is the one that counts
     } else if (strcmp(args[0], "bg") == 0) {
         handle_bg(args + 1);
+    } else if (strcmp(args[0], "stats") == 0) {
+        handle_stats(args + 1);
+    } else if (strcmp(args[0], "set") == 0) {
+        handle_set(args + 1);
+    } else if (strcmp(args[0], "hash") == 0) {
+        handle_hash(args + 1);
+    } else if (strcmp(args[0], "forall") == 0) {
+        handle_forall(args + 1);
+    } else if (strcmp(args[0], "wait") == 0) {
+        handle_wait(args + 1);
+    } else if (strcmp(args[0], "status") == 0) {
+        handle_status(args + 1);
+        return 1; // leaves the status it reports alone
+    } else if (strcmp(args[0], "true") == 0) {
+        // Nothing to do
+    } else if (strcmp(args[0], "false") == 0) {
+        status = 1;
     } else {
-        pid_t pid = fork();
-        if (pid < 0) {
-            perror("fork");
-        } else if (pid == 0) {
-            // Child process
-            pid_t pgid = getpid();
-            setpgid(0, pgid);
-            
-            // Restore default signal handlers in child
-            signal(SIGINT, SIG_DFL);
-            signal(SIGTSTP, SIG_DFL);
-
-            execute_command_group(args);
-            exit(EXIT_SUCCESS);
-        } else {
-            // Parent process
-            setpgid(pid, pid); // Set process group ID in parent too
-            
-            if (is_background) {
-                add_child_process(pid, args[0], 1);
-                printf("[%d] %d\n", processes[process_count-1].job_number, pid);
-            } else {
-                // Track foreground process for signal handling
-                foreground_pgid = pid;
-                current_foreground_pid = pid;
-                strncpy(current_foreground_command, args[0], sizeof(current_foreground_command) - 1);
-                current_foreground_command[sizeof(current_foreground_command) - 1] = '\0';
-                
-                int status;
-                pid_t result = waitpid(pid, &status, WUNTRACED);
-                
-                if (result == pid) {
-                    if (WIFSTOPPED(status)) {
-                        // Process was stopped by signal (Ctrl+Z)
-                        // The signal handler already dealt with this
-                        // Don't reset foreground tracking here
-                        return;
-                    } else {
-                        // Process completed normally or was terminated
-                        foreground_pgid = 0;
-                        current_foreground_pid = 0;
-                        current_foreground_command[0] = '\0';
-                    }
-                } else {
-                    // waitpid was interrupted or failed
-                    foreground_pgid = 0;
-                    current_foreground_pid = 0;
-                    current_foreground_command[0] = '\0';
-                }
-            }
+        return 0;
+    }
+    last_status = status;
+    free_stages(last_stages, last_stage_count);
+    last_stages = NULL;
+    last_stage_count = 0;
+    return 1;
+}
+
+void run_builtin_or_external(cmd_group *group, int is_background) {
+    if (group == NULL || group->stages == NULL) {
+        return;
+    }
+
+    pipeline_options opts;
+    group = apply_with_prefix(group, &opts);
+    if (group != NULL) {
+        group = expand_wildcards(group);
+    }
+    if (group == NULL) {
+        return;
+    }
+
+    atomic_cmd *cmd = group->stages;
+    char **args = cmd->argv;
+
+    // A lone, unredirected builtin runs in the shell; pipelines and
+    // redirected builtins go through execute_command_group, and so does
+    // a timed builtin so its stage is measured
+    if (group->stage_count == 1 && cmd->input_file == NULL && cmd->output_file == NULL &&
+        !opts.timed && run_builtin(args)) {
+        return;
+    }
+
+    pid_t pgid;
+    job_stage *stages = arena_alloc(&line_arena, group->stage_count * sizeof(job_stage));
+    if (stages == NULL) {
+        return;
+    }
+    int launched = execute_command_group(group, &opts, &pgid, stages);
+    foreground_job fg = {
+        .pgid = pgid,
+        .left = launched,
+        .group = group,
+        .stages = stages,
+        .stage_count = group->stage_count,
+        .auto_pipes = (opts.pipe_size == PIPE_SIZE_AUTO && group->stage_count > 1),
+    };
+    if (launched == 0) {
+        // Only stages the shell ran itself, which are finished already
+        finish_foreground(&fg, opts.timed);
+        return;
+    }
+
+    if (is_background) {
+        job_stage *owned = copy_stages(stages, group->stage_count);
+        process *job = (owned != NULL) ? add_job(owned, group->stage_count, 1, 0) : NULL;
+        if (job != NULL) {
+            job->timed = opts.timed;
+            printf("[%d] %d\n", job->job_number, pgid);
         }
+        return;
     }
+
+    // Track foreground process for signal handling, and wait for every
+    // stage; a stop means Ctrl+Z, and the job has been added to the table
+    set_foreground(pgid, pgid, args[0]);
+    if (wait_foreground(&fg)) {
+        return;
+    }
+    finish_foreground(&fg, opts.timed);
+    clear_foreground();
 }
 
+// Runs every group of a parsed command line in order.
+void run_shell_cmd(cmd_group *groups) {
+    for (cmd_group *group = groups; group != NULL; group = group->next) {
+        run_builtin_or_external(group, group->is_background);
+    }
+}
 
-void completed_processes(void) {
-    int status;
-    pid_t completed_pid;
-    
-    while ((completed_pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
-        int found_index = -1;
-        for (int i = 0; i < process_count; i++) {
-            if (processes[i].pid == completed_pid) {
-                found_index = i;
-                break;
+
+// Polls every background job for a change of state and reports it.
+// Returns the number of lines printed. Used when SIGCHLD says a job stopped
+// or continued, and for everything on kernels without pidfds.
+int completed_processes(void) {
+    int reported = 0;
+    for (int i = process_count - 1; i >= 0; i--) {
+        process *job = &processes[i];
+        if (!job->is_background) {
+            continue; // forall and foreground children are waited for by their owners
+        }
+        int finished = 0, stopped = 0;
+        for (int j = 0; j < job->stage_count && !finished; j++) {
+            job_stage *stage = &job->stages[j];
+            int status;
+            run_usage reaped;
+            if (stage->state != STAGE_DONE &&
+                usage_wait(stage->pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &reaped) == stage->pid) {
+                finished = update_job_stage(job, stage->pid, status, &reaped);
             }
+            stopped |= (stage->state == STAGE_STOPPED);
         }
-
-        if (found_index == -1) {
+        if (finished) {
+            finish_background_job(job);
+            reported++;
             continue;
         }
 
-        process *job = &processes[found_index];
-
-        if (WIFEXITED(status)) {
-            printf("%s with pid %d exited normally\n", job->command, completed_pid);
-            remove_process_by_pid(completed_pid);
-        } else if (WIFSIGNALED(status)) {
-            printf("%s with pid %d exited abnormally\n", job->command, completed_pid);
-            remove_process_by_pid(completed_pid);
-        } else if (WIFSTOPPED(status)) {
-            // Process was stopped
-            if (job->status != STOPPED) {
-                job->status = STOPPED;
-                // Only print if this wasn't already handled by signal handler
-                if (job->pid != current_foreground_pid) {
-                    printf("[%d] Stopped %s\n", job->job_number, job->command);
-                }
-            }
-        } else if (WIFCONTINUED(status)) {
-            job->status = RUNNING;
-            if (!job->is_background) {
-                printf("[%d] Running %s\n", job->job_number, job->command);
-            }
+        // A job counts as stopped while any of its stages is
+        job_status now = stopped ? STOPPED : RUNNING;
+        if (job->status != now) {
+            job->status = now;
+            printf("[%d] %s %s\n", job->job_number, stopped ? "Stopped" : "Running", job->command);
+            reported++;
         }
     }
+    return reported;
 }
@@ -0,0 +1,57 @@
+#include "strsort.h"
+
+#include <string.h>
+
+// Multikey quicksort (Bentley and Sedgewick): partitions on one byte at a
+// time, so each step reads a single byte of each name and a shared prefix
+// is never compared twice. The order is strcmp's.
+#define SORT_INSERTION_MAX 12
+
+static inline int byte_at(const char *name, size_t depth) {
+    return (unsigned char)name[depth];
+}
+
+static void sort_from(const char **v, size_t n, size_t depth) {
+    while (n > SORT_INSERTION_MAX) {
+        // Median of three bytes as the pivot
+        int a = byte_at(v[0], depth), b = byte_at(v[n / 2], depth), c = byte_at(v[n - 1], depth);
+        int pivot = (a < b) ? ((b < c) ? b : (a < c) ? c : a) : ((a < c) ? a : (b < c) ? c : b);
+
+        // v[0, lt) below the pivot, v[lt, i) equal to it, v[gt, n) above
+        size_t lt = 0, i = 0, gt = n;
+        while (i < gt) {
+            int ch = byte_at(v[i], depth);
+            if (ch < pivot) {
+                const char *t = v[lt]; v[lt] = v[i]; v[i] = t;
+                lt++;
+                i++;
+            } else if (ch > pivot) {
+                gt--;
+                const char *t = v[gt]; v[gt] = v[i]; v[i] = t;
+            } else {
+                i++;
+            }
+        }
+        sort_from(v, lt, depth);
+        sort_from(v + gt, n - gt, depth);
+        if (pivot == 0) {
+            return; // the middle names are equal
+        }
+        v += lt;
+        n = gt - lt;
+        depth++;
+    }
+    for (size_t i = 1; i < n; i++) {
+        const char *name = v[i];
+        size_t j = i;
+        while (j > 0 && strcmp(v[j - 1] + depth, name + depth) > 0) {
+            v[j] = v[j - 1];
+            j--;
+        }
+        v[j] = name;
+    }
+}
+
+void sort_strings(const char **v, size_t count) {
+    sort_from(v, count, 0);
+}
@@ -0,0 +1,163 @@
+#define _GNU_SOURCE // wait4
+#include "usage.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static void now(struct timespec *ts) {
+    clock_gettime(CLOCK_REALTIME, ts);
+}
+
+void usage_begin(run_usage *u) {
+    memset(u, 0, sizeof(*u));
+    now(&u->started);
+}
+
+pid_t usage_wait(pid_t pid, int *status, int options, run_usage *u) {
+    struct rusage ru;
+    pid_t result = wait4(pid, status, options, &ru);
+    if (result > 0 && u != NULL && (WIFEXITED(*status) || WIFSIGNALED(*status))) {
+        now(&u->ended);
+        u->usage = ru;
+    }
+    return result;
+}
+
+void usage_self(struct rusage *ru) {
+    getrusage(RUSAGE_SELF, ru);
+}
+
+static void timeval_sub(struct timeval *a, const struct timeval *b) {
+    a->tv_sec -= b->tv_sec;
+    a->tv_usec -= b->tv_usec;
+    if (a->tv_usec < 0) {
+        a->tv_sec--;
+        a->tv_usec += 1000000;
+    }
+}
+
+void usage_end_self(run_usage *u, const struct rusage *before) {
+    struct rusage after;
+    getrusage(RUSAGE_SELF, &after);
+    timeval_sub(&after.ru_utime, &before->ru_utime);
+    timeval_sub(&after.ru_stime, &before->ru_stime);
+    after.ru_nvcsw -= before->ru_nvcsw;
+    after.ru_nivcsw -= before->ru_nivcsw;
+    after.ru_minflt -= before->ru_minflt;
+    after.ru_majflt -= before->ru_majflt;
+    now(&u->ended);
+    u->usage = after;
+}
+
+static void ticks_to_timeval(unsigned long long ticks, struct timeval *tv) {
+    long hz = sysconf(_SC_CLK_TCK);
+    tv->tv_sec = (time_t)(ticks / hz);
+    tv->tv_usec = (suseconds_t)((ticks % hz) * 1000000 / hz);
+}
+
+int usage_sample(pid_t pid, run_usage *u) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    // The command name may hold spaces, so fields are counted after ')'
+    char *p = strrchr(buf, ')');
+    unsigned long minflt, majflt;
+    unsigned long long utime, stime;
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %lu %*u %lu %*u %llu %llu",
+                            &minflt, &majflt, &utime, &stime) != 4) {
+        return -1;
+    }
+    u->usage.ru_minflt = (long)minflt;
+    u->usage.ru_majflt = (long)majflt;
+    ticks_to_timeval(utime, &u->usage.ru_utime);
+    ticks_to_timeval(stime, &u->usage.ru_stime);
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    f = fopen(path, "r");
+    if (f == NULL) {
+        return 0;
+    }
+    while (fgets(buf, sizeof(buf), f) != NULL) {
+        sscanf(buf, "VmHWM: %ld", &u->usage.ru_maxrss);
+        sscanf(buf, "voluntary_ctxt_switches: %ld", &u->usage.ru_nvcsw);
+        sscanf(buf, "nonvoluntary_ctxt_switches: %ld", &u->usage.ru_nivcsw);
+    }
+    fclose(f);
+    return 0;
+}
+
+static int before(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+void usage_add(run_usage *total, const run_usage *stage) {
+    if (total->started.tv_sec == 0 || before(&stage->started, &total->started)) {
+        total->started = stage->started;
+    }
+    if (before(&total->ended, &stage->ended)) {
+        total->ended = stage->ended;
+    }
+    struct rusage *t = &total->usage;
+    const struct rusage *s = &stage->usage;
+    t->ru_utime.tv_sec += s->ru_utime.tv_sec;
+    t->ru_utime.tv_usec += s->ru_utime.tv_usec;
+    t->ru_stime.tv_sec += s->ru_stime.tv_sec;
+    t->ru_stime.tv_usec += s->ru_stime.tv_usec;
+    t->ru_utime.tv_sec += t->ru_utime.tv_usec / 1000000;
+    t->ru_utime.tv_usec %= 1000000;
+    t->ru_stime.tv_sec += t->ru_stime.tv_usec / 1000000;
+    t->ru_stime.tv_usec %= 1000000;
+    if (s->ru_maxrss > t->ru_maxrss) {
+        t->ru_maxrss = s->ru_maxrss;
+    }
+    t->ru_nvcsw += s->ru_nvcsw;
+    t->ru_nivcsw += s->ru_nivcsw;
+    t->ru_minflt += s->ru_minflt;
+    t->ru_majflt += s->ru_majflt;
+}
+
+const char *usage_columns(void) {
+    return "    real     user      sys   maxrss   vcsw  ivcsw   minflt majflt";
+}
+
+static double seconds(const struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+void usage_format(char *buf, size_t len, const run_usage *u) {
+    struct timespec end = u->ended;
+    if (end.tv_sec == 0) {
+        now(&end); // still running: time so far
+    }
+    double real = (end.tv_sec - u->started.tv_sec) + (end.tv_nsec - u->started.tv_nsec) / 1e9;
+
+    // ru_maxrss is in kilobytes
+    char rss[24];
+    long kb = u->usage.ru_maxrss;
+    if (kb >= 10 * 1024 * 1024) {
+        snprintf(rss, sizeof(rss), "%ldG", kb / (1024 * 1024));
+    } else if (kb >= 10 * 1024) {
+        snprintf(rss, sizeof(rss), "%ldM", kb / 1024);
+    } else {
+        snprintf(rss, sizeof(rss), "%ldK", kb);
+    }
+    snprintf(buf, len, "%8.3f %8.3f %8.3f %8s %6ld %6ld %8ld %6ld", real,
+             seconds(&u->usage.ru_utime), seconds(&u->usage.ru_stime), rss,
+             u->usage.ru_nvcsw, u->usage.ru_nivcsw, u->usage.ru_minflt, u->usage.ru_majflt);
+}
+
+void usage_start_time(char *buf, size_t len, const run_usage *u) {
+    struct tm tm;
+    time_t t = u->started.tv_sec;
+    localtime_r(&t, &tm);
+    strftime(buf, len, "%H:%M:%S", &tm);
+}
@@ -0,0 +1,412 @@
+#define _GNU_SOURCE // getdents64
+#include "wildcard.h"
+#include "shell.h"
+#include "arena.h"
+#include "events.h"
+#include "strsort.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define GLOB_DENTS_SIZE (64 << 10)
+#define GLOB_INTERRUPT_EVERY 64 // directories read between Ctrl+C checks
+
+// One '/'-separated piece of a pattern. Names are first filtered on the
+// literal text before the first wildcard and after the last '*', so most
+// entries of a big directory are rejected by two memcmp calls; a component
+// with a single '*' needs nothing more.
+typedef struct {
+    const char *pat;
+    size_t prefix_len;
+    const char *suffix;
+    size_t suffix_len;
+    int literal;  // no wildcard at all: looked up, not listed
+    int globstar; // exactly "**"
+    int single_star;
+} component;
+
+typedef struct {
+    component *comps;
+    int comp_count;
+    int dirs_only; // the pattern ended in '/'
+    char path[PATH_MAX]; // directory being matched, as it will be printed
+    size_t path_len;
+    const char **matches;
+    size_t count;
+    size_t cap;
+    int interrupted;
+} glob_state;
+
+wildcard_stats wildcard_stats_total;
+
+// Returns the ']' closing the bracket expression at p, or NULL if there is
+// none, in which case the '[' is an ordinary character.
+static const char *class_end(const char *p) {
+    p++;
+    if (*p == '!' || *p == '^') p++;
+    if (*p == ']') p++; // a leading ']' is a member
+    for (; *p != '\0'; p++) {
+        if (*p == ']') return p;
+    }
+    return NULL;
+}
+
+static int is_magic(const char *p) {
+    return *p == '*' || *p == '?' || (*p == '[' && class_end(p) != NULL);
+}
+
+static int has_magic(const char *s) {
+    for (; *s != '\0'; s++) {
+        if (is_magic(s)) return 1;
+    }
+    return 0;
+}
+
+static int class_match(const char *p, const char *end, unsigned char c) {
+    p++;
+    int negate = (*p == '!' || *p == '^');
+    if (negate) p++;
+    int found = 0;
+    for (; p < end; p++) {
+        if (p[1] == '-' && p + 2 < end) {
+            if ((unsigned char)p[0] <= c && c <= (unsigned char)p[2]) found = 1;
+            p += 2;
+        } else if ((unsigned char)*p == c) {
+            found = 1;
+        }
+    }
+    return found != negate;
+}
+
+// '*', '?' and bracket expressions, with backtracking only to the most
+// recent '*', so a match costs at most pattern length times name length.
+static int match_component(const char *p, const char *s) {
+    const char *star_p = NULL, *star_s = NULL;
+    while (*s != '\0') {
+        if (*p == '*') {
+            while (*p == '*') p++;
+            star_p = p;
+            star_s = s;
+            continue;
+        }
+        if (*p == '?') {
+            p++;
+            s++;
+            continue;
+        }
+        if (*p == '[') {
+            const char *end = class_end(p);
+            if (end != NULL) {
+                if (class_match(p, end, (unsigned char)*s)) {
+                    p = end + 1;
+                    s++;
+                    continue;
+                }
+                goto backtrack;
+            }
+        }
+        if (*p == *s) {
+            p++;
+            s++;
+            continue;
+        }
+    backtrack:
+        if (star_p == NULL) return 0;
+        p = star_p;
+        s = ++star_s;
+    }
+    while (*p == '*') p++;
+    return *p == '\0';
+}
+
+static void compile_component(component *c, const char *pat) {
+    memset(c, 0, sizeof(*c));
+    c->pat = pat;
+    c->globstar = (strcmp(pat, "**") == 0);
+    const char *first = NULL, *last_star = NULL;
+    int magic = 0;
+    for (const char *p = pat; *p != '\0'; p++) {
+        if (!is_magic(p)) continue;
+        if (first == NULL) first = p;
+        magic++;
+        last_star = (*p == '*') ? p : NULL;
+        if (*p == '[') p = class_end(p);
+    }
+    c->literal = (first == NULL);
+    if (c->literal) return;
+    c->prefix_len = (size_t)(first - pat);
+    if (last_star != NULL) {
+        c->suffix = last_star + 1;
+        c->suffix_len = strlen(c->suffix);
+    }
+    c->single_star = (magic == 1 && last_star != NULL);
+}
+
+static int component_match(const component *c, const char *name) {
+    if (name[0] == '.') {
+        if (c->pat[0] != '.' || name[1] == '\0' || (name[1] == '.' && name[2] == '\0')) {
+            return 0; // hidden names need a literal '.'; '.' and '..' never match
+        }
+    }
+    if (c->prefix_len > 0 && strncmp(name, c->pat, c->prefix_len) != 0) {
+        return 0;
+    }
+    if (c->suffix != NULL) {
+        size_t len = strlen(name);
+        if (len < c->prefix_len + c->suffix_len ||
+            memcmp(name + len - c->suffix_len, c->suffix, c->suffix_len) != 0) {
+            return 0;
+        }
+    }
+    return c->single_star || match_component(c->pat + c->prefix_len, name + c->prefix_len);
+}
+
+static int push_word(glob_state *st, const char *word) {
+    if (st->count == st->cap) {
+        size_t cap = (st->cap == 0) ? 64 : st->cap * 2;
+        const char **grown = realloc(st->matches, cap * sizeof(char *));
+        if (grown == NULL) return -1;
+        st->matches = grown;
+        st->cap = cap;
+    }
+    st->matches[st->count++] = word;
+    return 0;
+}
+
+// Matches are packed into line_arena, the directory path and the name
+// copied side by side, with no allocation of their own.
+static void add_match(glob_state *st, const char *name, int slash) {
+    size_t name_len = strlen(name);
+    char *copy = arena_alloc_packed(&line_arena, st->path_len + name_len + slash + 1);
+    if (copy == NULL || push_word(st, copy) < 0) return;
+    memcpy(copy, st->path, st->path_len);
+    memcpy(copy + st->path_len, name, name_len);
+    if (slash) copy[st->path_len + name_len] = '/';
+    copy[st->path_len + name_len + slash] = '\0';
+}
+
+// follow: whether a symbolic link to a directory counts as one
+static int is_dir(int dir_fd, const char *name, unsigned char type, int follow) {
+    if (type == DT_DIR) return 1;
+    if (type != DT_UNKNOWN && !(type == DT_LNK && follow)) return 0;
+    struct stat st;
+    return fstatat(dir_fd, name, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+static void glob_dir(glob_state *st, int dir_fd, int index, int again);
+
+// Matches the rest of the pattern inside dir_fd's subdirectory name.
+static void descend(glob_state *st, int dir_fd, const char *name, int index, int again) {
+    size_t len = strlen(name);
+    if (st->path_len + len + 2 > sizeof(st->path)) {
+        return;
+    }
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    size_t saved = st->path_len;
+    memcpy(st->path + st->path_len, name, len);
+    st->path[st->path_len + len] = '/';
+    st->path_len += len + 1;
+    glob_dir(st, fd, index, again);
+    st->path_len = saved;
+    close(fd);
+}
+
+// A name that matched component index: the last one adds a path, any
+// other leads into the directory.
+static void matched(glob_state *st, int dir_fd, const char *name, unsigned char type, int index) {
+    if (index == st->comp_count - 1) {
+        if (!st->dirs_only || is_dir(dir_fd, name, type, 1)) add_match(st, name, st->dirs_only);
+    } else if (is_dir(dir_fd, name, type, 1)) {
+        descend(st, dir_fd, name, index + 1, 0);
+    }
+}
+
+// Lists dir_fd once, matching its entries against component index. Below
+// a '**' that is followed by a wildcard component, the same listing also
+// serves the case where '**' matches no further directory.
+static void read_dir(glob_state *st, int dir_fd, int index) {
+    const component *c = &st->comps[index];
+    int last = (index == st->comp_count - 1);
+    const component *next = (c->globstar && !last && !c[1].literal && !c[1].globstar) ? &c[1] : NULL;
+    if (++wildcard_stats_total.dirs_read % GLOB_INTERRUPT_EVERY == 0 && events_interrupted()) {
+        st->interrupted = 1;
+        return;
+    }
+    char *buf = malloc(GLOB_DENTS_SIZE);
+    if (buf == NULL) {
+        return;
+    }
+    ssize_t n;
+    while (!st->interrupted && (n = getdents64(dir_fd, buf, GLOB_DENTS_SIZE)) > 0) {
+        for (ssize_t off = 0; off < n;) {
+            struct dirent64 *d = (struct dirent64 *)(buf + off);
+            off += d->d_reclen;
+            const char *name = d->d_name;
+            if (!c->globstar) {
+                if (component_match(c, name)) matched(st, dir_fd, name, d->d_type, index);
+                continue;
+            }
+            if (next != NULL && component_match(next, name)) {
+                matched(st, dir_fd, name, d->d_type, index + 1);
+            }
+            // '**' itself: every directory, and under a trailing '**' every name
+            if (name[0] == '.') continue;
+            int dir = is_dir(dir_fd, name, d->d_type, 0);
+            if (last && (!st->dirs_only || dir || is_dir(dir_fd, name, d->d_type, 1))) {
+                add_match(st, name, st->dirs_only);
+            }
+            if (dir) descend(st, dir_fd, name, index, 1);
+        }
+    }
+    free(buf);
+}
+
+// again: dir_fd was reached by '**' at index matching one more directory
+static void glob_dir(glob_state *st, int dir_fd, int index, int again) {
+    if (st->interrupted) {
+        return;
+    }
+    const component *c = &st->comps[index];
+    int last = (index == st->comp_count - 1);
+    if (c->literal) {
+        if (!last) {
+            descend(st, dir_fd, c->pat, index + 1, 0);
+        } else {
+            struct stat sb;
+            if (fstatat(dir_fd, c->pat, &sb, st->dirs_only ? 0 : AT_SYMLINK_NOFOLLOW) == 0 &&
+                (!st->dirs_only || S_ISDIR(sb.st_mode))) {
+                add_match(st, c->pat, st->dirs_only);
+            }
+        }
+        return;
+    }
+    if (c->globstar) {
+        if (last && !again && st->path_len > 0) {
+            add_match(st, "", 0); // 'dir/**' includes dir/ itself
+        } else if (!last && (c[1].literal || c[1].globstar)) {
+            // '**' matching no directory, when read_dir cannot fold it in
+            glob_dir(st, dir_fd, index + 1, 0);
+            lseek(dir_fd, 0, SEEK_SET);
+        }
+    }
+    read_dir(st, dir_fd, index);
+}
+
+// Expands one pattern, appending its sorted matches to st->matches.
+static void expand_pattern(glob_state *st, const char *pattern) {
+    size_t len = strlen(pattern);
+    char *copy = arena_strndup(&line_arena, pattern, len);
+    component *comps = arena_alloc(&line_arena, (len / 2 + 1) * sizeof(component));
+    if (copy == NULL || comps == NULL) {
+        return;
+    }
+    st->comps = comps;
+    st->comp_count = 0;
+    st->dirs_only = (len > 0 && pattern[len - 1] == '/');
+    st->path_len = 0;
+    if (pattern[0] == '/') {
+        st->path[st->path_len++] = '/';
+    }
+    // Repeated slashes separate nothing
+    char *part = copy;
+    while (*part != '\0') {
+        char *slash = strchr(part, '/');
+        if (slash != NULL) *slash = '\0';
+        if (*part != '\0') compile_component(&comps[st->comp_count++], part);
+        if (slash == NULL) break;
+        part = slash + 1;
+    }
+    if (st->comp_count == 0) {
+        return;
+    }
+
+    int dir_fd = open(pattern[0] == '/' ? "/" : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        return;
+    }
+    size_t first = st->count;
+    glob_dir(st, dir_fd, 0, 0);
+    close(dir_fd);
+    sort_strings(st->matches + first, st->count - first);
+}
+
+static int stage_has_magic(const atomic_cmd *stage) {
+    for (int i = 0; i < stage->argc; i++) {
+        if (has_magic(stage->argv[i])) return 1;
+    }
+    return 0;
+}
+
+// A new argv for the stage, or NULL if Ctrl+C stopped the expansion.
+static char **expand_argv(atomic_cmd *stage, int *argc) {
+    glob_state *st = calloc(1, sizeof(glob_state));
+    if (st == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < stage->argc && !st->interrupted; i++) {
+        size_t before = st->count;
+        if (has_magic(stage->argv[i])) {
+            wildcard_stats_total.patterns++;
+            expand_pattern(st, stage->argv[i]);
+            wildcard_stats_total.matches += st->count - before;
+        }
+        if (st->count == before) {
+            push_word(st, stage->argv[i]); // no match: the word stays as typed
+        }
+    }
+
+    char **argv = NULL;
+    if (!st->interrupted) {
+        argv = arena_alloc(&line_arena, (st->count + 1) * sizeof(char *));
+    }
+    if (argv != NULL) {
+        memcpy(argv, st->matches, st->count * sizeof(char *));
+        argv[st->count] = NULL;
+        *argc = (int)st->count;
+    }
+    free(st->matches);
+    free(st);
+    return argv;
+}
+
+cmd_group *expand_wildcards(cmd_group *group) {
+    int any = 0;
+    for (atomic_cmd *stage = group->stages; stage != NULL && !any; stage = stage->next) {
+        any = stage_has_magic(stage);
+    }
+    if (!any) {
+        return group;
+    }
+
+    shell_interrupted = 0;
+    cmd_group *copy = arena_alloc(&line_arena, sizeof(cmd_group));
+    if (copy == NULL) {
+        return NULL;
+    }
+    *copy = *group;
+    atomic_cmd **tail = &copy->stages;
+    for (atomic_cmd *stage = group->stages; stage != NULL; stage = stage->next) {
+        atomic_cmd *next = arena_alloc(&line_arena, sizeof(atomic_cmd));
+        if (next == NULL) {
+            return NULL;
+        }
+        *next = *stage;
+        if (stage_has_magic(stage)) {
+            next->argv = expand_argv(stage, &next->argc);
+            if (next->argv == NULL) {
+                return NULL;
+            }
+        }
+        *tail = next;
+        tail = &next->next;
+    }
+    return copy;
+}
@@ -0,0 +1,295 @@
+#define _GNU_SOURCE // clone, CLONE_PARENT, MSG_CMSG_CLOEXEC
+#include "zygote.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+// Descriptors passed with each request: the command's stdin, stdout and
+// stderr, and the shell's working directory
+#define ZYGOTE_FDS 4
+
+// Largest path plus argv a request carries; longer commands are spawned
+#define ZYGOTE_ARGS_MAX 65536
+
+typedef struct {
+    pid_t pgid;
+    int argc;
+    int has_path;   // the strings start with a resolved path
+    int has_limits;
+    launch_limits limits;
+} zygote_header;
+
+static pid_t zygote_pid = 0;
+static int zygote_fd = -1;
+
+// --- The helper ---
+
+typedef struct {
+    zygote_header header;
+    char *path;
+    char **argv;
+    int fds[ZYGOTE_FDS];
+} zygote_request;
+
+// Runs in the new child, which shares nothing with the helper but a copy
+// of its memory. It sets up what launch_fork's child does, then execs.
+static int start_command(void *arg) {
+    zygote_request *req = arg;
+    setpgid(0, req->header.pgid);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    for (int fd = 0; fd < 3; fd++) {
+        dup2(req->fds[fd], fd);
+    }
+    if (fchdir(req->fds[3]) < 0) {
+        perror("zygote: fchdir");
+    }
+    if (req->header.has_limits) {
+        launch_apply_limits(&req->header.limits);
+    }
+    if (req->path != NULL) {
+        execv(req->path, req->argv);
+    }
+    execvp(req->argv[0], req->argv);
+    fprintf(stderr, "Command not found!\n");
+    _exit(EXIT_FAILURE);
+}
+
+// Receives one request. Returns 0 at end of input or on a malformed message.
+static int receive_request(int sock, zygote_request *req, char *strings, char **argv) {
+    char control[CMSG_SPACE(ZYGOTE_FDS * sizeof(int))];
+    struct iovec iov[2] = {
+        { &req->header, sizeof(req->header) },
+        { strings, ZYGOTE_ARGS_MAX },
+    };
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = 2,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+    if (n <= 0) {
+        return 0;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(ZYGOTE_FDS * sizeof(int))) {
+        return 0;
+    }
+    memcpy(req->fds, CMSG_DATA(cmsg), sizeof(req->fds));
+    if ((size_t)n <= sizeof(req->header) || req->header.argc <= 0 ||
+        req->header.argc >= ZYGOTE_ARGS_MAX / 2 || (msg.msg_flags & MSG_TRUNC)) {
+        return 0;
+    }
+
+    // The strings are NUL-terminated back to back: path, then argv
+    char *p = strings;
+    char *end = strings + (n - sizeof(req->header));
+    int count = req->header.argc + (req->header.has_path ? 1 : 0);
+    for (int i = 0; i < count; i++) {
+        char *nul = memchr(p, '\0', (size_t)(end - p));
+        if (nul == NULL) {
+            return 0;
+        }
+        argv[i] = p;
+        p = nul + 1;
+    }
+    argv[count] = NULL;
+    req->path = req->header.has_path ? argv[0] : NULL;
+    req->argv = req->header.has_path ? argv + 1 : argv;
+    return 1;
+}
+
+int zygote_main(int sock) {
+    static char strings[ZYGOTE_ARGS_MAX];
+    static char *argv[ZYGOTE_ARGS_MAX / 2 + 1];
+    static char stack[65536] __attribute__((aligned(16)));
+    zygote_request req;
+
+    while (receive_request(sock, &req, strings, argv)) {
+        // The child runs on its own copy of this stack
+        pid_t pid = clone(start_command, stack + sizeof(stack), CLONE_PARENT | SIGCHLD, &req);
+        int reply = (pid > 0) ? pid : -errno;
+        for (int i = 0; i < ZYGOTE_FDS; i++) {
+            close(req.fds[i]);
+        }
+        if (send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) < 0) {
+            break;
+        }
+    }
+    return 0;
+}
+
+// --- The shell's side ---
+
+int zygote_start(void) {
+    if (zygote_fd >= 0) {
+        return 0;
+    }
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) < 0) {
+        perror("zygote: socketpair");
+        return -1;
+    }
+
+    // A fresh image of the shell binary, in its own process group so
+    // terminal signals meant for jobs never reach it
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_init(&attr);
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawn_file_actions_adddup2(&actions, pair[1], STDIN_FILENO);
+    char exe[PATH_MAX];
+    ssize_t exe_len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (exe_len <= 0) {
+        strcpy(exe, "/proc/self/exe");
+        exe_len = (ssize_t)strlen(exe);
+    }
+    exe[exe_len] = '\0';
+    char *argv[] = { exe, "--zygote", NULL };
+    int err = posix_spawn(&zygote_pid, exe, &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(pair[1]);
+    if (err != 0) {
+        fprintf(stderr, "zygote: %s\n", strerror(err));
+        close(pair[0]);
+        zygote_pid = 0;
+        return -1;
+    }
+    zygote_fd = pair[0];
+    return 0;
+}
+
+void zygote_stop(void) {
+    if (zygote_fd < 0) {
+        return;
+    }
+    close(zygote_fd); // the helper exits at end of input
+    zygote_fd = -1;
+    while (waitpid(zygote_pid, NULL, 0) < 0 && errno == EINTR) {
+    }
+    zygote_pid = 0;
+}
+
+// Sends the request and reads back the pid. Returns ZYGOTE_UNAVAILABLE if
+// the helper has gone away.
+static pid_t send_request(const launch_request *req, const char *strings, size_t len) {
+    zygote_header header;
+    memset(&header, 0, sizeof(header));
+    header.pgid = req->pgid;
+    header.has_path = (req->path != NULL);
+    for (char **arg = req->argv; *arg != NULL; arg++) {
+        header.argc++;
+    }
+    if (req->limits != NULL) {
+        header.has_limits = 1;
+        header.limits = *req->limits;
+    }
+
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cwd < 0) {
+        return ZYGOTE_UNAVAILABLE;
+    }
+    int fds[ZYGOTE_FDS] = {
+        (req->stdin_fd >= 0) ? req->stdin_fd : STDIN_FILENO,
+        (req->stdout_fd >= 0) ? req->stdout_fd : STDOUT_FILENO,
+        STDERR_FILENO,
+        cwd,
+    };
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov[2] = {
+        { &header, sizeof(header) },
+        { (void *)strings, len },
+    };
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = 2,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t n;
+    while ((n = sendmsg(zygote_fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+    }
+    close(cwd);
+    if (n < 0) {
+        return ZYGOTE_UNAVAILABLE;
+    }
+    int reply;
+    while ((n = recv(zygote_fd, &reply, sizeof(reply), 0)) < 0 && errno == EINTR) {
+    }
+    if (n != sizeof(reply)) {
+        return ZYGOTE_UNAVAILABLE;
+    }
+    if (reply < 0) {
+        fprintf(stderr, "%s: %s\n", req->argv[0], strerror(-reply));
+        return -1;
+    }
+    return reply;
+}
+
+pid_t zygote_launch(const launch_request *req) {
+    static char strings[ZYGOTE_ARGS_MAX];
+    size_t len = 0;
+    const char *path = req->path;
+    for (int i = -1; i == -1 || req->argv[i] != NULL; i++) {
+        const char *s = (i < 0) ? path : req->argv[i];
+        if (s == NULL) {
+            continue;
+        }
+        size_t n = strlen(s) + 1;
+        if (len + n > sizeof(strings)) {
+            return ZYGOTE_UNAVAILABLE;
+        }
+        memcpy(strings + len, s, n);
+        len += n;
+    }
+
+    // A helper that died is restarted once
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (zygote_start() < 0) {
+            return ZYGOTE_UNAVAILABLE;
+        }
+        fflush(stdout);
+        pid_t pid = send_request(req, strings, len);
+        if (pid != ZYGOTE_UNAVAILABLE) {
+            if (pid > 0) {
+                // As launch_fork does, so a signal to the group cannot race the child
+                setpgid(pid, (req->pgid != 0) ? req->pgid : pid);
+            }
+            return pid;
+        }
+        zygote_stop();
+    }
+    return ZYGOTE_UNAVAILABLE;
+}